@@ -4,6 +4,8 @@
 
 #include "av_codec.h"
 #include "logger.h"
+#include "annexb.h"
+#include "utils.h"
 
 char startcode[4] = {0x00,0x00,0x00,0x01};
 static void write_to_file(void *data, int len)
@@ -17,26 +19,41 @@ static void write_to_file(void *data, int len)
 
 MediaData::MediaData()
 {
+    buffer_ = nullptr;
     data_ = nullptr;
     datalen_ = 0;
     pts = dts = 0;
+    capture_time = encode_start_time = encode_end_time = 0;
     type_ = -1;
 }
 MediaData::~MediaData()
 {
-    if (data_)
+    if (buffer_)
     {
-        delete[] data_;
+        buffer_->unref();
     }
+    buffer_ = nullptr;
     data_ = nullptr;
     datalen_ = 0;
 }
 
 void MediaData::copyData(uint8_t *data, int len)
 {
-    data_ = new uint8_t[len];
-    memcpy(data_, data, len);
-    datalen_ = len;
+    SharedBuffer *buffer = SHAREDBUFFERPOOL->alloc(data, len);
+    setBuffer(buffer);
+    buffer->unref();
+}
+
+void MediaData::setBuffer(SharedBuffer *buffer)
+{
+    buffer->ref();
+    if (buffer_)
+    {
+        buffer_->unref();
+    }
+    buffer_ = buffer;
+    data_ = buffer->data();
+    datalen_ = buffer->len();
 }
 
 uint8_t* MediaData::getData(int &length)
@@ -91,24 +108,21 @@ VideoMediaPacketData::~VideoMediaPacketData()
 
 void VideoMediaPacketData::copySpspps(uint8_t *data, int len)
 {
-    int i = 4;
-    uint8_t *sps = data + 4;
-    uint8_t *pps;
-    while (i < len)
+    std::vector<Utils::NaluSpan> nalus;
+
+    // extradata is annexb sps and pps
+    Utils::AnnexB::splitNalus(data, len, nalus);
+    if (nalus.size() < 2)
     {
-        if (data[i] == 0x00 && data[i + 1] == 0x00 && data[i + 2] == 0x00 && data[i + 3] == 0x01)
-        {
-            pps = data + i + 4;
-            break;
-        }
-        i++;
+        ELOG("invalid sps pps, nalu num %d\n", (int)nalus.size());
+        return;
     }
-    sps_ = new uint8_t[i - 4];
-    memcpy(sps_, sps, i - 4);
-    spslen_ = i - 4;
-    pps_ = new uint8_t[len - i - 4];
-    memcpy(pps_, pps, len - i - 4);
-    ppslen_ = len - i - 4;
+    sps_ = new uint8_t[nalus[0].len];
+    memcpy(sps_, nalus[0].data, nalus[0].len);
+    spslen_ = nalus[0].len;
+    pps_ = new uint8_t[nalus[1].len];
+    memcpy(pps_, nalus[1].data, nalus[1].len);
+    ppslen_ = nalus[1].len;
 }
 
 uint8_t* VideoMediaPacketData::getSps(int &length)
@@ -123,25 +137,6 @@ uint8_t* VideoMediaPacketData::getPps(int &length)
     return pps_;
 }
 
-VideoMediaPacketData * VideoMediaPacketData::copy()
-{
-    VideoMediaPacketData *pkt = new VideoMediaPacketData();
-    pkt->keyframe_ = keyframe_;
-    if (keyframe_)
-    {
-        pkt->sps_ = new uint8_t[spslen_];
-        memcpy(pkt->sps_, sps_, spslen_);
-        pkt->spslen_ = spslen_;
-        pkt->pps_ = new uint8_t[ppslen_];
-        memcpy(pkt->pps_, pps_, ppslen_);
-        pkt->ppslen_ = ppslen_;
-    }
-    pkt->dts = dts;
-    pkt->pts = pts;
-    pkt->copyData(data_, datalen_);
-    return nullptr;
-}
-
 MediaPacketShareData::MediaPacketData::MediaPacketData() {
     media = nullptr;
     type = 0;
@@ -160,8 +155,8 @@ MediaPacketShareData::MediaPacketShareData() {
 
 MediaPacketShareData::~MediaPacketShareData() {
     if (mediaPacketData) {
-        mediaPacketData->shareCnt--;
-        if (mediaPacketData->shareCnt <= 0) {
+        // share between codec thread and loop thread
+        if (mediaPacketData->shareCnt.fetch_sub(1) <= 1) {
             delete mediaPacketData;
         }
         mediaPacketData = nullptr;
@@ -429,9 +424,20 @@ VideoCodec::VideoCodec(std::string codec_name) {
     decode_codec_ctx = nullptr;
     decode_pkt = nullptr;
     decode_frame = nullptr;
+    input_frame = nullptr;
+    frame_queue_ = nullptr;
+    encode_stop_ = true;
+    memset(encode_timing_, 0, sizeof(encode_timing_));
+    bit_rate_ = 0;
+    pending_bit_rate_ = 0;
 }
 
 VideoCodec::~VideoCodec() {
+    stopEncodeThread();
+    if (input_frame) {
+        av_frame_free(&input_frame);
+        input_frame = nullptr;
+    }
     if (encode_codec_ctx) {
         avcodec_free_context(&encode_codec_ctx);
         encode_codec_ctx = nullptr;
@@ -458,11 +464,11 @@ VideoCodec::~VideoCodec() {
     }
 }
 
-int VideoCodec::initCodec(uint32_t w, uint32_t h, int32_t bitRate, int32_t framerate) {
+int VideoCodec::initCodec(uint32_t w, uint32_t h, int32_t bitRate, int32_t framerate, int threads, int threadType) {
     int ret;
 
     // init encoder
-    ret = initEncodeCodec(w, h, bitRate, framerate);
+    ret = initEncodeCodec(w, h, bitRate, framerate, threads, threadType);
     if (ret < 0)
     {
         return -1;
@@ -480,6 +486,7 @@ int VideoCodec::initCodec(uint32_t w, uint32_t h, int32_t bitRate, int32_t frame
 int VideoCodec::encode(char *yuv, int len, int64_t pts, int64_t dts, std::vector<MediaPacketShareData *> &pkts) {
     int ret;
     int w,h;
+    int64_t now;
 
     av_init_packet(encode_pkt);
     encode_pkt->data = NULL;
@@ -491,8 +498,17 @@ int VideoCodec::encode(char *yuv, int len, int64_t pts, int64_t dts, std::vector
     memcpy(encode_frame->data[1], yuv + w * h, w*h / 4);
     memcpy(encode_frame->data[2], yuv + w * h * 5 / 4, w*h / 4);
     encode_frame->pts = pts;
+    now = Utils::Util::getSteadyTimeUs();
+    setTiming(pts, now, now);
+    applyBitrate();
 
-    ret = avcodec_send_frame(encode_codec_ctx, encode_frame);
+    return sendFrame(encode_frame, pkts);
+}
+
+int VideoCodec::sendFrame(AVFrame *frame, std::vector<MediaPacketShareData *> &pkts) {
+    int ret;
+
+    ret = avcodec_send_frame(encode_codec_ctx, frame);
     if (ret < 0) {
         ELOG("send frame fail\n");
         return -1;
@@ -510,12 +526,170 @@ int VideoCodec::encode(char *yuv, int len, int64_t pts, int64_t dts, std::vector
         // get encode data
         int64_t pts = encode_pkt->pts;
         int64_t dts = encode_pkt->dts;
+        size_t first = pkts.size();
         parseH264(encode_pkt->data, encode_pkt->size, pts, dts, pkts);
+        // packet come out later than its frame when encoder delay, find frame time by pts
+        EncodeTiming &timing = encode_timing_[pts & (VIDEO_ENCODE_TIMING_SLOTS - 1)];
+        int64_t now = Utils::Util::getSteadyTimeUs();
+        for (size_t i = first; i < pkts.size(); i++) {
+            MediaData *media = pkts[i]->mediaPacketData->media;
+            media->capture_time = timing.capture_time;
+            media->encode_start_time = timing.start_time;
+            media->encode_end_time = now;
+        }
         av_packet_unref(encode_pkt);
     }
     return 0;
 }
 
+int VideoCodec::encodeBuffer(EncodeFrame &item, std::vector<MediaPacketShareData *> &pkts) {
+    int ret;
+    int w = encode_codec_ctx->width;
+    int h = encode_codec_ctx->height;
+    uint8_t *yuv = item.buffer->data();
+
+    // encoder reference the captured buffer directly, no plane copy
+    input_frame->buf[0] = av_buffer_create(yuv, item.buffer->len(), &VideoCodec::free_frame_buffer, item.buffer, 0);
+    if (input_frame->buf[0] == nullptr) {
+        ELOG("create frame buffer fail\n");
+        item.buffer->unref();
+        return -1;
+    }
+    input_frame->format = encode_codec_ctx->pix_fmt;
+    input_frame->width = w;
+    input_frame->height = h;
+    input_frame->data[0] = yuv;
+    input_frame->data[1] = yuv + w * h;
+    input_frame->data[2] = yuv + w * h * 5 / 4;
+    input_frame->linesize[0] = w;
+    input_frame->linesize[1] = w / 2;
+    input_frame->linesize[2] = w / 2;
+    input_frame->pts = item.pts;
+    setTiming(item.pts, item.capture_time, Utils::Util::getSteadyTimeUs());
+    applyBitrate();
+    ret = sendFrame(input_frame, pkts);
+    av_frame_unref(input_frame);
+    return ret;
+}
+
+void VideoCodec::setTiming(int64_t pts, int64_t captureTime, int64_t startTime) {
+    EncodeTiming &timing = encode_timing_[pts & (VIDEO_ENCODE_TIMING_SLOTS - 1)];
+    timing.capture_time = captureTime;
+    timing.start_time = startTime;
+}
+
+void VideoCodec::free_frame_buffer(void *opaque, uint8_t *data) {
+    SharedBuffer *buffer = static_cast<SharedBuffer*>(opaque);
+    buffer->unref();
+}
+
+int VideoCodec::startEncodeThread(VideoEncodeCallback callback) {
+    if (encode_thread_.joinable()) {
+        WLOG("encode thread have start\n");
+        return -1;
+    }
+    input_frame = av_frame_alloc();
+    if (input_frame == nullptr) {
+        ELOG("frame alloc fail\n");
+        return -1;
+    }
+    frame_queue_ = new SpscRingQueue<EncodeFrame>(VIDEO_ENCODE_QUEUE_SIZE);
+    encode_callback_ = callback;
+    encode_stop_ = false;
+    encode_thread_ = std::thread(&VideoCodec::encodeThread, this);
+    return 0;
+}
+
+void VideoCodec::stopEncodeThread() {
+    EncodeFrame item;
+
+    if (!encode_thread_.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(encode_mutex_);
+        encode_stop_ = true;
+    }
+    encode_cond_.notify_one();
+    encode_thread_.join();
+    while (frame_queue_->pop(item)) {
+        item.buffer->unref();
+    }
+    delete frame_queue_;
+    frame_queue_ = nullptr;
+}
+
+int VideoCodec::pushFrame(const char *yuv, int len, int64_t pts, int64_t dts) {
+    EncodeFrame item;
+
+    if (frame_queue_ == nullptr) {
+        return -1;
+    }
+    // capture buffer is reused by device, copy once into pooled buffer
+    item.buffer = SHAREDBUFFERPOOL->alloc((const uint8_t*)yuv, len);
+    item.pts = pts;
+    item.dts = dts;
+    item.capture_time = Utils::Util::getSteadyTimeUs();
+    if (!frame_queue_->push(item)) {
+        item.buffer->unref();
+        return -1;
+    }
+    {
+        // take the lock so notify can not fall between predicate check and wait
+        std::lock_guard<std::mutex> lock(encode_mutex_);
+    }
+    encode_cond_.notify_one();
+    return 0;
+}
+
+void VideoCodec::setBitrate(int32_t bitRate) {
+    if (bitRate > 0) {
+        pending_bit_rate_.store(bitRate, std::memory_order_relaxed);
+    }
+}
+
+void VideoCodec::applyBitrate() {
+    int32_t bitRate = pending_bit_rate_.exchange(0, std::memory_order_relaxed);
+
+    if (bitRate == 0 || bitRate == bit_rate_.load(std::memory_order_relaxed)) {
+        return;
+    }
+    // libx264 reconfigure the encoder when it see rate control changed on next frame
+    encode_codec_ctx->bit_rate = bitRate;
+    encode_codec_ctx->rc_max_rate = bitRate;
+    encode_codec_ctx->rc_buffer_size = bitRate;
+    bit_rate_.store(bitRate, std::memory_order_relaxed);
+    ILOG("video encoder bitrate %d\n", bitRate);
+}
+
+void VideoCodec::encodeThread() {
+    EncodeFrame item;
+    std::vector<MediaPacketShareData*> pkts;
+
+    ILOG("start video encode thread\n");
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(encode_mutex_);
+            encode_cond_.wait(lock, [this]() {
+                return encode_stop_ || frame_queue_->size() > 0;
+            });
+            if (encode_stop_) {
+                break;
+            }
+        }
+        while (frame_queue_->pop(item))
+        {
+            encodeBuffer(item, pkts);
+            if (!pkts.empty()) {
+                encode_callback_(pkts);
+                freePackets(pkts);
+            }
+        }
+    }
+    ILOG("stop video encode thread\n");
+}
+
 int VideoCodec::decode(char *data, int len) {
     return 0;
 }
@@ -533,7 +707,7 @@ int VideoCodec::freePackets(std::vector<MediaPacketShareData *> &pkts) {
     return 0;
 }
 
-int VideoCodec::initEncodeCodec(uint32_t w, uint32_t h, int32_t bitRate, int32_t framerate) {
+int VideoCodec::initEncodeCodec(uint32_t w, uint32_t h, int32_t bitRate, int32_t framerate, int threads, int threadType) {
     int ret;
 
     // init encoder
@@ -550,6 +724,9 @@ int VideoCodec::initEncodeCodec(uint32_t w, uint32_t h, int32_t bitRate, int32_t
     encode_codec_ctx->width = w;
     encode_codec_ctx->height = h;
     encode_codec_ctx->bit_rate = bitRate;
+    // x264 can only change bitrate later when vbv is on, buffer hold 1 second
+    encode_codec_ctx->rc_max_rate = bitRate;
+    encode_codec_ctx->rc_buffer_size = bitRate;
     encode_codec_ctx->framerate = (AVRational) { framerate, 1 };;
     encode_codec_ctx->has_b_frames = 0;
     encode_codec_ctx->max_b_frames = 0;
@@ -559,6 +736,8 @@ int VideoCodec::initEncodeCodec(uint32_t w, uint32_t h, int32_t bitRate, int32_t
     encode_codec_ctx->level = 0x1f;
     encode_codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
     encode_codec_ctx->time_base = (AVRational) { 1, framerate};
+    encode_codec_ctx->thread_count = threads;
+    encode_codec_ctx->thread_type = (threadType == VIDEO_CODEC_THREAD_SLICE) ? FF_THREAD_SLICE : FF_THREAD_FRAME;
     ret = avcodec_open2(encode_codec_ctx, video_codec, NULL);
     if (ret < 0) {
         av_strerror(ret, av_errors, 1024);
@@ -583,6 +762,7 @@ int VideoCodec::initEncodeCodec(uint32_t w, uint32_t h, int32_t bitRate, int32_t
         ELOG("pkg alloc fail\n");
         return -1;
     }
+    bit_rate_ = bitRate;
     return 0;
     return 0;
 }
@@ -592,78 +772,51 @@ int VideoCodec::initDecodeCodec() {
 }
 
 void VideoCodec::parseH264(uint8_t *h264, int len, int64_t pts, int64_t dts, std::vector<MediaPacketShareData *> &pkts) {
-    int i = 0;
-    std::vector<uint8_t> nalus;
-    uint8_t naluHeader;
-    uint8_t nalType;
-    bool findStartCode = false;
-
-    nalus.clear();
-    while (i < len)
+    std::vector<Utils::NaluSpan> nalus;
+    VideoMediaPacketData *media;
+    SharedBuffer *buffer;
+    uint8_t *p;
+    int total = 0;
+
+    // all nalus of one encoder packet (several slices in slice thread mode) are copied
+    // once into one pooled buffer as avcc, so the frame go out as one rtmp tag with
+    // one timestamp. the buffer headroom is left for rtmp tag header
+    Utils::AnnexB::splitNalus(h264, len, nalus);
+    if (nalus.empty())
     {
-        if (h264[i] == 0x00 && h264[i + 1] == 0x00 && h264[i + 2] == 0x01 && (i + 2) < len)
-        {
-            // start code 0x00 0x00 0x01
-            i += 3;
-            findStartCode = true;
-        }
-        else if (h264[i] == 0x00 && h264[i + 1] == 0x00 && h264[i + 2] == 0x00 && h264[i + 3] == 0x01 && (i + 3) < len)
-        {
-            // start code 0x00 0x00 0x00 0x01
-            i += 4;
-            findStartCode = true;
-        }
-        else
-        {
-            findStartCode = false;
-            nalus.push_back(h264[i]);
-            i++;
-        }
-        if (findStartCode)
-        {
-            if (!nalus.empty())
-            {
-                VideoMediaPacketData *media = new VideoMediaPacketData();
-                media->copyData(&nalus[0], nalus.size());
-                media->pts = pts;
-                media->dts = dts;
-                naluHeader = nalus[0];
-                nalType = naluHeader & 0x1f;
-                if (nalType == 5)
-                {
-                    media->keyframe_ = true;
-                    media->copySpspps(encode_codec_ctx->extradata, encode_codec_ctx->extradata_size);
-                    //write_to_file(encode_codec_ctx->extradata, encode_codec_ctx->extradata_size);
-                }
-                //write_to_file(startcode, 4);
-                //write_to_file(&nalus[0], nalus.size());
-                MediaPacketShareData *data = new MediaPacketShareData();
-                data->create(media, 1);
-                pkts.push_back(data);
-                nalus.clear();
-            }
-        }
+        return;
     }
-    if (!nalus.empty())
+    for (auto iter = nalus.begin(); iter != nalus.end(); ++iter)
     {
-        VideoMediaPacketData *media = new VideoMediaPacketData();
-        media->copyData(&nalus[0], nalus.size());
-        media->pts = pts;
-        media->dts = dts;
-        naluHeader = nalus[0];
-        nalType = naluHeader & 0x1f;
-        if (nalType == 5)
+        total += 4 + iter->len;
+    }
+    buffer = SHAREDBUFFERPOOL->alloc(total);
+    p = buffer->data();
+    media = new VideoMediaPacketData();
+    for (auto iter = nalus.begin(); iter != nalus.end(); ++iter)
+    {
+        p[0] = (uint8_t)(iter->len >> 24);
+        p[1] = (uint8_t)(iter->len >> 16);
+        p[2] = (uint8_t)(iter->len >> 8);
+        p[3] = (uint8_t)(iter->len);
+        memcpy(p + 4, iter->data, iter->len);
+        p += 4 + iter->len;
+        if ((iter->data[0] & 0x1f) == 5)
         {
             media->keyframe_ = true;
-            media->copySpspps(encode_codec_ctx->extradata, encode_codec_ctx->extradata_size);
-            //write_to_file(encode_codec_ctx->extradata, encode_codec_ctx->extradata_size);
         }
-        //write_to_file(startcode, 4);
-        //write_to_file(&nalus[0], nalus.size());
-        MediaPacketShareData *data = new MediaPacketShareData();
-        data->create(media, 1);
-        pkts.push_back(data);
-        nalus.clear();
     }
-}
-
+    buffer->setLen(total);
+    media->setBuffer(buffer);
+    buffer->unref();
+    media->pts = pts;
+    media->dts = dts;
+    // sequence header once per keyframe, not per idr slice
+    if (media->keyframe_)
+    {
+        media->copySpspps(encode_codec_ctx->extradata, encode_codec_ctx->extradata_size);
+    }
+    MediaPacketShareData *data = new MediaPacketShareData();
+    data->create(media, 1);
+    pkts.push_back(data);
+}
\ No newline at end of file
@@ -7,6 +7,12 @@
 
 #include <string>
 #include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include "DataBuf.h"
 extern "C"
 {
 #include "libavformat/avformat.h"
@@ -26,14 +32,22 @@ public:
     virtual ~MediaData();
 
 public:
+    // copy into pooled buffer
     void copyData(uint8_t *data, int len);
+    // reference buffer, no copy
+    void setBuffer(SharedBuffer *buffer);
     uint8_t* getData(int &length);
 
 public:
+    SharedBuffer *buffer_;
     uint8_t *data_;
     int datalen_;
     int64_t pts;
     int64_t dts;
+    // steady clock us, 0 when not measured
+    int64_t capture_time;
+    int64_t encode_start_time;
+    int64_t encode_end_time;
 
 public:
     int type_;  // 0 audio 1 video
@@ -63,7 +77,6 @@ public:
     void copySpspps(uint8_t *data, int len);
     uint8_t* getSps(int &length);
     uint8_t* getPps(int &length);
-    VideoMediaPacketData *copy();
 
 public:
     bool keyframe_;
@@ -81,7 +94,7 @@ public:
     public:
         MediaData *media;
         int type; // 0 audio 1 video
-        int shareCnt;
+        std::atomic<int> shareCnt;
 
     public:
         MediaPacketData();
@@ -134,22 +147,65 @@ private:
 };
 
 const std::string VIDEO_CODEC_NAME = "libx264";
+
+enum VideoCodecThreadType
+{
+    VIDEO_CODEC_THREAD_FRAME = 1,
+    VIDEO_CODEC_THREAD_SLICE = 2,
+};
+
+// frames wait for encode thread, capture drop frame when full
+const int VIDEO_ENCODE_QUEUE_SIZE = 8;
+// capture and encode time of frames inside encoder, index by pts, power of 2 and larger than encoder delay
+const int VIDEO_ENCODE_TIMING_SLOTS = 64;
+
+// called in encode thread, packets are freed after return
+using VideoEncodeCallback = std::function<void(std::vector<MediaPacketShareData*> &pkts)>;
+
 class VideoCodec
 {
+    struct EncodeFrame
+    {
+        SharedBuffer *buffer;
+        int64_t pts;
+        int64_t dts;
+        int64_t capture_time;
+    };
+    struct EncodeTiming
+    {
+        int64_t capture_time;
+        int64_t start_time;
+    };
 public:
     VideoCodec(std::string codec_name);
     virtual ~VideoCodec();
 
 public:
-    int initCodec(uint32_t w, uint32_t h, int32_t bitRate, int32_t framerate);
+    // threads 0 let encoder decide by cpu count, frame threads add threads-1 frames latency
+    int initCodec(uint32_t w, uint32_t h, int32_t bitRate, int32_t framerate, int threads = 1, int threadType = VIDEO_CODEC_THREAD_FRAME);
     int encode(char *yuv, int len, int64_t pts, int64_t dts, std::vector<MediaPacketShareData*> &pkts);
     int decode(char *data, int len);
     int freePackets(std::vector<MediaPacketShareData*> &pkts);
 
+public:
+    // pipeline mode, pushFrame never block and frames are encoded in order by encode thread
+    int startEncodeThread(VideoEncodeCallback callback);
+    void stopEncodeThread();
+    int pushFrame(const char *yuv, int len, int64_t pts, int64_t dts);
+    // any thread, encoder take the new bitrate before next frame
+    void setBitrate(int32_t bitRate);
+    int32_t bitrate() const { return bit_rate_.load(std::memory_order_relaxed); }
+
 private:
-    int initEncodeCodec(uint32_t w, uint32_t h, int32_t bitRate, int32_t framerate);
+    int initEncodeCodec(uint32_t w, uint32_t h, int32_t bitRate, int32_t framerate, int threads, int threadType);
     int initDecodeCodec();
+    int sendFrame(AVFrame *frame, std::vector<MediaPacketShareData*> &pkts);
+    void setTiming(int64_t pts, int64_t captureTime, int64_t startTime);
+    void applyBitrate();
+    int encodeBuffer(EncodeFrame &item, std::vector<MediaPacketShareData*> &pkts);
+    void encodeThread();
     void parseH264(uint8_t *h264, int len, int64_t pts, int64_t dts, std::vector<MediaPacketShareData*> &pkts);
+    static void free_frame_buffer(void *opaque, uint8_t *data);
 
 private:
     std::string codec_name_;
@@ -164,6 +220,18 @@ private:
     AVPacket *decode_pkt;
 
     char av_errors[1024];
+
+private:
+    AVFrame *input_frame;
+    SpscRingQueue<EncodeFrame> *frame_queue_;
+    VideoEncodeCallback encode_callback_;
+    std::thread encode_thread_;
+    std::mutex encode_mutex_;
+    std::condition_variable encode_cond_;
+    bool encode_stop_;
+    EncodeTiming encode_timing_[VIDEO_ENCODE_TIMING_SLOTS];
+    std::atomic<int32_t> bit_rate_;
+    std::atomic<int32_t> pending_bit_rate_;  // 0 no change
 };
 
 
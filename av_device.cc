@@ -4,6 +4,13 @@
 
 #include "av_device.h"
 #include "logger.h"
+#include "utils.h"
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 static void write_to_file(void *data, int len)
 {
@@ -13,52 +20,23 @@ static void write_to_file(void *data, int len)
     fclose(fp);
 }
 
-static uint32_t currentPos = 0;
-static void generalPcmData(void *audio_samples, int32_t num_samples, int32_t sampleRate)
-{
-    //int16_t *samples = nullptr;
-    //int16_t *ptr16Out = nullptr;
-    //int16_t *ptr16In = nullptr;
-    //float first = 0;
-    //float tincr = 2 * M_PI * 110.0 / sampleRate;
-    ///* increment frequency by 110 Hz per second */
-    //float tincr2 = 2 * M_PI * 110.0 / sampleRate / sampleRate;
-
-    //ptr16Out = (int16_t *)audio_samples;
-    //for (int i = 0; i < num_samples; i++) {
-    //	*ptr16Out = (int16_t)(sin(first) * 10000); // left
-    //	ptr16Out++;
-    //	//*ptr16Out = 0; // right (same as left sample)
-    //	//ptr16Out++;
-    //	first += tincr;
-    //	tincr += tincr2;
-    //}
-    //write_to_file(audio_samples, num_samples * 2);
-    FILE *fp;
-    int16_t *ptr16Out = nullptr;
-
-    fp = fopen("source1_8k.pcm", "r");
-    fseek(fp, currentPos, 0);
-    int16_t sample[160];
-    fread(sample, sizeof(int16_t), 160, fp);
-    currentPos += (160 * sizeof(int16_t));
-    if (currentPos >= 960000)
-    {
-        currentPos = 0;
-    }
-    ptr16Out = (int16_t *)audio_samples;
+static void generalPcmData(void *audio_samples, int32_t num_samples, int32_t sampleRate, double &phase)
+{
+    int16_t *ptr16Out = (int16_t *)audio_samples;
+    double tincr = 2 * M_PI * 440.0 / sampleRate;
+
     for (int i = 0; i < num_samples; i++) {
-        *ptr16Out = sample[i]; // left
+        *ptr16Out = (int16_t)(sin(phase) * 10000);
         ptr16Out++;
-        //*ptr16Out = sample[i]; // right (same as left sample)
-        //ptr16Out++;
+        phase += tincr;
     }
-    fclose(fp);
-    //write_to_file(audio_samples, num_samples * 2 * 2);
+    if (phase > 2 * M_PI) {
+        phase = fmod(phase, 2 * M_PI);
+    }
+    //write_to_file(audio_samples, num_samples * 2);
 }
 
-static int frameNo = 0;
-static void generalYuvData(uint8_t *yuv, uint32_t w, uint32_t h)
+static void generalYuvData(uint8_t *yuv, uint32_t w, uint32_t h, int &frameNo)
 {
     uint8_t *yuv_y, *yuv_u, *yuv_v;
     int x, y, i;
@@ -88,9 +66,90 @@ static void generalYuvData(uint8_t *yuv, uint32_t w, uint32_t h)
     }
 }
 
+// sleep to next frame deadline, a late frame does not make the following ones burst
+static void waitNextFrame(std::recursive_mutex &mutex, std::condition_variable_any &cond,
+                          std::chrono::steady_clock::time_point &next, std::chrono::microseconds interval)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    next += interval;
+    if (now > next + interval)
+    {
+        next = now;
+    }
+    mutex.lock();
+    cond.wait_until(mutex, next);
+    mutex.unlock();
+}
+
+CaptureFixture::CaptureFixture()
+{
+    data_ = nullptr;
+    size_ = frameSize_ = pos_ = 0;
+}
+
+CaptureFixture::~CaptureFixture()
+{
+    close();
+}
+
+bool CaptureFixture::open(const std::string &filename, size_t frameSize)
+{
+    struct stat st;
+    void *addr;
+    int fd;
+
+    close();
+    fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < frameSize || frameSize == 0)
+    {
+        ::close(fd);
+        return false;
+    }
+    addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED)
+    {
+        return false;
+    }
+    data_ = (uint8_t*)addr;
+    size_ = st.st_size;
+    frameSize_ = frameSize;
+    pos_ = 0;
+    return true;
+}
+
+void CaptureFixture::close()
+{
+    if (data_)
+    {
+        munmap(data_, size_);
+        data_ = nullptr;
+    }
+    size_ = pos_ = 0;
+}
+
+const uint8_t* CaptureFixture::nextFrame()
+{
+    const uint8_t *frame;
+
+    if (pos_ + frameSize_ > size_)
+    {
+        pos_ = 0;
+    }
+    frame = data_ + pos_;
+    pos_ += frameSize_;
+    return frame;
+}
+
 BaseDevices::BaseDevices(std::string deviceName) : deviceName_(deviceName)
 {
     bInit_ = false;
+    captureStartTime_ = 0;
 }
 
 BaseDevices::~BaseDevices()
@@ -131,6 +190,7 @@ AudioDevices::AudioDevices(std::string deviceName, uint32_t sampleRate, int32_t
     audio_callback_ = nullptr;
     start_ = false;
     pcmPlayData_ = pcmRecordData_ = nullptr;
+    tonePhase_ = 0;
     //pNS_inst = nullptr;
 }
 
@@ -210,6 +270,10 @@ int AudioDevices::InitRecordDevice()
     int32_t nBytesPerSample = nBitsPerSample_ / 8;
     int32_t nSamplePerFrame = nSampleRate_ / (1000 / nFrameDuration_);
     pcmRecordData_ = new char[nBytesPerSample * nSamplePerFrame * nChannels_];
+    if (fixture_.open(deviceName_, nBytesPerSample * nSamplePerFrame * nChannels_))
+    {
+        ILOG("audio capture from %s\n", deviceName_.c_str());
+    }
 
     //��ʼ����������ģ��
     //pNS_inst = WebRtcNsx_Create();
@@ -298,7 +362,15 @@ void AudioDevices::SendRecordFrameData()
     if (audio_callback_ != nullptr)
     {
         int32_t nSamplePerFrame = nSampleRate_ / (1000 / nFrameDuration_);
-        generalPcmData(pcmRecordData_, nSamplePerFrame, nSampleRate_);
+        captureStartTime_ = Utils::Util::getSteadyTimeUs();
+        if (fixture_.valid())
+        {
+            memcpy(pcmRecordData_, fixture_.nextFrame(), nBitsPerSample_ / 8 * nSamplePerFrame * nChannels_);
+        }
+        else
+        {
+            generalPcmData(pcmRecordData_, nSamplePerFrame, nSampleRate_, tonePhase_);
+        }
         //int16_t *srcData = new int16_t[nSamplePerFrame];
         //memcpy(srcData, pcmRecordData_, nSamplePerFrame * sizeof(int16_t));
         //WebRtcNsx_Process(pNS_inst, &srcData, 1, (short* const*)(&pcmRecordData_));
@@ -315,6 +387,8 @@ void AudioDevices::SendRecordFrameData()
 
 void AudioDevices::AudioDeviceThread()
 {
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+
     ILOG("start audio device thread\n");
     while (start_)
     {
@@ -336,9 +410,7 @@ void AudioDevices::AudioDeviceThread()
                 break;
             }
         }
-        sleepMutex_.lock();
-        audioThreadCond_.wait_for(sleepMutex_, std::chrono::milliseconds(5 - 1));
-        sleepMutex_.unlock();
+        waitNextFrame(sleepMutex_, audioThreadCond_, next, std::chrono::microseconds(nFrameDuration_ * 1000));
     }
     ILOG("audio device thread end\n");
 }
@@ -355,6 +427,7 @@ VideoDevices::VideoDevices(std::string deviceName, uint32_t width, uint32_t heig
     video_callback_ = nullptr;
     start_ = false;
     yuvData_ = nullptr;
+    frameNo_ = 0;
 }
 
 VideoDevices::~VideoDevices()
@@ -399,6 +472,10 @@ bool VideoDevices::Playing() const
 int VideoDevices::InitRecordDevice()
 {
     yuvData_ = new uint8_t[mWidth_*mHeight_ * 3 / 2];
+    if (fixture_.open(deviceName_, mWidth_*mHeight_ * 3 / 2))
+    {
+        ILOG("video capture from %s\n", deviceName_.c_str());
+    }
     rec_is_initialized_ = true;
     return 0;
 }
@@ -446,7 +523,15 @@ void VideoDevices::SendRecordFrameData()
     int ret = 0;
     if (video_callback_ != nullptr)
     {
-        generalYuvData(yuvData_, mWidth_, mHeight_);
+        captureStartTime_ = Utils::Util::getSteadyTimeUs();
+        if (fixture_.valid())
+        {
+            memcpy(yuvData_, fixture_.nextFrame(), mWidth_*mHeight_ * 3 / 2);
+        }
+        else
+        {
+            generalYuvData(yuvData_, mWidth_, mHeight_, frameNo_);
+        }
         //write_to_file(yuvData_, mWidth_*mHeight_ * 3 / 2);
         ret = video_callback_->YuvDataIsAvailable(yuvData_, mWidth_*mHeight_ * 3 / 2, mWidth_, mHeight_);
         if (ret != 0)
@@ -459,6 +544,8 @@ void VideoDevices::SendRecordFrameData()
 
 void VideoDevices::VideoDeviceThread()
 {
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+
     ILOG("start video device thread\n");
     while (start_)
     {
@@ -480,9 +567,7 @@ void VideoDevices::VideoDeviceThread()
                 break;
             }
         }
-        sleepMutex_.lock();
-        videoThreadCond_.wait_for(sleepMutex_, std::chrono::milliseconds(20 - 1));
-        sleepMutex_.unlock();
+        waitNextFrame(sleepMutex_, videoThreadCond_, next, std::chrono::microseconds(1000000 / mFrameRate_));
     }
     ILOG("audio device thread end\n");
 }
@@ -9,6 +9,7 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <cstdint>
 //#include "noise_suppression_x.h"
 
 enum DeviceType
@@ -47,6 +48,27 @@ public:
     virtual ~VideoDataTransport() = default;
 };
 
+// pcm or yuv file mapped once, capture thread read frame by frame and loop at end
+class CaptureFixture
+{
+public:
+    CaptureFixture();
+    ~CaptureFixture();
+
+public:
+    // false when file can not be mapped or is smaller than one frame
+    bool open(const std::string &filename, size_t frameSize);
+    void close();
+    bool valid() const { return data_ != nullptr; }
+    const uint8_t* nextFrame();
+
+private:
+    uint8_t *data_;
+    size_t size_;
+    size_t frameSize_;
+    size_t pos_;
+};
+
 class BaseDevices
 {
 public:
@@ -70,10 +92,15 @@ public:
     virtual void registerAudioCallback(AudioDataTransport *callback);
     virtual void registerVideoCallback(VideoDataTransport *callback);
 
+public:
+    // steady us when capture of current frame begin, read it in data callback
+    int64_t captureStartTime() const { return captureStartTime_; }
+
 protected:
     std::string deviceName_;
     std::string deviceType_;
     bool bInit_;
+    int64_t captureStartTime_;
 };
 
 class AudioDevices : public BaseDevices
@@ -116,6 +143,9 @@ private:
     int32_t nFrameDuration_;
     char *pcmRecordData_;
     char *pcmPlayData_;
+    // device name is a pcm file, tone is generated when it can not be opened
+    CaptureFixture fixture_;
+    double tonePhase_;
 
     AudioDataTransport *audio_callback_;
 
@@ -169,6 +199,9 @@ private:
     uint32_t mFrameRate_;
     int32_t nFrameDuration_;
     uint8_t *yuvData_;
+    // device name is an i420 file, test pattern is generated when it can not be opened
+    CaptureFixture fixture_;
+    int frameNo_;
 
     VideoDataTransport *video_callback_;
 
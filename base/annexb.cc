@@ -0,0 +1,145 @@
+#include "annexb.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define ANNEXB_USE_SSE2 1
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ANNEXB_USE_AVX2 1
+#endif
+#endif
+
+namespace Utils {
+
+	const uint8_t AnnexB::START_CODE[4] = {0x00, 0x00, 0x00, 0x01};
+
+	// return position of 0x00 0x00 0x01 at or after pos, len if not found
+	static int find_start_code_c(const uint8_t *buf, int pos, int len)
+	{
+		for (int i = pos; i + 3 <= len; i++)
+		{
+			// buf[i+2] > 1 mean no start code can begin at i, i+1 or i+2
+			if (buf[i + 2] > 1)
+			{
+				i += 2;
+				continue;
+			}
+			if (buf[i] == 0x00 && buf[i + 1] == 0x00 && buf[i + 2] == 0x01)
+			{
+				return i;
+			}
+		}
+		return len;
+	}
+
+#if ANNEXB_USE_SSE2
+	static int find_start_code_sse2(const uint8_t *buf, int pos, int len)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i one = _mm_set1_epi8(1);
+		int i = pos;
+
+		// compare 16 positions at once, b0 b1 b2 are the 3 bytes of start code
+		for (; i + 16 + 2 <= len; i += 16)
+		{
+			__m128i b0 = _mm_loadu_si128((const __m128i*)(buf + i));
+			__m128i b1 = _mm_loadu_si128((const __m128i*)(buf + i + 1));
+			__m128i b2 = _mm_loadu_si128((const __m128i*)(buf + i + 2));
+			__m128i m = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)), _mm_cmpeq_epi8(b2, one));
+			int mask = _mm_movemask_epi8(m);
+			if (mask)
+			{
+				return i + __builtin_ctz(mask);
+			}
+		}
+		return find_start_code_c(buf, i, len);
+	}
+#endif
+
+#if ANNEXB_USE_AVX2
+	__attribute__((target("avx2")))
+	static int find_start_code_avx2(const uint8_t *buf, int pos, int len)
+	{
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i one = _mm256_set1_epi8(1);
+		int i = pos;
+
+		for (; i + 32 + 2 <= len; i += 32)
+		{
+			__m256i b0 = _mm256_loadu_si256((const __m256i*)(buf + i));
+			__m256i b1 = _mm256_loadu_si256((const __m256i*)(buf + i + 1));
+			__m256i b2 = _mm256_loadu_si256((const __m256i*)(buf + i + 2));
+			__m256i m = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero), _mm256_cmpeq_epi8(b1, zero)), _mm256_cmpeq_epi8(b2, one));
+			uint32_t mask = (uint32_t)_mm256_movemask_epi8(m);
+			if (mask)
+			{
+				return i + __builtin_ctz(mask);
+			}
+		}
+		return find_start_code_sse2(buf, i, len);
+	}
+#endif
+
+	typedef int (*FindStartCodeFunc)(const uint8_t *buf, int pos, int len);
+
+	static FindStartCodeFunc select_find_start_code()
+	{
+#if ANNEXB_USE_AVX2
+		if (__builtin_cpu_supports("avx2"))
+		{
+			return find_start_code_avx2;
+		}
+#endif
+#if ANNEXB_USE_SSE2
+		return find_start_code_sse2;
+#else
+		return find_start_code_c;
+#endif
+	}
+
+	static const FindStartCodeFunc find_start_code = select_find_start_code();
+
+	int AnnexB::findStartCode(const uint8_t *buf, int len, int &startCodeLen)
+	{
+		int pos = find_start_code(buf, 0, len);
+
+		startCodeLen = 0;
+		if (pos >= len)
+		{
+			return len;
+		}
+		startCodeLen = 3;
+		if (pos > 0 && buf[pos - 1] == 0x00)
+		{
+			// start code 0x00 0x00 0x00 0x01
+			pos--;
+			startCodeLen = 4;
+		}
+		return pos;
+	}
+
+	int AnnexB::splitNalus(const uint8_t *buf, int len, std::vector<NaluSpan> &nalus)
+	{
+		int startCodeLen = 0;
+		int pos = 0;
+		int next;
+
+		while (pos < len)
+		{
+			next = pos + findStartCode(buf + pos, len - pos, startCodeLen);
+			if (next > pos)
+			{
+				NaluSpan span;
+				span.data = buf + pos;
+				span.len = next - pos;
+				nalus.push_back(span);
+			}
+			if (next >= len)
+			{
+				break;
+			}
+			pos = next + startCodeLen;
+		}
+		return (int)nalus.size();
+	}
+
+}
@@ -0,0 +1,29 @@
+#ifndef _ANNEXB_H_
+#define _ANNEXB_H_
+
+#include <stdint.h>
+#include <vector>
+
+namespace Utils {
+
+	// one nalu inside an annexb buffer, start code not included
+	struct NaluSpan
+	{
+		const uint8_t *data;
+		int len;
+	};
+
+	class AnnexB {
+	public:
+		static const uint8_t START_CODE[4];
+
+	public:
+		// return offset of first start code, len if not found, startCodeLen is 3 or 4
+		static int findStartCode(const uint8_t *buf, int len, int &startCodeLen);
+		// views into buf, no copy, data before first start code is one nalu too
+		static int splitNalus(const uint8_t *buf, int len, std::vector<NaluSpan> &nalus);
+	};
+
+}
+
+#endif // !_ANNEXB_H_
@@ -1,11 +1,83 @@
 #include "logger.h"
 #include <memory>
 #include <iostream>
+#include <chrono>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
 
 namespace LogCore {
 
 	const std::string LOGTAG = "RTMPCLI";
 
+	// mark ring closed when thread exit, flush thread free it
+	struct LogRingHolder
+	{
+		LogRing *ring = nullptr;
+		~LogRingHolder()
+		{
+			if (ring)
+			{
+				ring->closed_ = true;
+			}
+		}
+	};
+
+	static thread_local LogRingHolder t_ringHolder;
+
+	LogRing::LogRing(int capacity)
+	{
+		capacity_ = capacity;
+		records_ = new LogRecord[capacity];
+		head_ = 0;
+		tail_ = 0;
+		closed_ = false;
+		dropped_ = 0;
+	}
+
+	LogRing::~LogRing()
+	{
+		delete[] records_;
+	}
+
+	LogRecord* LogRing::reserve()
+	{
+		uint32_t tail = tail_.load(std::memory_order_relaxed);
+		if (tail - head_.load(std::memory_order_acquire) >= capacity_)
+		{
+			return nullptr;
+		}
+		return &records_[tail % capacity_];
+	}
+
+	void LogRing::commit()
+	{
+		tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	LogRecord* LogRing::front()
+	{
+		uint32_t head = head_.load(std::memory_order_relaxed);
+		if (head == tail_.load(std::memory_order_acquire))
+		{
+			return nullptr;
+		}
+		return &records_[head % capacity_];
+	}
+
+	void LogRing::pop()
+	{
+		head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	Logger::Logger()
+	{
+		logHandler_m = nullptr;
+		running_ = false;
+		accepting_ = false;
+		producers_ = 0;
+	}
+
 	void Logger::startup()
 	{
 		int ret;
@@ -22,17 +94,156 @@ namespace LogCore {
 			std::cout << "zlog get category error" << std::endl;
 			return;
 		}
+		running_ = true;
+		flushThread_ = std::thread(&Logger::flushThread, this);
+		accepting_ = true;
 	}
 
 	void Logger::shutdown()
 	{
+		// no new record, then wait producers already inside log() commit theirs
+		accepting_ = false;
+		while (producers_.load() != 0)
+		{
+			std::this_thread::yield();
+		}
+		if (running_)
+		{
+			{
+				std::lock_guard<std::mutex> lock(flushMutex_);
+				running_ = false;
+			}
+			flushCond_.notify_one();
+			// flush thread drain all rings before exit
+			flushThread_.join();
+		}
 		zlog_fini();
+		logHandler_m = nullptr;
 	}
 
 	zlog_category_t *Logger::logger()
 	{
-		return logHandler_m;
+		return logHandler_m.load();
 		//return nullptr;
 	}
 
-}
\ No newline at end of file
+	void Logger::log(int level, const char *file, const char *func, long line, const char *fmt, ...)
+	{
+		va_list args;
+		LogRing *ring;
+		LogRecord *record;
+
+		// seq_cst pair with shutdown, either it see this producer or this see not accepting.
+		// log before startup or after shutdown is dropped, zlog may be in fini
+		producers_.fetch_add(1);
+		if (!accepting_.load() || !zlog_level_enabled(logHandler_m.load(), level))
+		{
+			producers_.fetch_sub(1);
+			return;
+		}
+		ring = threadRing();
+		record = ring->reserve();
+		if (record == nullptr)
+		{
+			ring->dropped_.fetch_add(1, std::memory_order_relaxed);
+			producers_.fetch_sub(1);
+			return;
+		}
+		record->level = level;
+		record->line = line;
+		record->file = file;
+		record->func = func;
+		va_start(args, fmt);
+		vsnprintf(record->msg, LOG_RECORD_MSG_SIZE, fmt, args);
+		va_end(args);
+		ring->commit();
+		producers_.fetch_sub(1);
+	}
+
+	bool Logger::allow(std::atomic<int64_t> &last, int intervalMs)
+	{
+		int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+		int64_t prev = last.load(std::memory_order_relaxed);
+		if (prev != 0 && now - prev < intervalMs)
+		{
+			return false;
+		}
+		// only one thread win when several hit the same site together
+		return last.compare_exchange_strong(prev, now, std::memory_order_relaxed);
+	}
+
+	LogRing* Logger::threadRing()
+	{
+		if (t_ringHolder.ring == nullptr)
+		{
+			LogRing *ring = new LogRing(LOG_RING_SIZE);
+			std::lock_guard<std::mutex> lock(ringMutex_);
+			rings_.push_back(ring);
+			t_ringHolder.ring = ring;
+		}
+		return t_ringHolder.ring;
+	}
+
+	bool Logger::flush()
+	{
+		std::vector<LogRing*> rings;
+		bool busy = false;
+
+		{
+			std::lock_guard<std::mutex> lock(ringMutex_);
+			rings = rings_;
+		}
+		for (auto iter = rings.begin(); iter != rings.end(); ++iter)
+		{
+			LogRing *ring = *iter;
+			// read closed before drain, so no record is committed after the last drain
+			bool closed = ring->closed_.load(std::memory_order_acquire);
+			LogRecord *record;
+			uint64_t dropped;
+			while ((record = ring->front()) != nullptr)
+			{
+				zlog(logHandler_m.load(), record->file, strlen(record->file), record->func, strlen(record->func),
+					 record->line, record->level, "%s", record->msg);
+				ring->pop();
+				busy = true;
+			}
+			dropped = ring->dropped_.exchange(0, std::memory_order_relaxed);
+			if (dropped > 0)
+			{
+				zlog(logHandler_m.load(), __FILE__, strlen(__FILE__), __func__, strlen(__func__), __LINE__,
+					 LOG_LEVEL_WARN, "log ring full, drop %d logs\n", (int)dropped);
+			}
+			if (closed)
+			{
+				std::lock_guard<std::mutex> lock(ringMutex_);
+				for (auto it = rings_.begin(); it != rings_.end(); ++it)
+				{
+					if (*it == ring)
+					{
+						rings_.erase(it);
+						break;
+					}
+				}
+				delete ring;
+			}
+		}
+		return busy;
+	}
+
+	void Logger::flushThread()
+	{
+		while (running_)
+		{
+			if (!flush())
+			{
+				std::unique_lock<std::mutex> lock(flushMutex_);
+				flushCond_.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS), [this]() {
+					return !running_;
+				});
+			}
+		}
+		flush();
+	}
+
+}
@@ -3,13 +3,74 @@
 
 #include <memory>
 #include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "singleton.h"
 #include "zlog.h"
 
+// same value as zlog level, usable in preprocessor
+#define LOG_LEVEL_DEBUG   20
+#define LOG_LEVEL_INFO    40
+#define LOG_LEVEL_NOTICE  60
+#define LOG_LEVEL_WARN    80
+#define LOG_LEVEL_ERROR   100
+#define LOG_LEVEL_FATAL   120
+
+// log below this level is removed at compile time, e.g. -DLOG_COMPILE_LEVEL=LOG_LEVEL_INFO
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
 namespace LogCore {
 
+const int LOG_RECORD_MSG_SIZE = 480;
+// records per thread, log is dropped when flush thread can not catch up
+const int LOG_RING_SIZE = 256;
+const int LOG_FLUSH_INTERVAL_MS = 10;
+
+struct LogRecord
+{
+	int level;
+	long line;
+	const char *file;
+	const char *func;
+	char msg[LOG_RECORD_MSG_SIZE];
+};
+
+// one producer thread, consumer is flush thread
+class LogRing
+{
+public:
+	LogRing(int capacity);
+	virtual ~LogRing();
+
+public:
+	// producer get a free record, nullptr when full, then commit after fill it
+	LogRecord* reserve();
+	void commit();
+	// consumer
+	LogRecord* front();
+	void pop();
+
+public:
+	std::atomic<bool> closed_;   // thread exit, free after drain
+	std::atomic<uint64_t> dropped_;
+
+private:
+	LogRecord *records_;
+	uint32_t capacity_;
+	std::atomic<uint32_t> head_;
+	std::atomic<uint32_t> tail_;
+};
+
 class Logger : public core::Singleton<Logger>
 {
+public:
+	Logger();
+
 public:
 	void startup();
 
@@ -17,24 +78,69 @@ public:
 
 	zlog_category_t *logger();
 
+public:
+	// format in caller thread, write to zlog by flush thread
+	void log(int level, const char *file, const char *func, long line, const char *fmt, ...) __attribute__((format(printf, 6, 7)));
+	// true at most once every intervalMs for the same last
+	static bool allow(std::atomic<int64_t> &last, int intervalMs);
+
 private:
-	zlog_category_t *logHandler_m;
+	LogRing* threadRing();
+	void flushThread();
+	bool flush();
+
+private:
+	std::atomic<zlog_category_t*> logHandler_m;
+	std::atomic<bool> running_;
+	// log() only touch rings and zlog while accepting, shutdown wait producers leave before fini
+	std::atomic<bool> accepting_;
+	std::atomic<int> producers_;
+	std::vector<LogRing*> rings_;
+	std::mutex ringMutex_;
+	std::thread flushThread_;
+	std::mutex flushMutex_;
+	std::condition_variable flushCond_;
 };
 
 }
 
-#define DLOG(...) zlog_debug(LogCore::Logger::instance()->logger(), __VA_ARGS__)
-#define ILOG(...) zlog_info(LogCore::Logger::instance()->logger(), __VA_ARGS__)
-#define NLOG(...) zlog_notice(LogCore::Logger::instance()->logger(), __VA_ARGS__)
-#define WLOG(...) zlog_warn(LogCore::Logger::instance()->logger(), __VA_ARGS__)
-#define ELOG(...) zlog_error(LogCore::Logger::instance()->logger(), __VA_ARGS__)
-#define FLOG(...) zlog_fatal(LogCore::Logger::instance()->logger(), __VA_ARGS__)
-
-//#define DLOG(...)
-//#define ILOG(...)
-//#define NLOG(...)
-//#define WLOG(...)
-//#define ELOG(...)
-//#define FLOG(...)
-
-#endif
\ No newline at end of file
+#define LOGCORE_WRITE(level, ...) LogCore::Logger::instance()->log(level, __FILE__, __func__, __LINE__, __VA_ARGS__)
+#define LOGCORE_NONE(...) do {} while (0)
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_DEBUG
+#define DLOG(...) LOGCORE_WRITE(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define DLOG(...) LOGCORE_NONE(__VA_ARGS__)
+#endif
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_INFO
+#define ILOG(...) LOGCORE_WRITE(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define ILOG(...) LOGCORE_NONE(__VA_ARGS__)
+#endif
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_NOTICE
+#define NLOG(...) LOGCORE_WRITE(LOG_LEVEL_NOTICE, __VA_ARGS__)
+#else
+#define NLOG(...) LOGCORE_NONE(__VA_ARGS__)
+#endif
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_WARN
+#define WLOG(...) LOGCORE_WRITE(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define WLOG(...) LOGCORE_NONE(__VA_ARGS__)
+#endif
+#define ELOG(...) LOGCORE_WRITE(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define FLOG(...) LOGCORE_WRITE(LOG_LEVEL_FATAL, __VA_ARGS__)
+
+// log at most once every ms for this call site, e.g. WLOG_RATE(1000, "queue full\n")
+#define LOG_RATE_LIMIT(ms, LOGX, ...) \
+	do { \
+		static std::atomic<int64_t> logcore_last_(0); \
+		if (LogCore::Logger::allow(logcore_last_, ms)) { \
+			LOGX(__VA_ARGS__); \
+		} \
+	} while (0)
+
+#define ILOG_RATE(ms, ...) LOG_RATE_LIMIT(ms, ILOG, __VA_ARGS__)
+#define WLOG_RATE(ms, ...) LOG_RATE_LIMIT(ms, WLOG, __VA_ARGS__)
+#define ELOG_RATE(ms, ...) LOG_RATE_LIMIT(ms, ELOG, __VA_ARGS__)
+
+#endif
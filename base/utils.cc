@@ -2,6 +2,7 @@
 #include "string.h"
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <functional>
 #include <algorithm>
@@ -124,6 +125,13 @@ namespace Utils {
 	  return nowms;
   }
 
+  int64_t Util::getSteadyTimeUs()
+  {
+	  struct timespec ts;
+	  clock_gettime(CLOCK_MONOTONIC, &ts);
+	  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
   char* Util::strDup(char const* str)
   {
 	  if (str == NULL) return NULL;
@@ -24,6 +24,8 @@ namespace Utils {
 	  static uint16_t generalSeq();
 	  static uint16_t generalPort();
 	  static uint32_t getCurrentTimeMs();
+	  // monotonic clock, only for measure duration
+	  static int64_t getSteadyTimeUs();
 	  static char* strDup(char const* str);
 	  static char* strDupSize(char const* str);
   };
@@ -0,0 +1,398 @@
+#include "flv_server.h"
+#include <string.h>
+#include <algorithm>
+#include "rtmpclient.h"
+#include "logger.h"
+#include "netio.h"
+
+// collect remuxed gop cache of new subscriber, sent after cache lock is released
+class FlvReplayConsumer : public IRtmpMediaConsumer
+{
+public:
+    virtual void onMediaTag(const RtmpMediaTag &tag) {
+        FlvTag flv;
+        if (FlvStream::remux(tag, flv)) {
+            tags.push_back(flv);
+        }
+    }
+
+public:
+    std::vector<FlvTag> tags;
+};
+
+FlvSubscriber::FlvSubscriber(uint64_t key, uint64_t id) : key(key), id(id)
+{
+    stream = nullptr;
+    websocket = false;
+    playing = false;
+    closing = false;
+    dropping = false;
+    skip_gops = 0;
+    inflight = 0;
+    start_seq = 0;
+}
+
+FlvStream::FlvStream(FlvFanoutServer *server, const std::string &path, RtmpPlayClient *client) : server_(server), path_(path), client_(client)
+{
+
+}
+
+FlvStream::~FlvStream()
+{
+    subscribers_.clear();
+}
+
+bool FlvStream::remux(const RtmpMediaTag &tag, FlvTag &flv)
+{
+    const uint8_t *body = tag.body->data();
+    int length = tag.body->len();
+    uint8_t *p;
+    std::string wsHeader;
+    WsHeader header;
+
+    if (tag.type == RTMP_MSG_AudioMessage) {
+        flv.type = 8;
+        flv.header = RtmpGopCache::isAudioSequenceHeader(body, length);
+    }
+    else if (tag.type == RTMP_MSG_VideoMessage) {
+        flv.type = 9;
+        flv.header = RtmpGopCache::isVideoSequenceHeader(body, length);
+        flv.keyframe = RtmpGopCache::isVideoKeyframe(body, length);
+    }
+    else if (tag.type == RTMP_MSG_AMF0DataMessage || tag.type == RTMP_MSG_AMF3DataMessage) {
+        flv.type = 18;
+        flv.header = RtmpGopCache::isMetaData(tag.type, body, length);
+        if (tag.type == RTMP_MSG_AMF3DataMessage) {
+            // flv script tag is amf0, skip amf3 format byte
+            body++;
+            length--;
+        }
+    }
+    else {
+        return false;
+    }
+    if (length <= 0) {
+        return false;
+    }
+    flv.seq = tag.seq;
+
+    flv.buffer = SHAREDBUFFERPOOL->alloc(FLV_TAG_HEADER_SIZE + length + FLV_PREV_TAG_SIZE);
+    p = flv.buffer->data();
+    flv_write_tag_header(p, flv.type, length, tag.timestamp);
+    memcpy(p + FLV_TAG_HEADER_SIZE, body, length);
+    write_uint32(p + FLV_TAG_HEADER_SIZE + length, FLV_TAG_HEADER_SIZE + length);
+    flv.buffer->setLen(FLV_TAG_HEADER_SIZE + length + FLV_PREV_TAG_SIZE);
+
+    header.eof = true;
+    header.opcode = BINARY_FRAME;
+    header.len = flv.buffer->len();
+    flv.ws_header_len = header.encode(wsHeader);
+    memcpy(p - flv.ws_header_len, wsHeader.data(), flv.ws_header_len);
+    return true;
+}
+
+void FlvStream::onMediaTag(const RtmpMediaTag &tag)
+{
+    FlvTag flv;
+
+    // remux once here, all subscribers share this buffer
+    if (!remux(tag, flv)) {
+        return;
+    }
+    if (server_->ioLoop()->isLoopThread()) {
+        dispatch(flv);
+    }
+    else {
+        server_->ioLoop()->post([this, flv]() {
+            this->dispatch(flv);
+        });
+    }
+}
+
+void FlvStream::dispatch(const FlvTag &tag)
+{
+    // subscriber may be closed and removed while sending
+    std::vector<FlvSubscriber*> subscribers = subscribers_;
+    for (auto iter = subscribers.begin(); iter != subscribers.end(); ++iter) {
+        // already sent by gop cache replay
+        if (tag.seq != 0 && tag.seq <= (*iter)->start_seq) {
+            continue;
+        }
+        server_->sendTag(*iter, tag, tag.header);
+    }
+    tag.buffer->unref();
+}
+
+void FlvStream::addSubscriber(FlvSubscriber *sub)
+{
+    FlvReplayConsumer replay;
+
+    sub->stream = this;
+    server_->sendFlvHeader(sub);
+    // live tags posted before replay but not yet dispatched are skipped by seq
+    sub->start_seq = client_->replayConsumer(&replay);
+    for (auto iter = replay.tags.begin(); iter != replay.tags.end(); ++iter) {
+        server_->sendTag(sub, *iter, true);
+        iter->buffer->unref();
+    }
+    subscribers_.push_back(sub);
+    ILOG("flv subscriber %lu play %s, replay %d tags, %d subscribers\n", sub->id, path_.c_str(), (int)replay.tags.size(), (int)subscribers_.size());
+}
+
+void FlvStream::removeSubscriber(FlvSubscriber *sub)
+{
+    auto iter = std::find(subscribers_.begin(), subscribers_.end(), sub);
+    if (iter != subscribers_.end()) {
+        subscribers_.erase(iter);
+    }
+    sub->stream = nullptr;
+}
+
+FlvFanoutServer::FlvFanoutServer(uv_loop_t *loop, uint16_t port) : loop_(loop)
+{
+    ioLoop_ = NetCore::NetIoLoop::fromLoop(loop);
+    server_ = new NetCore::TcpSocketServer(loop, port);
+    next_id_ = 1;
+
+    WsHeader header;
+    header.eof = true;
+    header.opcode = BINARY_FRAME;
+    header.len = FLV_HEADER_SIZE;
+    header.encode(ws_flv_header_);
+    ws_flv_header_.append((const char*)flv_header, FLV_HEADER_SIZE);
+}
+
+FlvFanoutServer::~FlvFanoutServer()
+{
+    for (auto iter = streams_.begin(); iter != streams_.end(); ++iter) {
+        (*iter)->client()->detachConsumer(*iter);
+        delete *iter;
+    }
+    streams_.clear();
+    for (auto iter = subscribers_.begin(); iter != subscribers_.end(); ++iter) {
+        delete iter->second;
+    }
+    subscribers_.clear();
+    delete server_;
+}
+
+void FlvFanoutServer::start()
+{
+    server_->setRecvDataCallback(std::bind(&FlvFanoutServer::onRecvData, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4));
+    server_->setCloseCallback(std::bind(&FlvFanoutServer::onClosed, this, std::placeholders::_1, std::placeholders::_2));
+    server_->bindAndStart();
+}
+
+void FlvFanoutServer::addStream(const std::string &path, RtmpPlayClient *client)
+{
+    FlvStream *stream = new FlvStream(this, path, client);
+    streams_.push_back(stream);
+    client->attachConsumer(stream);
+}
+
+void FlvFanoutServer::sendFlvHeader(FlvSubscriber *sub)
+{
+    uv_buf_t buf;
+
+    if (sub->websocket) {
+        buf.base = (char*)ws_flv_header_.data();
+        buf.len = ws_flv_header_.length();
+    }
+    else {
+        buf.base = (char*)flv_header;
+        buf.len = FLV_HEADER_SIZE;
+    }
+    sub->inflight += buf.len;
+    server_->sendDataVec(sub->key, &buf, 1, std::bind(&FlvFanoutServer::onWriteComplete, this, sub->key, sub->id, (int)buf.len, std::placeholders::_1));
+}
+
+bool FlvFanoutServer::sendTag(FlvSubscriber *sub, const FlvTag &tag, bool force)
+{
+    uv_buf_t buf;
+    SharedBuffer *buffer = tag.buffer;
+    uint64_t key = sub->key;
+    uint64_t id = sub->id;
+    int len;
+
+    if (sub->closing) {
+        return false;
+    }
+    if (!force) {
+        if (sub->dropping) {
+            // only restart from keyframe, so player never see a broken gop
+            if (!tag.keyframe) {
+                return false;
+            }
+            if (sub->inflight > FLV_SUBSCRIBER_LOW_WATERMARK) {
+                if (++sub->skip_gops > FLV_SUBSCRIBER_MAX_SKIP_GOPS) {
+                    WLOG_RATE(1000, "flv subscriber %lu too slow, %ld bytes pending, close it\n", sub->id, sub->inflight);
+                    closeSubscriber(sub);
+                }
+                return false;
+            }
+            sub->dropping = false;
+            sub->skip_gops = 0;
+        }
+        else if (sub->inflight > FLV_SUBSCRIBER_HIGH_WATERMARK) {
+            DLOG("flv subscriber %lu congested, %ld bytes pending\n", sub->id, sub->inflight);
+            sub->dropping = true;
+            return false;
+        }
+    }
+
+    if (sub->websocket) {
+        buf.base = (char*)buffer->data() - tag.ws_header_len;
+        buf.len = tag.ws_header_len + buffer->len();
+    }
+    else {
+        buf.base = (char*)buffer->data();
+        buf.len = buffer->len();
+    }
+    len = (int)buf.len;
+    sub->inflight += len;
+    buffer->ref();
+    // sub may be deleted when write fail at once, do not touch it after send
+    server_->sendDataVec(key, &buf, 1, [this, key, id, len, buffer](int status) {
+        buffer->unref();
+        this->onWriteComplete(key, id, len, status);
+    });
+    return true;
+}
+
+void FlvFanoutServer::onWriteComplete(uint64_t key, uint64_t id, int len, int status)
+{
+    auto iter = subscribers_.find(key);
+    if (iter == subscribers_.end() || iter->second->id != id) {
+        return;
+    }
+    iter->second->inflight -= len;
+    // canceled writes mean the connection is already closing
+    if (status < 0 && status != UV_ECANCELED) {
+        closeSubscriber(iter->second);
+    }
+}
+
+void FlvFanoutServer::sendResponse(FlvSubscriber *sub, const std::string &response, bool close)
+{
+    uv_buf_t buf;
+    std::string *data = new std::string(response);
+    uint64_t key = sub->key;
+    uint64_t id = sub->id;
+
+    buf.base = (char*)data->data();
+    buf.len = data->length();
+    server_->sendDataVec(key, &buf, 1, [this, data, key, id, close](int status) {
+        delete data;
+        auto iter = this->subscribers_.find(key);
+        if (close && status != UV_ECANCELED && iter != this->subscribers_.end() && iter->second->id == id) {
+            this->closeSubscriber(iter->second);
+        }
+    });
+}
+
+void FlvFanoutServer::closeSubscriber(FlvSubscriber *sub)
+{
+    if (!sub->closing) {
+        sub->closing = true;
+        server_->close(sub->key);
+    }
+}
+
+void FlvFanoutServer::onRecvData(const char *data, ssize_t len, uint64_t key, NetCore::TcpSocketConn *conn)
+{
+    FlvSubscriber *sub;
+    auto iter = subscribers_.find(key);
+
+    if (iter == subscribers_.end()) {
+        sub = new FlvSubscriber(key, next_id_++);
+        subscribers_[key] = sub;
+    }
+    else {
+        sub = iter->second;
+    }
+    if (sub->closing) {
+        return;
+    }
+    if (sub->playing) {
+        if (sub->websocket) {
+            std::string payload;
+            bool finish;
+            int hlen;
+            WsOpCode opcode;
+            sub->ws.decodeData(data, (int)len, payload, finish, opcode, hlen);
+            if (opcode == CLOSE_FRAME) {
+                DLOG("flv subscriber %lu websocket close\n", sub->id);
+                closeSubscriber(sub);
+            }
+        }
+        return;
+    }
+    sub->request.append(data, len);
+    if (sub->request.find("\r\n\r\n") != std::string::npos) {
+        onRequest(sub);
+    }
+    else if ((int)sub->request.length() > FLV_SERVER_MAX_REQUEST) {
+        WLOG("flv request too large, close %lu\n", sub->id);
+        closeSubscriber(sub);
+    }
+}
+
+void FlvFanoutServer::onRequest(FlvSubscriber *sub)
+{
+    std::string path;
+    FlvStream *stream = nullptr;
+
+    // GET /live/live1.flv?token=xx HTTP/1.1, same parser as websocket handshake
+    if (sub->ws.parseRequest(sub->request) != 0 || sub->ws.getMethod() != 0) {
+        sendResponse(sub, "HTTP/1.1 405 Method Not Allowed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", true);
+        return;
+    }
+    path = sub->ws.getPath();
+    path = path.substr(0, path.find('?'));
+    for (auto iter = streams_.begin(); iter != streams_.end(); ++iter) {
+        if ((*iter)->path() == path) {
+            stream = *iter;
+            break;
+        }
+    }
+    if (stream == nullptr) {
+        WLOG("flv stream %s not found\n", path.c_str());
+        sendResponse(sub, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", true);
+        return;
+    }
+
+    if (sub->ws.isUpgrade()) {
+        std::string response;
+        if (sub->ws.doHandShake(sub->request) != 0) {
+            sendResponse(sub, "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", true);
+            return;
+        }
+        sub->ws.doResponse(response);
+        sub->websocket = true;
+        sendResponse(sub, response, false);
+    }
+    else {
+        sendResponse(sub, "HTTP/1.1 200 OK\r\n"
+                          "Content-Type: video/x-flv\r\n"
+                          "Cache-Control: no-cache\r\n"
+                          "Access-Control-Allow-Origin: *\r\n"
+                          "Connection: close\r\n\r\n", false);
+    }
+    sub->request.clear();
+    sub->playing = true;
+    stream->addSubscriber(sub);
+}
+
+void FlvFanoutServer::onClosed(uint64_t key, NetCore::TcpSocketConn *conn)
+{
+    auto iter = subscribers_.find(key);
+    if (iter != subscribers_.end()) {
+        FlvSubscriber *sub = iter->second;
+        if (sub->stream) {
+            sub->stream->removeSubscriber(sub);
+        }
+        DLOG("flv subscriber %lu closed\n", sub->id);
+        subscribers_.erase(iter);
+        delete sub;
+    }
+}
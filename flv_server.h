@@ -0,0 +1,136 @@
+#ifndef RTMP_CLIENT_FLV_SERVER_H
+#define RTMP_CLIENT_FLV_SERVER_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "net/NetCore.h"
+#include "wsProtocol.h"
+#include "rtmp_gop_cache.h"
+#include "flv_tag.h"
+
+class RtmpPlayClient;
+
+// request larger than this without header end is closed
+const int FLV_SERVER_MAX_REQUEST = 8192;
+// bytes written to socket but not complete, stop sending above high and resume at keyframe below low
+const int FLV_SUBSCRIBER_HIGH_WATERMARK = 1024 * 1024;
+const int FLV_SUBSCRIBER_LOW_WATERMARK = 256 * 1024;
+// close subscriber when it still can not catch up after so many skipped gops
+const int FLV_SUBSCRIBER_MAX_SKIP_GOPS = 3;
+
+// one remuxed flv tag shared by all subscribers, never changed after created
+// buffer data is [tag header][body][prev tag size], websocket frame header is in headroom before it
+struct FlvTag
+{
+    SharedBuffer *buffer;
+    uint8_t type;       // flv tag type, 8 audio 9 video 18 script
+    int ws_header_len;
+    bool keyframe;
+    bool header;    // metadata or sequence header, always sent
+    uint64_t seq;   // seq of rtmp message in gop cache
+
+    FlvTag() {
+        buffer = nullptr;
+        type = 0;
+        ws_header_len = 0;
+        keyframe = false;
+        header = false;
+        seq = 0;
+    }
+};
+
+class FlvFanoutServer;
+class FlvStream;
+
+class FlvSubscriber
+{
+public:
+    FlvSubscriber(uint64_t key, uint64_t id);
+    virtual ~FlvSubscriber() = default;
+
+public:
+    uint64_t key;
+    uint64_t id;
+    FlvStream *stream;
+    bool websocket;
+    bool playing;
+    bool closing;
+    bool dropping;     // congested, wait for keyframe
+    int skip_gops;
+    int64_t inflight;  // bytes in socket write queue
+    uint64_t start_seq;    // live tags up to it were replayed from gop cache
+    std::string request;
+    WebSocketProtocolServer ws;
+};
+
+// live tags of one pulled stream, gop of new subscriber is replayed from gop cache of play client
+// all members are used in server loop thread
+class FlvStream : public IRtmpMediaConsumer
+{
+public:
+    FlvStream(FlvFanoutServer *server, const std::string &path, RtmpPlayClient *client);
+    virtual ~FlvStream();
+
+public:
+    // called by play client thread, remux once and hand over to server loop
+    virtual void onMediaTag(const RtmpMediaTag &tag);
+
+public:
+    void addSubscriber(FlvSubscriber *sub);
+    void removeSubscriber(FlvSubscriber *sub);
+    const std::string& path() const { return path_; }
+    RtmpPlayClient* client() const { return client_; }
+
+public:
+    // rtmp message to flv tag with websocket frame header in headroom, false when not a media tag
+    static bool remux(const RtmpMediaTag &tag, FlvTag &flv);
+
+private:
+    void dispatch(const FlvTag &tag);
+
+private:
+    FlvFanoutServer *server_;
+    std::string path_;
+    RtmpPlayClient *client_;
+    std::vector<FlvSubscriber*> subscribers_;
+};
+
+// http-flv and websocket-flv server, e.g. http://host:port/live/live1.flv
+class FlvFanoutServer
+{
+public:
+    FlvFanoutServer(uv_loop_t *loop, uint16_t port);
+    virtual ~FlvFanoutServer();
+
+public:
+    void start();
+    // call before start, stream stays until server destroy
+    void addStream(const std::string &path, RtmpPlayClient *client);
+
+public:
+    NetCore::NetIoLoop *ioLoop() const { return ioLoop_; }
+    // false when tag is dropped for slow subscriber
+    bool sendTag(FlvSubscriber *sub, const FlvTag &tag, bool force);
+    void sendFlvHeader(FlvSubscriber *sub);
+
+private:
+    void onRecvData(const char *data, ssize_t len, uint64_t key, NetCore::TcpSocketConn *conn);
+    void onClosed(uint64_t key, NetCore::TcpSocketConn *conn);
+    void onRequest(FlvSubscriber *sub);
+    void onWriteComplete(uint64_t key, uint64_t id, int len, int status);
+    void sendResponse(FlvSubscriber *sub, const std::string &response, bool close);
+    void closeSubscriber(FlvSubscriber *sub);
+
+private:
+    uv_loop_t *loop_;
+    NetCore::NetIoLoop *ioLoop_;
+    NetCore::TcpSocketServer *server_;
+    uint64_t next_id_;
+    std::unordered_map<uint64_t, FlvSubscriber*> subscribers_;
+    std::vector<FlvStream*> streams_;
+    // flv header in one websocket binary frame
+    std::string ws_flv_header_;
+};
+
+#endif //RTMP_CLIENT_FLV_SERVER_H
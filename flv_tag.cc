@@ -0,0 +1,21 @@
+#include "flv_tag.h"
+
+const uint8_t flv_header[FLV_HEADER_SIZE] = {
+    'F', 'L', 'V', 0x01, 0x05, 0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x00
+};
+
+int flv_write_tag_header(uint8_t *p, uint8_t type, int length, uint32_t timestamp)
+{
+    p[0] = type;
+    p[1] = (length >> 16) & 0xff;
+    p[2] = (length >> 8) & 0xff;
+    p[3] = length & 0xff;
+    // lower 24 bits then extended byte
+    p[4] = (timestamp >> 16) & 0xff;
+    p[5] = (timestamp >> 8) & 0xff;
+    p[6] = timestamp & 0xff;
+    p[7] = (timestamp >> 24) & 0xff;
+    // stream id
+    p[8] = p[9] = p[10] = 0;
+    return FLV_TAG_HEADER_SIZE;
+}
@@ -0,0 +1,17 @@
+#ifndef RTMP_CLIENT_FLV_TAG_H
+#define RTMP_CLIENT_FLV_TAG_H
+
+#include <stdint.h>
+
+// flv header and PreviousTagSize0
+const int FLV_HEADER_SIZE = 13;
+const int FLV_TAG_HEADER_SIZE = 11;
+const int FLV_PREV_TAG_SIZE = 4;
+
+// flv header with audio and video, followed by PreviousTagSize0
+extern const uint8_t flv_header[FLV_HEADER_SIZE];
+
+// write tag header before body of length, return FLV_TAG_HEADER_SIZE
+int flv_write_tag_header(uint8_t *p, uint8_t type, int length, uint32_t timestamp);
+
+#endif //RTMP_CLIENT_FLV_TAG_H
@@ -1,16 +1,58 @@
 #include <iostream>
+#include <string>
 
 #include "net/NetCore.h"
 #include "base/logger.h"
 #include "rtmpclient.h"
+#include "rtmp_metrics.h"
+#include "flv_server.h"
 
-int main() {
+// usage: rtmp_client [url] [session num] [loop num, 0 one per cpu core] [metrics http port, 0 disable] [flv port, 0 disable]
+int main(int argc, char *argv[]) {
+
+    std::string url = "rtmp://8.135.38.10:1935/live/live1";
+    int sessions = 1;
+    int loops = 0;
+    int metricsPort = 0;
+    int flvPort = 0;
+
+    if (argc > 1) {
+        url = argv[1];
+    }
+    if (argc > 2) {
+        sessions = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        loops = atoi(argv[3]);
+    }
+    if (argc > 4) {
+        metricsPort = atoi(argv[4]);
+    }
+    if (argc > 5) {
+        flvPort = atoi(argv[5]);
+    }
 
     LogCore::Logger::instance()->startup();
 
     ILOG("rtmp client start...\n");
 
-    NETIOMANAGER->init();
+    NETIOMANAGER->init(loops);
+
+    NetCore::HttpServer *metricsServer = nullptr;
+    RtmpMetricsHttpHandle metricsHandle;
+    if (metricsPort > 0) {
+        // prometheus scrape http://host:port/metrics
+        metricsServer = new NetCore::HttpServer(NETIOMANAGER->loop_, metricsPort);
+        metricsServer->registerHandle("/metrics", &metricsHandle);
+        metricsServer->start();
+    }
+
+    FlvFanoutServer *flvServer = nullptr;
+    if (flvPort > 0) {
+        // first session is served at http://host:port/live.flv and ws://host:port/live.flv
+        flvServer = new FlvFanoutServer(NETIOMANAGER->loop_, flvPort);
+        flvServer->start();
+    }
 
 //    RtmpPublishClient *client = new RtmpPublishClient("rtmp://8.135.38.10:1935/live/live1", true);
 //    NetCore::IPAddr addr;
@@ -18,11 +60,30 @@ int main() {
 //    addr.port = 1935;
 //    client->start(640, 480, 400000);
 
-    RtmpPlayClient *client = new RtmpPlayClient("rtmp://8.135.38.10:1935/live/live1", true);
-    client->start(0,0,0);
+    for (int i = 0; i < sessions; i++) {
+        RtmpPlayClient *client = new RtmpPlayClient(url, true);
+        client->setReconnect(true);
+        // recorder and flv server take raw tags from gop cache
+        client->setMediaPassthrough(true);
+        if (sessions == 1) {
+            client->setRecordFile("test.h264");
+        }
+        client->start(0,0,0);
+        if (flvServer && i == 0) {
+            flvServer->addStream("/live.flv", client);
+        }
+    }
 
     NETIOMANAGER->startup();
 
+    if (flvServer) {
+        delete flvServer;
+    }
+    if (metricsServer) {
+        delete metricsServer;
+    }
+    RECORDIOTHREAD->shutdown();
+
     LogCore::Logger::instance()->shutdown();
     return 0;
 }
@@ -188,7 +188,7 @@ DataCacheBuf::DataCacheBuf()
 {
     bytes = new char[MAX_CACHE_LEN];
     nbytes = (MAX_CACHE_LEN);
-    //pos = bytes;
+    pos = bytes;
     length = 0;
 }
 
@@ -202,7 +202,7 @@ DataCacheBuf::~DataCacheBuf()
 
 char* DataCacheBuf::data()
 {
-    return bytes;
+    return pos;
 }
 
 int DataCacheBuf::size()
@@ -232,21 +232,34 @@ void DataCacheBuf::push_data(char *data, int size)
         ILOG("need realloc buffer\n");
         char *temp = new char[length + size + 2048];
         nbytes = (length + size + 2048);
-        memcpy(temp, bytes, length);
+        memcpy(temp, pos, length);
         memcpy(temp+length, data, size);
         length += size;
         delete[] bytes;
         bytes = temp;
+        pos = bytes;
         return;
     }
-    memcpy(bytes+length, data, size);
+    if ((pos - bytes) + length + size > nbytes)
+    {
+        // move left data to head only when tail space is not enough
+        memmove(bytes, pos, length);
+        pos = bytes;
+    }
+    memcpy(pos+length, data, size);
     length += size;
 }
 
 void DataCacheBuf::pop_data(int len)
 {
-    memmove(bytes, bytes+len, length-len);
+    // only move read cursor, data is moved in push_data when needed
+    pos += len;
     length -= len;
+    if (length <= 0)
+    {
+        pos = bytes;
+        length = 0;
+    }
 }
 
 //char DataCacheBuf::read_1byte()
@@ -307,3 +320,128 @@ void DataCacheBuf::pop_data(int len)
 //    memcpy(p, data, size);
 //    p += size;
 //}
+
+SharedBuffer::SharedBuffer(int sizeClass, int capacity) : capacity_(capacity), len_(0), sizeClass_(sizeClass), refCnt_(0)
+{
+	buf_ = new uint8_t[SHARED_BUFFER_HEADROOM + capacity];
+}
+
+SharedBuffer::~SharedBuffer()
+{
+	delete[] buf_;
+}
+
+uint8_t* SharedBuffer::data()
+{
+	return buf_ + SHARED_BUFFER_HEADROOM;
+}
+
+int SharedBuffer::len()
+{
+	return len_;
+}
+
+void SharedBuffer::setLen(int len)
+{
+	len_ = len;
+}
+
+int SharedBuffer::capacity()
+{
+	return capacity_;
+}
+
+int SharedBuffer::headroom()
+{
+	return SHARED_BUFFER_HEADROOM;
+}
+
+void SharedBuffer::ref()
+{
+	refCnt_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void SharedBuffer::unref()
+{
+	if (refCnt_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+	{
+		SHAREDBUFFERPOOL->release(this);
+	}
+}
+
+bool SharedBuffer::unique()
+{
+	return refCnt_.load(std::memory_order_acquire) == 1;
+}
+
+SharedBufferPool::SharedBufferPool()
+{
+
+}
+
+SharedBufferPool::~SharedBufferPool()
+{
+	for (int i = 0; i < SHARED_BUFFER_CLASS_NUM; i++)
+	{
+		for (auto iter = freeList_[i].begin(); iter != freeList_[i].end(); ++iter)
+		{
+			delete *iter;
+		}
+		freeList_[i].clear();
+	}
+}
+
+SharedBuffer* SharedBufferPool::alloc(int size)
+{
+	SharedBuffer *buffer = nullptr;
+	int sizeClass = 0;
+
+	while (sizeClass < SHARED_BUFFER_CLASS_NUM && (256 << sizeClass) < size)
+	{
+		sizeClass++;
+	}
+	if (sizeClass == SHARED_BUFFER_CLASS_NUM)
+	{
+		buffer = new SharedBuffer(-1, size);
+	}
+	else
+	{
+		{
+			std::lock_guard<std::mutex> lock(poolMutex_);
+			if (!freeList_[sizeClass].empty())
+			{
+				buffer = freeList_[sizeClass].back();
+				freeList_[sizeClass].pop_back();
+			}
+		}
+		if (buffer == nullptr)
+		{
+			buffer = new SharedBuffer(sizeClass, 256 << sizeClass);
+		}
+	}
+	buffer->len_ = 0;
+	buffer->refCnt_ = 1;
+	return buffer;
+}
+
+SharedBuffer* SharedBufferPool::alloc(const uint8_t *data, int len)
+{
+	SharedBuffer *buffer = alloc(len);
+	memcpy(buffer->data(), data, len);
+	buffer->len_ = len;
+	return buffer;
+}
+
+void SharedBufferPool::release(SharedBuffer *buffer)
+{
+	if (buffer->sizeClass_ >= 0)
+	{
+		std::lock_guard<std::mutex> lock(poolMutex_);
+		if (freeList_[buffer->sizeClass_].size() < SHARED_BUFFER_MAX_FREE)
+		{
+			freeList_[buffer->sizeClass_].push_back(buffer);
+			return;
+		}
+	}
+	delete buffer;
+}
@@ -1,6 +1,12 @@
 #ifndef _DATA_BUF_H_
 #define _DATA_BUF_H_
 
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "singleton.h"
+
 const int MAX_DATA_LEN = 65535;
 const int MAX_CACHE_LEN = (8 * 1024);
 
@@ -56,4 +62,179 @@ private:
     int length;
 };
 
+// bounded lock free queue, only one producer thread and one consumer thread
+template<typename T>
+class SpscRingQueue
+{
+public:
+	SpscRingQueue(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity)
+		{
+			size <<= 1;
+		}
+		items_.resize(size);
+		mask_ = size - 1;
+		head_ = 0;
+		tail_ = 0;
+	}
+
+public:
+	// call by producer, return false when full
+	bool push(const T &item)
+	{
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		if (tail - head_.load(std::memory_order_acquire) > mask_)
+		{
+			return false;
+		}
+		items_[tail & mask_] = item;
+		tail_.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// call by consumer, return false when empty
+	bool pop(T &item)
+	{
+		size_t head = head_.load(std::memory_order_relaxed);
+		if (head == tail_.load(std::memory_order_acquire))
+		{
+			return false;
+		}
+		item = items_[head & mask_];
+		head_.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	size_t size() const
+	{
+		return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+	}
+
+private:
+	std::vector<T> items_;
+	size_t mask_;
+	// keep producer and consumer index in different cache line
+	char pad0_[64];
+	std::atomic<size_t> head_;
+	char pad1_[64];
+	std::atomic<size_t> tail_;
+};
+
+// unbounded lock free queue, any thread can push and only one consumer thread pop
+template<typename T>
+class MpscQueue
+{
+	struct Node
+	{
+		std::atomic<Node*> next;
+		T item;
+	};
+
+public:
+	MpscQueue()
+	{
+		Node *stub = new Node();
+		stub->next.store(nullptr, std::memory_order_relaxed);
+		head_.store(stub, std::memory_order_relaxed);
+		tail_ = stub;
+	}
+
+	~MpscQueue()
+	{
+		T item;
+		while (pop(item))
+		{
+		}
+		delete tail_;
+	}
+
+public:
+	void push(const T &item)
+	{
+		Node *node = new Node();
+		node->item = item;
+		node->next.store(nullptr, std::memory_order_relaxed);
+		Node *prev = head_.exchange(node, std::memory_order_acq_rel);
+		prev->next.store(node, std::memory_order_release);
+	}
+
+	// call by consumer, false when empty or the next push is not linked yet
+	bool pop(T &item)
+	{
+		Node *tail = tail_;
+		Node *next = tail->next.load(std::memory_order_acquire);
+		if (next == nullptr)
+		{
+			return false;
+		}
+		item = next->item;
+		tail_ = next;
+		delete tail;
+		return true;
+	}
+
+private:
+	std::atomic<Node*> head_;
+	char pad0_[64];
+	Node *tail_;
+};
+
+// bytes reserved before data() so protocol header can be written in place
+const int SHARED_BUFFER_HEADROOM = 32;
+// size class 256 << n, buffer larger than max class is not pooled
+const int SHARED_BUFFER_CLASS_NUM = 15;
+const int SHARED_BUFFER_MAX_FREE = 64;
+
+class SharedBufferPool;
+
+// refcounted buffer, return to pool when last reference unref
+class SharedBuffer
+{
+	friend class SharedBufferPool;
+public:
+	uint8_t *data();
+	int len();
+	void setLen(int len);
+	int capacity();
+	int headroom();
+
+public:
+	void ref();
+	void unref();
+	// caller hold the only reference, buffer can be written again
+	bool unique();
+
+private:
+	SharedBuffer(int sizeClass, int capacity);
+	~SharedBuffer();
+
+private:
+	uint8_t *buf_;
+	int capacity_;
+	int len_;
+	int sizeClass_;
+	std::atomic<int> refCnt_;
+};
+
+class SharedBufferPool : public core::Singleton<SharedBufferPool>
+{
+public:
+	SharedBufferPool();
+	virtual ~SharedBufferPool();
+
+public:
+	// return buffer with refcnt 1 and capacity >= size
+	SharedBuffer* alloc(int size);
+	SharedBuffer* alloc(const uint8_t *data, int len);
+	void release(SharedBuffer *buffer);
+
+private:
+	std::mutex poolMutex_;
+	std::vector<SharedBuffer*> freeList_[SHARED_BUFFER_CLASS_NUM];
+};
+
+#define SHAREDBUFFERPOOL  SharedBufferPool::instance()
+
 #endif
@@ -77,12 +77,42 @@ namespace NetCore
 		sockCb_ = nullptr;
 	}
 
+	bool BaseSocket::isLoopThread()
+	{
+		NetIoLoop *ioLoop = NetIoLoop::fromLoop(loop_);
+		// loop not create by NetIoManager, caller must keep it in loop thread
+		return ioLoop == nullptr || ioLoop->isLoopThread();
+	}
+
+	void BaseSocket::postLoop(AsyncCallback callback)
+	{
+		NetIoLoop *ioLoop = NetIoLoop::fromLoop(loop_);
+		if (ioLoop)
+		{
+			ioLoop->post(callback);
+		}
+		else
+		{
+			callback();
+		}
+	}
+
 	void BaseSocket::init(int type)
 	{
 		buf_ = new char[MAX_DATA_LEN];
 		socketType = type;
 	}
 
+	int BaseSocket::sendDataVec(const uv_buf_t *bufs, int nbufs, OnWriteCompleteCallback callback)
+	{
+		// not support vector write
+		if (callback)
+		{
+			callback(-1);
+		}
+		return -1;
+	}
+
 	void BaseSocket::registerCallback(ISocketCallback *callback)
 	{
 		sockCb_ = callback;
@@ -133,13 +163,32 @@ namespace NetCore
 		conn_req_ = new uv_connect_t;
 		conn_req_->data = this;
 		tcp_->data = this;
+		writeHigh_ = 0;
+		writeLow_ = 0;
+		writeCongested_ = false;
+		rateStartUs_ = 0;
+		rateBytes_ = 0;
+		writeRate_ = 0;
+		writeLatency_ = 0;
+		sendQueue_ = std::make_shared<MpscQueue<TcpPendingWrite*>>();
+		sendScheduled_ = false;
 		init(0);
 		//rbuf_ = new DataRingBuf();
 	}
 
 	TcpSocket::~TcpSocket()
 	{
+		TcpPendingWrite *write;
+
 		DLOG("destroy tcp socket\n");
+		while (sendQueue_->pop(write))
+		{
+			if (write->callback)
+			{
+				write->callback(UV_ECANCELED);
+			}
+			delete write;
+		}
 		if (conn_req_)
 		{
 			delete conn_req_;
@@ -173,40 +222,71 @@ namespace NetCore
 	}
 
 	int TcpSocket::writeData(const char *data, int len)
+	{
+		// caller may reuse data after return, keep a copy until write complete
+		SharedBuffer *buffer = SHAREDBUFFERPOOL->alloc((const uint8_t*)data, len);
+		uv_buf_t buf = uv_buf_init((char*)buffer->data(), len);
+		return writeData(&buf, 1, [buffer](int status) {
+			buffer->unref();
+		});
+	}
+
+	int TcpSocket::writeData(const uv_buf_t *bufs, int nbufs, OnWriteCompleteCallback callback)
 	{
 		uv_write_t *req;
-		uv_buf_t buf;
-		buf.base = const_cast<char*>(data);
-		buf.len = len;
+		int ret;
+		size_t bytes = 0;
+		uint64_t start = uv_hrtime() / 1000;
+		for (int i = 0; i < nbufs; i++)
+		{
+			bytes += bufs[i].len;
+		}
 		req = new uv_write_t;
-		uv_write(req, (uv_stream_t*)tcp_, &buf, 1, [](uv_write_t* req, int status) {
-			if (req)
+		req->data = new OnWriteCompleteCallback([this, callback, bytes, start](int status) {
+			if (status == 0)
 			{
-				delete req;
+				this->sampleWrite(bytes, start);
 			}
-			if (status == UV_ECANCELED)
+			if (callback)
 			{
-				//write error;
+				callback(status);
 			}
+			this->checkWriteWatermark();
 		});
-
+		ret = uv_write(req, (uv_stream_t*)tcp_, bufs, nbufs, [](uv_write_t* req, int status) {
+			auto cb = static_cast<OnWriteCompleteCallback*>(req->data);
+			(*cb)(status);
+			delete cb;
+			delete req;
+		});
+		if (ret < 0)
+		{
+			// uv_write fail will not call write callback
+			auto cb = static_cast<OnWriteCompleteCallback*>(req->data);
+			(*cb)(ret);
+			delete cb;
+			delete req;
+			return -1;
+		}
+		checkWriteWatermark();
 		return 0;
 	}
 
 	int TcpSocket::sendData(const char *data, int len)
 	{
-		if (std::this_thread::get_id() == NETIOMANAGER->mainLoopThreadId_)
+		if (isLoopThread())
 		{
 			writeData(data, len);
 		}
 		else
 		{
-			DLOG("not loop thread\n");
-			sendDataByRawSocket(data, len);
-			//std::string str(data, len);
-			//NETIOMANAGER->postMainLoop([this, str]() {
-			//	this->writeData(str.data(), str.length());
-			//});
+			SharedBuffer *buffer = SHAREDBUFFERPOOL->alloc((const uint8_t*)data, len);
+			TcpPendingWrite *write = new TcpPendingWrite();
+			write->bufs.push_back(uv_buf_init((char*)buffer->data(), len));
+			write->callback = [buffer](int status) {
+				buffer->unref();
+			};
+			enqueueWrite(write);
 		}
 		return 0;
 	}
@@ -220,6 +300,133 @@ namespace NetCore
 		return ret;
 	}
 
+	int TcpSocket::sendDataVec(const uv_buf_t *bufs, int nbufs, OnWriteCompleteCallback callback)
+	{
+		if (isLoopThread())
+		{
+			return writeData(bufs, nbufs, std::move(callback));
+		}
+		TcpPendingWrite *write = new TcpPendingWrite();
+		write->bufs.assign(bufs, bufs + nbufs);
+		write->callback = std::move(callback);
+		enqueueWrite(write);
+		return 0;
+	}
+
+	void TcpSocket::enqueueWrite(TcpPendingWrite *write)
+	{
+		std::weak_ptr<MpscQueue<TcpPendingWrite*>> queue = sendQueue_;
+
+		sendQueue_->push(write);
+		if (!sendScheduled_.exchange(true))
+		{
+			postLoop([this, queue]() {
+				// socket may be destroyed before the drain run
+				if (queue.lock())
+				{
+					this->drainWrites();
+				}
+			});
+		}
+	}
+
+	void TcpSocket::drainWrites()
+	{
+		std::vector<uv_buf_t> bufs;
+		std::vector<OnWriteCompleteCallback> callbacks;
+		TcpPendingWrite *write;
+
+		// clear before pop, so a push after it always schedule another drain
+		sendScheduled_.store(false);
+		while (sendQueue_->pop(write))
+		{
+			bufs.insert(bufs.end(), write->bufs.begin(), write->bufs.end());
+			if (write->callback)
+			{
+				callbacks.push_back(std::move(write->callback));
+			}
+			delete write;
+		}
+		if (bufs.empty())
+		{
+			return;
+		}
+		// all writes of the batch go in one uv_write
+		writeData(&bufs[0], (int)bufs.size(), [callbacks](int status) {
+			for (auto iter = callbacks.begin(); iter != callbacks.end(); ++iter)
+			{
+				(*iter)(status);
+			}
+		});
+	}
+
+	size_t TcpSocket::writeQueueSize()
+	{
+		return uv_stream_get_write_queue_size((uv_stream_t*)tcp_);
+	}
+
+	void TcpSocket::setWriteWatermark(size_t high, size_t low, OnWriteCongestionCallback callback)
+	{
+		writeHigh_ = high;
+		writeLow_ = low;
+		writeCongested_ = false;
+		congestionCb_ = callback;
+	}
+
+	void TcpSocket::checkWriteWatermark()
+	{
+		size_t size;
+
+		if (writeHigh_ == 0)
+		{
+			return;
+		}
+		size = uv_stream_get_write_queue_size((uv_stream_t*)tcp_);
+		if (!writeCongested_ && size >= writeHigh_)
+		{
+			writeCongested_ = true;
+			if (congestionCb_)
+			{
+				congestionCb_(true);
+			}
+		}
+		else if (writeCongested_ && size <= writeLow_)
+		{
+			writeCongested_ = false;
+			if (congestionCb_)
+			{
+				congestionCb_(false);
+			}
+		}
+	}
+
+	void TcpSocket::sampleWrite(size_t bytes, uint64_t startUs)
+	{
+		uint64_t now = uv_hrtime() / 1000;
+		uint64_t latency = writeLatency_.load(std::memory_order_relaxed);
+		uint64_t rate = writeRate_.load(std::memory_order_relaxed);
+		uint64_t sample;
+
+		// smooth like tcp srtt, latency gain 1/8 and rate gain 1/4
+		sample = now - startUs;
+		latency = (latency == 0) ? sample : (latency * 7 + sample) / 8;
+		writeLatency_.store(latency, std::memory_order_relaxed);
+		if (rateBytes_ == 0)
+		{
+			// window start at first write, idle time is not counted
+			rateStartUs_ = startUs;
+		}
+		rateBytes_ += bytes;
+		if (now - rateStartUs_ < TCP_WRITE_RATE_INTERVAL_US)
+		{
+			return;
+		}
+		sample = rateBytes_ * 1000000 / (now - rateStartUs_);
+		rate = (rate == 0) ? sample : (rate * 3 + sample) / 4;
+		writeRate_.store(rate, std::memory_order_relaxed);
+		rateBytes_ = 0;
+	}
+
 	// must call by main loop thread
 	int TcpSocket::close()
 	{
@@ -1007,7 +1214,24 @@ namespace NetCore
 
 	void HttpServer::onHttpGet(std::string &url, std::string &param, HttpResponseWriter *writer)
 	{
-		
+		IHttpServerHandle *handle = nullptr;
+
+		find_handle(url, &handle);
+		if (handle == nullptr)
+		{
+			handle = &http404handle;
+		}
+		if (handle->is_404())
+		{
+			writer->set_response_code(404);
+			handle->http_server_handle(writer, "not found");
+		}
+		else
+		{
+			// get handle receive the query string as data
+			handle->http_server_handle(writer, param);
+		}
+		writer->write(server_);
 	}
 
     void HttpServer::find_handle(std::string &pattern, IHttpServerHandle **handle)
@@ -1135,26 +1359,26 @@ namespace NetCore
 			if (wsProtocol_ && wsProtocol_->isConnected())
 			{
 				wsProtocol_->encodeData(data, len, TEXT_FRAME, dest);
-				if (std::this_thread::get_id() == NETIOMANAGER->mainLoopThreadId_)
+				if (isLoopThread())
 				{
 					writeData(dest.c_str(), dest.length());
 				}
 				else
 				{
-					NETIOMANAGER->postMainLoop([this, dest]() {
+					postLoop([this, dest]() {
 						this->writeData(dest.c_str(), dest.length());
 					});
 				}
 			}
 			else
 			{
-				if (std::this_thread::get_id() == NETIOMANAGER->mainLoopThreadId_)
+				if (isLoopThread())
 				{
 					writeData(data, len);
 				}
 				else
 				{
-					NETIOMANAGER->postMainLoop([this, data, len]() {
+					postLoop([this, data, len]() {
 						this->writeData(data, len);
 					});
 				}
@@ -1168,6 +1392,29 @@ namespace NetCore
 		return 0;
 	}
 
+	int TcpSocketConn::sendDataVec(const uv_buf_t *bufs, int nbufs, OnWriteCompleteCallback callback)
+	{
+		if (tlsTranport_)
+		{
+			return BaseSocket::sendDataVec(bufs, nbufs, std::move(callback));
+		}
+		if (isLoopThread())
+		{
+			return writeData(bufs, nbufs, std::move(callback));
+		}
+		// buffer array may be on caller stack, keep a copy until loop thread write it
+		std::vector<uv_buf_t> vec(bufs, bufs + nbufs);
+		postLoop([this, vec, callback]() {
+			this->writeData(&vec[0], (int)vec.size(), callback);
+		});
+		return 0;
+	}
+
+	size_t TcpSocketConn::writeQueueSize()
+	{
+		return uv_stream_get_write_queue_size((uv_stream_t*)tcp_);
+	}
+
 	int TcpSocketConn::close()
 	{
 		if (wsProtocol_ != nullptr)
@@ -1272,13 +1519,13 @@ namespace NetCore
 
 	void TcpSocketConn::onTlsWriteData(char *data, int len)
 	{
-		if (std::this_thread::get_id() == NETIOMANAGER->mainLoopThreadId_)
+		if (isLoopThread())
 		{
 			writeData(data, len);
 		}
 		else
 		{
-			NETIOMANAGER->postMainLoop([this, data, len]() {
+			postLoop([this, data, len]() {
 				this->writeData(data, len);
 			});
 		}
@@ -1344,6 +1591,36 @@ namespace NetCore
 		return 0;
 	}
 
+	int TcpSocketConn::writeData(const uv_buf_t *bufs, int nbufs, OnWriteCompleteCallback callback)
+	{
+		uv_write_t *req;
+		int ret;
+		req = new uv_write_t;
+		req->data = new OnWriteCompleteCallback(std::move(callback));
+		ret = uv_write(req, (uv_stream_t*)tcp_, bufs, nbufs, [](uv_write_t* req, int status) {
+			auto cb = static_cast<OnWriteCompleteCallback*>(req->data);
+			if (*cb)
+			{
+				(*cb)(status);
+			}
+			delete cb;
+			delete req;
+		});
+		if (ret < 0)
+		{
+			// uv_write fail will not call write callback
+			auto cb = static_cast<OnWriteCompleteCallback*>(req->data);
+			if (*cb)
+			{
+				(*cb)(ret);
+			}
+			delete cb;
+			delete req;
+			return -1;
+		}
+		return 0;
+	}
+
 	void TcpSocketConn::onMessage(char* buf, ssize_t size, const struct sockaddr* addr, unsigned flags)
 	{
 		if (size > 0)
@@ -1458,6 +1735,30 @@ namespace NetCore
 		}
 	}
 
+	int TcpSocketServer::sendDataVec(uint64_t key, const uv_buf_t *bufs, int nbufs, OnWriteCompleteCallback callback)
+	{
+		auto iter = clientMap.find(key);
+		if (iter == clientMap.end())
+		{
+			if (callback)
+			{
+				callback(-1);
+			}
+			return -1;
+		}
+		return iter->second->sendDataVec(bufs, nbufs, std::move(callback));
+	}
+
+	size_t TcpSocketServer::writeQueueSize(uint64_t key)
+	{
+		auto iter = clientMap.find(key);
+		if (iter == clientMap.end())
+		{
+			return 0;
+		}
+		return iter->second->writeQueueSize();
+	}
+
 	void TcpSocketServer::close(uint64_t key)
 	{
 		if (clientMap.find(key) != clientMap.end())
@@ -1520,18 +1821,20 @@ namespace NetCore
 		//conn->sendData(data, len);
 		if (onRecvDataCb_)
 		{
-			onRecvDataCb_(data, len, key, nullptr);
+			// conn stay valid until close callback return
+			onRecvDataCb_(data, len, key, conn);
 		}
 	}
 
 	void TcpSocketServer::onClosed(uint64_t key, TcpSocketConn *conn)
 	{
 		DLOG("recv close from %ld\n", key);
-		removeClient(key);
+		// user drop its reference to conn here, then conn is freed
 		if (onCloseCb_)
 		{
-			onCloseCb_(key, nullptr);
+			onCloseCb_(key, conn);
 		}
+		removeClient(key);
 	}
 
 	void TcpSocketServer::on_connection_cb(uv_stream_t* server, int status)
@@ -1587,7 +1890,7 @@ namespace NetCore
 
 	int UdpSocket::sendData(const char *data, int len)
 	{
-		if (std::this_thread::get_id() == NETIOMANAGER->mainLoopThreadId_)
+		if (isLoopThread())
 		{
 			writeData(data, len);
 		}
@@ -1751,42 +2054,151 @@ namespace NetCore
 		}
 	}
 
-	void NetIoManager::init()
+	NetIoLoop::NetIoLoop(int index) : load_(0), index_(index)
 	{
 		loop_ = new uv_loop_t();
 		uv_loop_init(loop_);
+		loop_->data = this;
 		async_ = new AsyncCore(loop_);
 	}
 
-	void NetIoManager::startup(bool runInMain)
+	NetIoLoop::~NetIoLoop()
+	{
+		shutdown();
+	}
+
+	void NetIoLoop::startup(bool runInCurrent)
 	{
-		if (runInMain)
+		if (runInCurrent)
 		{
 			mainLoop();
 		}
 		else
 		{
-			mainLoopThread_ = std::thread(&NetIoManager::mainLoop, this);
+			loopThread_ = std::thread(&NetIoLoop::mainLoop, this);
 		}
 	}
 
-	void NetIoManager::shutdown()
+	void NetIoLoop::shutdown()
 	{
-		if (loop_)
+		if (loop_ == nullptr)
+		{
+			return;
+		}
+		if (loopThread_.joinable())
 		{
-			uv_loop_close(loop_);
-			free(loop_);
+			post([this]() {
+				async_->closeAsync();
+				uv_stop(loop_);
+			});
+			loopThread_.join();
 		}
+		else
+		{
+			async_->closeAsync();
+		}
+		// run close callback of async handle
+		uv_run(loop_, UV_RUN_NOWAIT);
+		uv_loop_close(loop_);
+		delete loop_;
+		loop_ = nullptr;
+		delete async_;
+		async_ = nullptr;
 	}
 
-	void NetIoManager::postMainLoop(AsyncCallback callback)
+	void NetIoLoop::post(AsyncCallback callback)
 	{
 		async_->postAsyncEvent(callback);
 	}
 
-	void NetIoManager::mainLoop()
+	bool NetIoLoop::isLoopThread()
 	{
-		mainLoopThreadId_ = std::this_thread::get_id();
+		return std::this_thread::get_id() == loopThreadId_.load(std::memory_order_acquire);
+	}
+
+	NetIoLoop* NetIoLoop::fromLoop(uv_loop_t *loop)
+	{
+		if (loop == nullptr)
+		{
+			return nullptr;
+		}
+		return static_cast<NetIoLoop*>(loop->data);
+	}
+
+	void NetIoLoop::mainLoop()
+	{
+		loopThreadId_.store(std::this_thread::get_id(), std::memory_order_release);
+		ILOG("io loop %d start\n", index_);
 		uv_run(loop_, UV_RUN_DEFAULT);
+		ILOG("io loop %d exit\n", index_);
+	}
+
+	void NetIoManager::init(int loopNum)
+	{
+		if (loopNum <= 0)
+		{
+			loopNum = std::thread::hardware_concurrency();
+			if (loopNum <= 0)
+			{
+				loopNum = 1;
+			}
+		}
+		for (int i = 0; i < loopNum; i++)
+		{
+			loops_.push_back(new NetIoLoop(i));
+		}
+		loop_ = loops_[0]->loop_;
+		ILOG("net io manager init with %d loops\n", loopNum);
+	}
+
+	void NetIoManager::startup(bool runInMain)
+	{
+		for (size_t i = 1; i < loops_.size(); i++)
+		{
+			loops_[i]->startup(false);
+		}
+		loops_[0]->startup(runInMain);
+	}
+
+	void NetIoManager::shutdown()
+	{
+		for (auto iter = loops_.begin(); iter != loops_.end(); ++iter)
+		{
+			delete *iter;
+		}
+		loops_.clear();
+		loop_ = nullptr;
+	}
+
+	void NetIoManager::postMainLoop(AsyncCallback callback)
+	{
+		loops_[0]->post(callback);
+	}
+
+	NetIoLoop* NetIoManager::allocLoop()
+	{
+		std::lock_guard<std::mutex> lock(loopMutex_);
+		NetIoLoop *ioLoop = nullptr;
+		for (auto iter = loops_.begin(); iter != loops_.end(); ++iter)
+		{
+			if (ioLoop == nullptr || (*iter)->load_ < ioLoop->load_)
+			{
+				ioLoop = *iter;
+			}
+		}
+		if (ioLoop)
+		{
+			ioLoop->load_++;
+		}
+		return ioLoop;
+	}
+
+	void NetIoManager::releaseLoop(NetIoLoop *ioLoop)
+	{
+		std::lock_guard<std::mutex> lock(loopMutex_);
+		if (ioLoop && ioLoop->load_ > 0)
+		{
+			ioLoop->load_--;
+		}
 	}
 }
\ No newline at end of file
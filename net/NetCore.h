@@ -5,7 +5,10 @@
 
 #include "uv.h"
 #include <string>
+#include <memory>
 #include <thread>
+#include <atomic>
+#include <vector>
 #include <unordered_map>
 #include "DataBuf.h"
 #include "AsyncEvent.h"
@@ -30,7 +33,46 @@ namespace NetCore
 	class TcpSocketConn;
 	using OnRecvDataCallback = std::function<void(const char *, ssize_t, uint64_t, TcpSocketConn*)>;
 	using OnConnCloseCallback = std::function<void(uint64_t, TcpSocketConn*)>;
+	using OnWriteCompleteCallback = std::function<void(int)>;
+	// true when write queue above high watermark, false when drained below low watermark
+	using OnWriteCongestionCallback = std::function<void(bool)>;
+
+	// write throughput is sampled over completed writes of this interval
+	const uint64_t TCP_WRITE_RATE_INTERVAL_US = 500 * 1000;
 	class BaseSocket;
+
+	// one uv loop with its own thread and async queue, loop->data point to it
+	class NetIoLoop
+	{
+	public:
+		NetIoLoop(int index);
+		virtual ~NetIoLoop();
+
+	public:
+		void startup(bool runInCurrent);
+		void shutdown();
+		void post(AsyncCallback callback);
+		bool isLoopThread();
+		int index() const { return index_; }
+
+	public:
+		static NetIoLoop* fromLoop(uv_loop_t *loop);
+
+	private:
+		void mainLoop();
+
+	public:
+		uv_loop_t *loop_;
+		// set by loop thread, read from any thread
+		std::atomic<std::thread::id> loopThreadId_;
+		std::atomic<int> load_; // sessions bind to this loop
+
+	private:
+		int index_;
+		AsyncCore *async_;
+		std::thread loopThread_;
+	};
+
 	class ISocketCallback
 	{
 	public:
@@ -49,6 +91,8 @@ namespace NetCore
 
 	protected:
 		void init(int type);
+		bool isLoopThread();
+		void postLoop(AsyncCallback callback);
 
 	public:
 		virtual int connectServer(IPAddr &addr) = 0;
@@ -56,6 +100,12 @@ namespace NetCore
 		virtual int sendDataByRawSocket(const char *data, int len) = 0;
 		virtual int close() = 0;
 
+	public:
+		// send several buffers in one write, the buffers must stay valid until callback is called
+		virtual int sendDataVec(const uv_buf_t *bufs, int nbufs, OnWriteCompleteCallback callback);
+		// bytes queued in uv and not written to kernel yet
+		virtual size_t writeQueueSize() { return 0; }
+
 	public:
 		void registerCallback(ISocketCallback *callback);
 
@@ -79,6 +129,13 @@ namespace NetCore
 		int socketType; // 0 tcp 1 udp
 	};
 
+	// write handed over by other thread, run by loop thread in batch
+	struct TcpPendingWrite
+	{
+		std::vector<uv_buf_t> bufs;
+		OnWriteCompleteCallback callback;
+	};
+
 	class TcpSocket : public BaseSocket
 	{
 	public:
@@ -91,16 +148,49 @@ namespace NetCore
 		virtual int sendDataByRawSocket(const char *data, int len);
 		virtual int close();
 
+	public:
+		virtual int sendDataVec(const uv_buf_t *bufs, int nbufs, OnWriteCompleteCallback callback);
+		virtual size_t writeQueueSize();
+		// high 0 disable, callback run in loop thread
+		void setWriteWatermark(size_t high, size_t low, OnWriteCongestionCallback callback);
+		bool isWriteCongested() const { return writeCongested_; }
+		// bytes per second completed by uv_write, smoothed, 0 before first sample, any thread can read
+		uint64_t writeThroughput() const { return writeRate_.load(std::memory_order_relaxed); }
+		// smoothed time from uv_write to its completion
+		uint64_t writeLatencyUs() const { return writeLatency_.load(std::memory_order_relaxed); }
+
 	protected:
 		virtual void onConnect(int status);
 		virtual void onMessage(char* data, ssize_t size, const struct sockaddr* addr, unsigned flags);
 
 	private:
 		int writeData(const char *data, int len);
+		int writeData(const uv_buf_t *bufs, int nbufs, OnWriteCompleteCallback callback);
+		void checkWriteWatermark();
+		void sampleWrite(size_t bytes, uint64_t startUs);
+		void enqueueWrite(TcpPendingWrite *write);
+		void drainWrites();
 
 	protected:
 		uv_tcp_t *tcp_;
 		uv_connect_t *conn_req_;
+
+	private:
+		size_t writeHigh_;
+		size_t writeLow_;
+		bool writeCongested_;
+		OnWriteCongestionCallback congestionCb_;
+
+	private:
+		uint64_t rateStartUs_;
+		uint64_t rateBytes_;
+		std::atomic<uint64_t> writeRate_;
+		std::atomic<uint64_t> writeLatency_;
+
+	private:
+		// producers wake loop only when no drain is scheduled
+		std::shared_ptr<MpscQueue<TcpPendingWrite*>> sendQueue_;
+		std::atomic<bool> sendScheduled_;
 	};
 
 	class WebSocketClient : public TcpSocket
@@ -304,6 +394,11 @@ namespace NetCore
 		virtual int sendDataByRawSocket(const char *data, int len);
 		virtual int close();
 
+	public:
+		// raw bytes without ws/tls framing, buffers must stay valid until callback is called
+		virtual int sendDataVec(const uv_buf_t *bufs, int nbufs, OnWriteCompleteCallback callback);
+		virtual size_t writeQueueSize();
+
 	public:
 		void onTlsConnectStatus(int status);
 		void onTlsReadData(char *buf, int size);
@@ -317,6 +412,7 @@ namespace NetCore
 		int onConnClosed();
 		int writeData(const char *data, int len);
 		int writeData(const std::string &data);
+		int writeData(const uv_buf_t *bufs, int nbufs, OnWriteCompleteCallback callback);
 
 	protected:
 		virtual void onMessage(char* buf, ssize_t size, const struct sockaddr* addr, unsigned flags);
@@ -340,6 +436,8 @@ namespace NetCore
 	public:
 		void bindAndStart();
 		void sendData(uint64_t key, const char *data, int len);
+		int sendDataVec(uint64_t key, const uv_buf_t *bufs, int nbufs, OnWriteCompleteCallback callback);
+		size_t writeQueueSize(uint64_t key);
 		void close(uint64_t key);
 		void setRecvDataCallback(OnRecvDataCallback callback);
 		void setCloseCallback(OnConnCloseCallback callback);
@@ -418,20 +516,24 @@ namespace NetCore
 	class NetIoManager : public core::Singleton<NetIoManager>
 	{
 	public:
-		void init();
+		// loopNum 0 means one loop per cpu core
+		void init(int loopNum = 1);
+		// loop 0 run in current thread when runInMain, others always run in own thread
 		void startup(bool runInMain = true);
 		void shutdown();
 		void postMainLoop(AsyncCallback callback);
 
-	private:
-		void mainLoop();
+	public:
+		// pick the loop with least sessions, must call releaseLoop when session destroy
+		NetIoLoop* allocLoop();
+		void releaseLoop(NetIoLoop *ioLoop);
+		int loopNum() const { return static_cast<int>(loops_.size()); }
 
 	public:
-		uv_loop_t *loop_;
-		std::thread::id mainLoopThreadId_;
+		uv_loop_t *loop_; // loop 0
 	private:
-		AsyncCore *async_;
-		std::thread mainLoopThread_;
+		std::vector<NetIoLoop*> loops_;
+		std::mutex loopMutex_;
 	};
 }
 
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include "RTSPCommon.h"
 #include "logger.h"
+#include "annexb.h"
 //#include "util.h"
 
 #ifdef WIN32
@@ -450,25 +451,28 @@ bool parseRTSPURLUsernamePassword(char const* url, std::string &username, std::s
 
 int trimStartCode(uint8_t *buf, int len)
 {
-	uint8_t *ptr = buf;
+	int startCodeLen = 0;
+	int pos;
 	if (len < 4) return 0;
 
 	// trying to find 0x00 0x00 ... 0x01 pattern
-	// find first 0x00 0x00 bytes
-	if (ptr[0] == 0x00 && ptr[1] == 0x00) {
-		// find first 0x01
-		while (*ptr == 0x00 && ptr < buf+len-1)
-			ptr++;
-
-		if (*ptr != 0x01) {	// error - invalid stream
-			ELOG("invalid stream, 0x%02x\n", *ptr);
-			ptr = buf;
-		} else {
-			ptr++;
+	if (buf[0] == 0x00 && buf[1] == 0x00) {
+		pos = Utils::AnnexB::findStartCode(buf, len, startCodeLen);
+		// only more 0x00 is allowed before start code
+		for (int i = 0; i < pos; i++) {
+			if (buf[i] != 0x00) {
+				pos = len;
+				break;
+			}
+		}
+		if (pos >= len) {	// error - invalid stream
+			ELOG("invalid stream, 0x%02x\n", buf[2]);
+			return 0;
 		}
+		return pos + startCodeLen;
 	}
 
-	return ptr-buf;
+	return 0;
 }
 
 char* getLine(char* startOfLine) 
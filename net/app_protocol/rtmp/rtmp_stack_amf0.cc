@@ -1,5 +1,6 @@
 #include "rtmp_stack_amf0.h"
 
+#include <new>
 #include <utility>
 #include <vector>
 #include <sstream>
@@ -1562,6 +1563,277 @@ int rtmp_amf0_write_undefined(uint8_t *data, int len)
     return offset;
 }
 
+RtmpAmf0Arena::RtmpAmf0Arena(int size)
+{
+    block_size = size;
+    first_size = 0;
+    current_size = 0;
+    used = 0;
+}
+
+RtmpAmf0Arena::~RtmpAmf0Arena()
+{
+    for (int i = 0; i < (int)blocks.size(); i++) {
+        delete[] blocks[i];
+    }
+    blocks.clear();
+}
+
+void* RtmpAmf0Arena::alloc(int size)
+{
+    uint8_t* p = NULL;
+
+    size = (size + 7) & ~7;
+    if (blocks.empty() || used + size > current_size) {
+        // large value get a block of its own
+        current_size = (size > block_size) ? size : block_size;
+        blocks.push_back(new uint8_t[current_size]);
+        if (blocks.size() == 1) {
+            first_size = current_size;
+        }
+        used = 0;
+    }
+    p = blocks.back() + used;
+    used += size;
+    return p;
+}
+
+void RtmpAmf0Arena::reset()
+{
+    for (int i = 1; i < (int)blocks.size(); i++) {
+        delete[] blocks[i];
+    }
+    if (blocks.size() > 1) {
+        blocks.resize(1);
+    }
+    current_size = first_size;
+    used = 0;
+}
+
+RtmpAmf0View::RtmpAmf0View()
+{
+    marker = RTMP_AMF0_Invalid;
+    number = 0;
+    str = NULL;
+    len = 0;
+    key = NULL;
+    key_len = 0;
+    count = 0;
+    child = NULL;
+    next = NULL;
+}
+
+bool RtmpAmf0View::is_string()
+{
+    return marker == RTMP_AMF0_String || marker == RTMP_AMF0_LongString;
+}
+
+bool RtmpAmf0View::is_boolean()
+{
+    return marker == RTMP_AMF0_Boolean;
+}
+
+bool RtmpAmf0View::is_number()
+{
+    return marker == RTMP_AMF0_Number;
+}
+
+bool RtmpAmf0View::is_null()
+{
+    return marker == RTMP_AMF0_Null;
+}
+
+bool RtmpAmf0View::is_object()
+{
+    return marker == RTMP_AMF0_Object;
+}
+
+bool RtmpAmf0View::is_ecma_array()
+{
+    return marker == RTMP_AMF0_EcmaArray;
+}
+
+bool RtmpAmf0View::is_strict_array()
+{
+    return marker == RTMP_AMF0_StrictArray;
+}
+
+string RtmpAmf0View::to_str()
+{
+    if (!is_string() || len == 0) {
+        return "";
+    }
+    return string(str, len);
+}
+
+bool RtmpAmf0View::str_equals(const char* value)
+{
+    int size = (int)strlen(value);
+    return is_string() && len == size && memcmp(str, value, size) == 0;
+}
+
+bool RtmpAmf0View::to_boolean()
+{
+    return number != 0;
+}
+
+double RtmpAmf0View::to_number()
+{
+    return number;
+}
+
+RtmpAmf0View* RtmpAmf0View::get_property(const char* name)
+{
+    int size = (int)strlen(name);
+
+    for (RtmpAmf0View* p = child; p != NULL; p = p->next) {
+        if (p->key_len == size && memcmp(p->key, name, size) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+RtmpAmf0View* RtmpAmf0View::at(int index)
+{
+    RtmpAmf0View* p = child;
+
+    for (int i = 0; i < index && p != NULL; i++) {
+        p = p->next;
+    }
+    return p;
+}
+
+static int rtmp_amf0_read_utf8_view(uint8_t *data, int len, const char*& value, int& size)
+{
+    uint16_t length = 0;
+
+    if (len < 2) {
+        return -1;
+    }
+    read_uint16(data, &length);
+    if (len - 2 < length) {
+        return -1;
+    }
+    value = (const char*)data + 2;
+    size = length;
+    return 2 + length;
+}
+
+static int rtmp_amf0_read_view_depth(uint8_t *data, int len, RtmpAmf0Arena* arena, RtmpAmf0View** ppvalue, int depth)
+{
+    int offset = 0;
+    int ret;
+    int64_t temp = 0;
+    uint32_t count = 0;
+    RtmpAmf0View* value = NULL;
+    RtmpAmf0View** tail = NULL;
+    const char* key = NULL;
+    int key_len = 0;
+
+    if (len < 1 || depth > RTMP_AMF0_VIEW_MAX_DEPTH) {
+        return -1;
+    }
+    value = new (arena->alloc(sizeof(RtmpAmf0View))) RtmpAmf0View();
+    value->marker = data[offset++];
+    tail = &value->child;
+    switch (value->marker) {
+        case RTMP_AMF0_Number:
+        case RTMP_AMF0_Date:
+            if (len - offset < 8) {
+                return -1;
+            }
+            offset += read_int64(data+offset, &temp);
+            memcpy(&value->number, &temp, 8);
+            if (value->marker == RTMP_AMF0_Date) {
+                // time zone is reserved
+                if (len - offset < 2) {
+                    return -1;
+                }
+                offset += 2;
+            }
+            break;
+        case RTMP_AMF0_Boolean:
+            if (len - offset < 1) {
+                return -1;
+            }
+            value->number = (data[offset++] != 0) ? 1 : 0;
+            break;
+        case RTMP_AMF0_String:
+            if ((ret = rtmp_amf0_read_utf8_view(data+offset, len-offset, value->str, value->len)) < 0) {
+                return ret;
+            }
+            offset += ret;
+            break;
+        case RTMP_AMF0_LongString:
+            if (len - offset < 4) {
+                return -1;
+            }
+            offset += read_uint32(data+offset, &count);
+            if ((uint32_t)(len - offset) < count) {
+                return -1;
+            }
+            value->str = (const char*)data + offset;
+            value->len = (int)count;
+            offset += count;
+            break;
+        case RTMP_AMF0_Null:
+        case RTMP_AMF0_Undefined:
+            break;
+        case RTMP_AMF0_EcmaArray:
+        case RTMP_AMF0_Object:
+            if (value->marker == RTMP_AMF0_EcmaArray) {
+                // associative count is only a hint, properties end with object eof
+                if (len - offset < 4) {
+                    return -1;
+                }
+                offset += 4;
+            }
+            while (offset < len) {
+                if (rtmp_amf0_is_object_eof(data+offset, len-offset)) {
+                    offset += 3;
+                    break;
+                }
+                if ((ret = rtmp_amf0_read_utf8_view(data+offset, len-offset, key, key_len)) < 0) {
+                    return ret;
+                }
+                offset += ret;
+                if ((ret = rtmp_amf0_read_view_depth(data+offset, len-offset, arena, tail, depth+1)) < 0) {
+                    return ret;
+                }
+                offset += ret;
+                (*tail)->key = key;
+                (*tail)->key_len = key_len;
+                tail = &(*tail)->next;
+                value->count++;
+            }
+            break;
+        case RTMP_AMF0_StrictArray:
+            if (len - offset < 4) {
+                return -1;
+            }
+            offset += read_uint32(data+offset, &count);
+            for (uint32_t i = 0; i < count && offset < len; i++) {
+                if ((ret = rtmp_amf0_read_view_depth(data+offset, len-offset, arena, tail, depth+1)) < 0) {
+                    return ret;
+                }
+                offset += ret;
+                tail = &(*tail)->next;
+                value->count++;
+            }
+            break;
+        default:
+            return -2;
+    }
+    *ppvalue = value;
+    return offset;
+}
+
+int rtmp_amf0_read_view(uint8_t *data, int len, RtmpAmf0Arena* arena, RtmpAmf0View** ppvalue)
+{
+    return rtmp_amf0_read_view_depth(data, len, arena, ppvalue, 0);
+}
+
 namespace rtmp_internal
 {
     int rtmp_amf0_read_utf8(uint8_t *data, int len, string& value)
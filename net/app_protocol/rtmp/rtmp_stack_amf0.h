@@ -582,6 +582,93 @@ extern int rtmp_amf0_write_null(uint8_t *data, int len);
 extern int rtmp_amf0_read_undefined(uint8_t *data, int len);
 extern int rtmp_amf0_write_undefined(uint8_t *data, int len);
 
+/**
+ * block size of amf0 decode arena, a command or metadata message usually fit in one block.
+ */
+const int RTMP_AMF0_ARENA_BLOCK_SIZE = 4096;
+/**
+ * object nested deeper than this is treated as invalid.
+ */
+const int RTMP_AMF0_VIEW_MAX_DEPTH = 32;
+
+/**
+ * bump allocator for decode, all allocations are freed together by reset.
+ * @remark the first block is kept by reset, so steady decode does not malloc.
+ */
+class RtmpAmf0Arena
+{
+private:
+    std::vector<uint8_t*> blocks;
+    int block_size;
+    int first_size;
+    int current_size;
+    int used;
+public:
+    RtmpAmf0Arena(int size = RTMP_AMF0_ARENA_BLOCK_SIZE);
+    virtual ~RtmpAmf0Arena();
+public:
+    /**
+     * alloc 8 bytes aligned memory, never fail.
+     */
+    virtual void* alloc(int size);
+    virtual void reset();
+};
+
+/**
+ * read only amf0 value decoded into arena.
+ * string and property key point into the decoded bytes, no copy,
+ * so the bytes and the arena must live as long as the view.
+ * @remark use rtmp_amf0_read_view to create it.
+ */
+class RtmpAmf0View
+{
+public:
+    char marker;
+    // number, date in ms, or boolean as 0/1
+    double number;
+    const char* str;
+    int len;
+    // property name when the value is in object or ecma array
+    const char* key;
+    int key_len;
+    // properties or elements of complex value, in decode order
+    int count;
+    RtmpAmf0View* child;
+    RtmpAmf0View* next;
+public:
+    RtmpAmf0View();
+public:
+    virtual bool is_string();
+    virtual bool is_boolean();
+    virtual bool is_number();
+    virtual bool is_null();
+    virtual bool is_object();
+    virtual bool is_ecma_array();
+    virtual bool is_strict_array();
+public:
+    /**
+     * get a string copy, empty if not a string.
+     */
+    virtual std::string to_str();
+    virtual bool str_equals(const char* value);
+    virtual bool to_boolean();
+    virtual double to_number();
+    /**
+     * get the property of object or ecma array, NULL if not found.
+     */
+    virtual RtmpAmf0View* get_property(const char* name);
+    /**
+     * get the element or property at index, NULL if out of range.
+     */
+    virtual RtmpAmf0View* at(int index);
+};
+
+/**
+ * decode any amf0 value into arena.
+ * @param ppvalue, the output value, allocated in arena and never freed by user.
+ */
+extern int rtmp_amf0_read_view(uint8_t *data, int len, RtmpAmf0Arena* arena, RtmpAmf0View** ppvalue);
+
 // internal objects, user should never use it.
 namespace rtmp_internal
 {
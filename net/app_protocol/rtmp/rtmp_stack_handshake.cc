@@ -320,6 +320,7 @@ int rtmp_handshake::create_c2()
 {
     int ret = 0;
 
+    delete[] c2;
     c2 = new char[1536];
     memcpy(c2, s0s1s2+1, 1536);
 //    index = 0;
@@ -348,6 +349,7 @@ int rtmp_handshake::process_s0s1s2(const char *data, int len)
     {
         return -1;
     }
+    delete[] s0s1s2;
     s0s1s2 = new char[3073];
     memcpy(s0s1s2, data, len);
     ver = data[offset];
@@ -364,6 +366,28 @@ int rtmp_handshake::process_s0s1s2(const char *data, int len)
     return offset;
 }
 
+int rtmp_handshake::create_s0s1s2(const char *data, int len)
+{
+    if (len < 1537)
+    {
+        return -1;
+    }
+    if (data[0] != 0x03)
+    {
+        ELOG("version error handshake fail\n");
+        return -2;
+    }
+    delete[] s0s1s2;
+    s0s1s2 = new char[3073];
+    s0s1s2[0] = 0x03;
+    random_generate(s0s1s2+1, 1536);
+    write_uint32((uint8_t*)s0s1s2+1, (uint32_t)::time(NULL));
+    // zero version, client do not look for digest in s1
+    write_uint32((uint8_t*)s0s1s2+5, 0);
+    memcpy(s0s1s2+1537, data+1, 1536);
+    return 3073;
+}
+
 int rtmp_handshake::build_time(char *payload)
 {
     return write_uint32((uint8_t*)payload, time);
@@ -418,6 +442,8 @@ int rtmp_handshake::build_digest(char *payload, bool with_digest)
 int rtmp_handshake::general_c0c1(schema_type type)
 {
     index = 0;
+    // handshake may run again on the same object when reconnect
+    delete[] c0c1;
     c0c1 = new char[1+1536];
     c0c1[index] = 0x03;
     index += 1;
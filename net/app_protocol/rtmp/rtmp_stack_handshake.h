@@ -95,6 +95,8 @@ public:
     int create_c0c1(schema_type schema);
     int create_c2();
     int process_s0s1s2(const char *data, int len);
+    // server handshake, simple schema, s2 echo c1 and c2 is not verified
+    int create_s0s1s2(const char *data, int len);
 
 private:
     int build_time(char *payload);
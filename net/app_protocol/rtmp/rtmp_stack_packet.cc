@@ -210,6 +210,28 @@ int RtmpHeader::decode_base_header(uint8_t *data, int length, uint8_t &fmt, uint
     }
 }
 
+int RtmpHeader::encode_basic_header(uint8_t *data, uint8_t fmt)
+{
+    if (chunk_stream_id < 64)
+    {
+        data[0] = (fmt << 6) | (uint8_t)chunk_stream_id;
+        return 1;
+    }
+    else if (chunk_stream_id < 320)
+    {
+        data[0] = (fmt << 6);
+        data[1] = (uint8_t)(chunk_stream_id - 64);
+        return 2;
+    }
+    else
+    {
+        data[0] = (fmt << 6) | 0x01;
+        data[1] = (uint8_t)((chunk_stream_id - 64) & 0xff);
+        data[2] = (uint8_t)((chunk_stream_id - 64) >> 8);
+        return 3;
+    }
+}
+
 int RtmpHeader::encode_fmt0_chunk_header(uint8_t *data, int size)
 {
     uint8_t *p = data;
@@ -218,8 +240,8 @@ int RtmpHeader::encode_fmt0_chunk_header(uint8_t *data, int size)
     {
         return -1;
     }
-    // base header(chunk type + chunk stream id) 1 byte
-    *p++ = 0x00 | (((uint8_t)chunk_stream_id) & 0x3f);
+    // base header(chunk type + chunk stream id) 1-3 bytes
+    p += encode_basic_header(p, 0);
     // timestame big endian 3 bytes
     if (timestamp >= RTMP_EXTENDED_TIMESTAMP)
     {
@@ -266,8 +288,8 @@ int RtmpHeader::encode_fmt1_chunk_header(uint8_t *data, int size)
     {
         return -1;
     }
-    // base header(chunk type + chunk stream id) 1 byte
-    *p++ = 0x40 | (((uint8_t)chunk_stream_id) & 0x3f);
+    // base header(chunk type + chunk stream id) 1-3 bytes
+    p += encode_basic_header(p, 1);
     // timestame big endian 3 bytes
     if (timestamp >= RTMP_EXTENDED_TIMESTAMP)
     {
@@ -308,8 +330,8 @@ int RtmpHeader::encode_fmt2_chunk_header(uint8_t *data, int size)
     {
         return -1;
     }
-    // base header(chunk type + chunk stream id) 1 byte
-    *p++ = 0x80 | (((uint8_t)chunk_stream_id) & 0x3f);
+    // base header(chunk type + chunk stream id) 1-3 bytes
+    p += encode_basic_header(p, 2);
     // timestame big endian 3 bytes
     if (timestamp >= RTMP_EXTENDED_TIMESTAMP)
     {
@@ -343,8 +365,8 @@ int RtmpHeader::encode_fmt3_chunk_header(uint8_t *data, int size)
     {
         return -1;
     }
-    // base header(chunk type + chunk stream id) 1 byte
-    *p++ = 0xC0 | (((uint8_t)chunk_stream_id) & 0x3f);
+    // base header(chunk type + chunk stream id) 1-3 bytes
+    p += encode_basic_header(p, 3);
     if (timestamp >= RTMP_EXTENDED_TIMESTAMP)
     {
         q = (uint8_t*)&timestamp;
@@ -356,23 +378,26 @@ int RtmpHeader::encode_fmt3_chunk_header(uint8_t *data, int size)
     return (int)(p-data);
 }
 
-int RtmpBasePacket::encode(uint8_t *&payload, int &size)
+int RtmpBasePacket::encode(SharedBuffer *&buffer, uint8_t *&payload, int &size)
 {
     int ret;
     int length = get_pkg_len();
-    uint8_t *buffer = NULL;
 
+    buffer = nullptr;
+    payload = nullptr;
     if (length > 0)
     {
-        buffer = new uint8_t[length];
-        ret = encode_pkg(buffer, length);
+        buffer = SHAREDBUFFERPOOL->alloc(length);
+        ret = encode_pkg(buffer->data(), length);
         if (ret < 0)
         {
-            delete[] buffer;
+            buffer->unref();
+            buffer = nullptr;
             return -1;
         }
+        buffer->setLen(length);
+        payload = buffer->data();
     }
-    payload = buffer;
     size = length;
     return 0;
 }
@@ -381,47 +406,78 @@ RtmpChunkData::RtmpChunkData()
 {
     payload = nullptr;
     current_payload_len = 0;
+    time_delta = 0;
+    extended_timestamp = false;
 }
 
 RtmpChunkData::~RtmpChunkData()
 {
     if (payload)
     {
-        delete[] payload;
+        payload->unref();
     }
 }
 
 void RtmpChunkData::create_payload(int length)
 {
-    if (payload)
+    if (payload && (!payload->unique() || payload->capacity() < length))
     {
-        delete[] payload;
+        payload->unref();
+        payload = nullptr;
     }
-    payload = new uint8_t[length];
+    if (payload == nullptr)
+    {
+        payload = SHAREDBUFFERPOOL->alloc(length);
+    }
+    payload->setLen(0);
     current_payload_len = 0;
 }
 
 void RtmpChunkData::copy_payload(uint8_t *data, int len)
 {
-    memcpy(payload+current_payload_len, data, len);
+    memcpy(payload->data()+current_payload_len, data, len);
     current_payload_len += len;
 }
 
+SharedBuffer* RtmpChunkData::finish_payload()
+{
+    payload->setLen(current_payload_len);
+    payload->ref();
+    current_payload_len = 0;
+    return payload;
+}
+
 RtmpAudioPacket::RtmpAudioPacket()
 {
+    kind = KIND;
     data = nullptr;
     datalen = 0;
+    body = nullptr;
 }
 
 RtmpAudioPacket::RtmpAudioPacket(int len)
 {
+    kind = KIND;
     data = new uint8_t[len];
     datalen = len;
+    body = nullptr;
+}
+
+RtmpAudioPacket::RtmpAudioPacket(SharedBuffer *body)
+{
+    kind = KIND;
+    body->ref();
+    this->body = body;
+    data = body->data();
+    datalen = body->len();
 }
 
 RtmpAudioPacket::~RtmpAudioPacket()
 {
-    if (data) {
+    if (body) {
+        body->unref();
+    }
+    else if (data) {
         delete[] data;
     }
 }
@@ -431,6 +487,20 @@ uint32_t RtmpAudioPacket::getTimestamp()
     return timestamp;
 }
 
+int RtmpAudioPacket::encode(SharedBuffer *&buffer, uint8_t *&payload, int &size)
+{
+    if (body == nullptr || body->headroom() < 1) {
+        return RtmpBasePacket::encode(buffer, payload, size);
+    }
+    // no copy, only 1 byte tag header before audio data
+    payload = body->data() - 1;
+    payload[0] = 0x82;
+    size = get_pkg_len();
+    body->ref();
+    buffer = body;
+    return 0;
+}
+
 int RtmpAudioPacket::encode_pkg(uint8_t *payload, int size)
 {
     int offset = 0;
@@ -450,6 +520,9 @@ int RtmpAudioPacket::encode_pkg(uint8_t *payload, int size)
 
 int RtmpAudioPacket::decode(uint8_t *data, int len)
 {
+    if (len < 1) {
+        return -1;
+    }
     flag = data[0];
     datalen = len-1;
     this->data = new uint8_t[datalen];
@@ -473,11 +546,13 @@ int RtmpAudioPacket::get_msg_type()
 }
 
 RtmpAVCPacket::RtmpAVCPacket() {
+    kind = KIND;
     sps = pps = nullptr;
     spslen = ppslen = 0;
 }
 
 RtmpAVCPacket::RtmpAVCPacket(int spslen, int ppslen) {
+    kind = KIND;
     sps = new uint8_t[spslen];
     this->spslen = spslen;
     pps = new uint8_t[ppslen];
@@ -522,16 +597,24 @@ int RtmpAVCPacket::encode_pkg(uint8_t *payload, int size) {
 int RtmpAVCPacket::decode(uint8_t *data, int len) {
     int offset = 0;
 
-    if (len < 11) {
+    if (len < 13) {
         return -1;
     }
     offset += 11;
     offset += read_int16(data+offset, (int16_t*)&spslen);
+    spslen &= 0xffff;
+    if (spslen > len - offset - 3) {
+        return -1;
+    }
     sps = new uint8_t[spslen];
     memcpy(sps, data+offset,spslen);
     offset += spslen;
     offset += 1;
     offset += read_int16(data+offset, (int16_t*)&ppslen);
+    ppslen &= 0xffff;
+    if (ppslen > len - offset) {
+        return -1;
+    }
     pps = new uint8_t[ppslen];
     memcpy(pps, data+offset, ppslen);
     offset += ppslen;
@@ -551,15 +634,25 @@ int RtmpAVCPacket::get_msg_type() {
 }
 
 RtmpVideoPacket::RtmpVideoPacket() {
+    kind = KIND;
     naluItem.clear();
+    body = nullptr;
     //nalu = nullptr;
 }
 
 RtmpVideoPacket::RtmpVideoPacket(int len) {
+    kind = KIND;
     H264Nalu *nalu = new H264Nalu;
     nalu->nalu = new uint8_t[len];
     nalu->nalulen = len;
     naluItem.push_back(nalu);
+    body = nullptr;
+}
+
+RtmpVideoPacket::RtmpVideoPacket(SharedBuffer *body) {
+    kind = KIND;
+    body->ref();
+    this->body = body;
 }
 
 RtmpVideoPacket::~RtmpVideoPacket() {
@@ -567,17 +660,47 @@ RtmpVideoPacket::~RtmpVideoPacket() {
         delete naluItem[i];
     }
     naluItem.clear();
+    if (body) {
+        body->unref();
+    }
 }
 
 uint32_t RtmpVideoPacket::getTimestamp() {
     return timestamp;
 }
 
+int RtmpVideoPacket::encode(SharedBuffer *&buffer, uint8_t *&payload, int &size)
+{
+    if (body == nullptr || body->headroom() < 5) {
+        return RtmpBasePacket::encode(buffer, payload, size);
+    }
+    // no copy, 5 bytes tag header before avcc nalus
+    payload = body->data() - 5;
+    encode_header(payload);
+    size = get_pkg_len();
+    body->ref();
+    buffer = body;
+    return 0;
+}
+
 int RtmpVideoPacket::encode_pkg(uint8_t *payload, int size)
 {
     int offset = 0;
-    uint8_t *q;
-    int time = 40;
+
+    offset += encode_header(payload);
+    if (body) {
+        memcpy(payload+offset, body->data(), body->len());
+        return 0;
+    }
+    offset += write_uint32(payload+offset, naluItem[0]->nalulen);
+    memcpy(payload+offset, naluItem[0]->nalu, naluItem[0]->nalulen);
+    offset += naluItem[0]->nalulen;
+    return 0;
+}
+
+int RtmpVideoPacket::encode_header(uint8_t *payload)
+{
+    int offset = 0;
 
     if (keyframe) {
         payload[offset++] = 0x17;
@@ -593,17 +716,18 @@ int RtmpVideoPacket::encode_pkg(uint8_t *payload, int size)
     payload[offset++] = 0x00;
     payload[offset++] = 0x00;
     payload[offset++] = 0x00;
-    offset += write_uint32(payload+offset, naluItem[0]->nalulen);
-    memcpy(payload+offset, naluItem[0]->nalu, naluItem[0]->nalulen);
-    offset += naluItem[0]->nalulen;
-    return 0;
+    return offset;
 }
 
 int RtmpVideoPacket::decode(uint8_t *data, int len)
 {
     int offset = 0;
     uint8_t val;
+    uint32_t nalulen;
 
+    if (len < 5) {
+        return -1;
+    }
     val = data[offset];
     offset++;
     if (val == 0x17) {
@@ -614,8 +738,16 @@ int RtmpVideoPacket::decode(uint8_t *data, int len)
     }
     offset += 4;
     while(offset < len) {
+        if (len - offset < 4) {
+            return -1;
+        }
+        read_uint32(data + offset, &nalulen);
+        offset += 4;
+        if (nalulen > (uint32_t)(len - offset)) {
+            return -1;
+        }
         H264Nalu *nalu = new H264Nalu;
-        offset += read_uint32(data + offset, (uint32_t *) &(nalu->nalulen));
+        nalu->nalulen = (int)nalulen;
         nalu->nalu = new uint8_t[nalu->nalulen];
         memcpy(nalu->nalu, data + offset, nalu->nalulen);
         offset += nalu->nalulen;
@@ -626,6 +758,9 @@ int RtmpVideoPacket::decode(uint8_t *data, int len)
 
 int RtmpVideoPacket::get_pkg_len()
 {
+    if (body) {
+        return 1 + 1 + 3 + body->len();
+    }
     return 1 + 1 + 3 + 4 + naluItem[0]->nalulen;
 }
 
@@ -639,8 +774,142 @@ int RtmpVideoPacket::get_msg_type()
     return RTMP_MSG_VideoMessage;
 }
 
+RtmpMediaPacket::RtmpMediaPacket(uint8_t msg_type, SharedBuffer *body) {
+    kind = KIND;
+    body->ref();
+    this->body = body;
+    this->msg_type = msg_type;
+    timestamp = 0;
+    frame_type = 0;
+    codec_id = 0;
+    packet_type = -1;
+    composition_time = 0;
+    nalu_length_size = 4;
+    header_len = 0;
+}
+
+RtmpMediaPacket::~RtmpMediaPacket() {
+    body->unref();
+}
+
+bool RtmpMediaPacket::is_keyframe() const {
+    return is_video() && frame_type == 1 && !is_sequence_header();
+}
+
+bool RtmpMediaPacket::is_sequence_header() const {
+    // avc sequence header or aac audio specific config
+    if (is_video()) {
+        return codec_id == 7 && packet_type == 0;
+    }
+    return codec_id == 10 && packet_type == 0;
+}
+
+const uint8_t* RtmpMediaPacket::payload() const {
+    return body->data() + header_len;
+}
+
+int RtmpMediaPacket::payload_len() const {
+    return body->len() - header_len;
+}
+
+bool RtmpMediaPacket::next_nalu(int &offset, const uint8_t *&nalu, int &nalulen) const {
+    const uint8_t *p = payload();
+    int len = payload_len();
+    uint32_t size = 0;
+
+    if (!is_video() || codec_id != 7 || packet_type != 1) {
+        return false;
+    }
+    if (offset < 0 || len - offset < nalu_length_size) {
+        return false;
+    }
+    for (int i = 0; i < nalu_length_size; i++) {
+        size = (size << 8) | p[offset + i];
+    }
+    offset += nalu_length_size;
+    if (size > (uint32_t)(len - offset)) {
+        return false;
+    }
+    nalu = p + offset;
+    nalulen = (int)size;
+    offset += nalulen;
+    return true;
+}
+
+uint32_t RtmpMediaPacket::getTimestamp() {
+    return timestamp;
+}
+
+int RtmpMediaPacket::encode(SharedBuffer *&buffer, uint8_t *&payload, int &size) {
+    body->ref();
+    buffer = body;
+    payload = body->data();
+    size = body->len();
+    return 0;
+}
+
+int RtmpMediaPacket::encode_pkg(uint8_t *payload, int size) {
+    memcpy(payload, body->data(), body->len());
+    return 0;
+}
+
+int RtmpMediaPacket::decode(uint8_t *data, int len) {
+    if (len < 1) {
+        return -1;
+    }
+    if (is_video()) {
+        frame_type = data[0] >> 4;
+        codec_id = data[0] & 0x0f;
+        header_len = 1;
+        if (codec_id == 7) {
+            if (len < 5) {
+                return -1;
+            }
+            packet_type = (int8_t)data[1];
+            // si24
+            composition_time = (int32_t)(((uint32_t)data[2] << 24) | ((uint32_t)data[3] << 16) | ((uint32_t)data[4] << 8)) >> 8;
+            header_len = 5;
+            if (packet_type == 0) {
+                // AVCDecoderConfigurationRecord, lengthSizeMinusOne in low 2 bits of byte 4
+                if (len < header_len + 5) {
+                    return -1;
+                }
+                nalu_length_size = (data[header_len + 4] & 0x03) + 1;
+                if (nalu_length_size == 3) {
+                    return -1;
+                }
+            }
+        }
+    }
+    else {
+        codec_id = data[0] >> 4;
+        header_len = 1;
+        if (codec_id == 10) {
+            if (len < 2) {
+                return -1;
+            }
+            packet_type = (int8_t)data[1];
+            header_len = 2;
+        }
+    }
+    return len;
+}
+
+int RtmpMediaPacket::get_pkg_len() {
+    return body->len();
+}
+
+int RtmpMediaPacket::get_cs_id() {
+    return is_video() ? RTMP_CID_Video : RTMP_CID_Audio;
+}
+
+int RtmpMediaPacket::get_msg_type() {
+    return msg_type;
+}
+
 RtmpConnectPacket::RtmpConnectPacket()
 {
+    kind = KIND;
     command_name = "connect";
     number = 1;
     command_object = RtmpAmf0Any::object();
@@ -728,6 +997,7 @@ int RtmpConnectPacket::get_msg_type()
 
 RtmpConnectResponsePacket::RtmpConnectResponsePacket()
 {
+    kind = KIND;
     command_name = "_result";
     number = 1;
     object = RtmpAmf0Any::object();
@@ -841,6 +1111,7 @@ int RtmpConnectResponsePacket::encode_pkg(uint8_t *payload, int size)
 
 RtmpSetWindowAckSizePacket::RtmpSetWindowAckSizePacket()
 {
+    kind = KIND;
     window_ack_size = 0;
 }
 
@@ -888,6 +1159,7 @@ int RtmpSetWindowAckSizePacket::encode_pkg(uint8_t *payload, int size)
 
 RtmpAcknowledgementPacket::RtmpAcknowledgementPacket()
 {
+    kind = KIND;
     sequence_number = 0;
 }
 
@@ -937,6 +1209,7 @@ int RtmpAcknowledgementPacket::encode_pkg(uint8_t *payload, int size)
 
 RtmpSetChunkSizePacket::RtmpSetChunkSizePacket()
 {
+    kind = KIND;
     chunk_size = 128;
 }
 
@@ -986,6 +1259,7 @@ int RtmpSetChunkSizePacket::encode_pkg(uint8_t *payload, int size)
 
 RtmpSetPeerBandwidthPacket::RtmpSetPeerBandwidthPacket()
 {
+    kind = KIND;
     bandwidth = 0;
     type = RtmpPeerBandwidthDynamic;
 }
@@ -1038,6 +1312,7 @@ int RtmpSetPeerBandwidthPacket::encode_pkg(uint8_t *payload, int size)
 
 RtmpUserControlPacket::RtmpUserControlPacket()
 {
+    kind = KIND;
     event_type = 0;
     event_data = 0;
     extra_data = 0;
@@ -1050,7 +1325,40 @@ RtmpUserControlPacket::~RtmpUserControlPacket()
 
 int RtmpUserControlPacket::decode(uint8_t *data, int len)
 {
-    return 0;
+    int offset = 0;
+    int8_t event;
+
+    if (len < 2)
+    {
+        return -1;
+    }
+    offset += read_int16(data+offset, &event_type);
+    if (event_type == RtmpPCUCFmsEvent0)
+    {
+        if (len - offset < 1)
+        {
+            return -1;
+        }
+        offset += read_int8(data+offset, &event);
+        event_data = event;
+    }
+    else
+    {
+        if (len - offset < 4)
+        {
+            return -1;
+        }
+        offset += read_int32(data+offset, &event_data);
+    }
+    if (event_type == RtmpPCUCSetBufferLength)
+    {
+        if (len - offset < 4)
+        {
+            return -1;
+        }
+        offset += read_int32(data+offset, &extra_data);
+    }
+    return offset;
 }
 
 int RtmpUserControlPacket::get_pkg_len()
@@ -1107,6 +1415,7 @@ int RtmpUserControlPacket::encode_pkg(uint8_t *payload, int size)
 }
 
 RtmpCallPacket::RtmpCallPacket() {
+    kind = KIND;
     command_name = "";
     number = 0;
     object = nullptr;
@@ -1224,6 +1533,7 @@ int RtmpCallPacket::encode_pkg(uint8_t *payload, int size) {
 }
 
 RtmpCallResponsePacket::RtmpCallResponsePacket(double id) {
+    kind = KIND;
     command_name = "_result";
     number = id;
     object = nullptr;
@@ -1298,6 +1608,7 @@ int RtmpCallResponsePacket::encode_pkg(uint8_t *payload, int size) {
 }
 
 RtmpCreateStreamPacket::RtmpCreateStreamPacket() {
+    kind = KIND;
     command_name = "createStream";
     number = 2;
     object = RtmpAmf0Any::null();
@@ -1371,6 +1682,7 @@ int RtmpCreateStreamPacket::encode_pkg(uint8_t *payload, int size) {
 }
 
 RtmpCreateStreamResponsePacket::RtmpCreateStreamResponsePacket(double id, double streamid) {
+    kind = KIND;
     command_name = "_result";
     number = id;
     object = RtmpAmf0Any::null();
@@ -1453,6 +1765,7 @@ int RtmpCreateStreamResponsePacket::encode_pkg(uint8_t *payload, int size) {
 }
 
 RtmpCloseStreamPacket::RtmpCloseStreamPacket() {
+    kind = KIND;
     command_name = "closeStream";
     number = 0;
     object = RtmpAmf0Any::null();
@@ -1503,6 +1816,7 @@ int RtmpCloseStreamPacket::encode_pkg(uint8_t *payload, int size) {
 }
 
 RtmpFMLEStartPacket::RtmpFMLEStartPacket() {
+    kind = KIND;
     command_name = "releaseStream";
     number = 0;
     object = RtmpAmf0Any::null();
@@ -1601,6 +1915,7 @@ RtmpFMLEStartPacket *RtmpFMLEStartPacket::create_FC_publish(std::string stream)
 }
 
 RtmpFMLEStartResponsePacket::RtmpFMLEStartResponsePacket(double id) {
+    kind = KIND;
     command_name = "_result";
     number = id;
     object = RtmpAmf0Any::null();
@@ -1686,6 +2001,7 @@ int RtmpFMLEStartResponsePacket::encode_pkg(uint8_t *payload, int size) {
 }
 
 RtmpPublishPacket::RtmpPublishPacket() {
+    kind = KIND;
 	command_name = "publish";
 	number = 0;
 	object = RtmpAmf0Any::null();
@@ -1782,6 +2098,7 @@ int RtmpPublishPacket::encode_pkg(uint8_t *payload, int size) {
 }
 
 RtmpPausePacket::RtmpPausePacket() {
+    kind = KIND;
 	command_name = "pause";
 	number = 0;
 	object = RtmpAmf0Any::null();
@@ -1848,6 +2165,7 @@ int RtmpPausePacket::encode_pkg(uint8_t *payload, int size) {
 }
 
 RtmpPlayPacket::RtmpPlayPacket() {
+    kind = KIND;
 	command_name = "play";
 	number = 0;
 	object = RtmpAmf0Any::null();
@@ -2003,6 +2321,7 @@ int RtmpPlayPacket::encode_pkg(uint8_t *payload, int size) {
 }
 
 RtmpPlayResponsePacket::RtmpPlayResponsePacket() {
+    kind = KIND;
 	command_name = "_result";
 	number = 0;
 	object = RtmpAmf0Any::null();
@@ -2063,6 +2382,7 @@ int RtmpPlayResponsePacket::encode_pkg(uint8_t *payload, int size) {
 }
 
 RtmpOnBWDonePacket::RtmpOnBWDonePacket() {
+    kind = KIND;
     command_name = "onBWDone";
     number = 0;
     args = RtmpAmf0Any::null();
@@ -2115,6 +2435,7 @@ int RtmpOnBWDonePacket::encode_pkg(uint8_t * payload, int size) {
 }
 
 RtmpOnStatusCallPacket::RtmpOnStatusCallPacket() {
+    kind = KIND;
     command_name = "onStatus";
     number = 0;
     args = RtmpAmf0Any::null();
@@ -2174,6 +2495,7 @@ int RtmpOnStatusCallPacket::encode_pkg(uint8_t * payload, int size) {
 }
 
 RtmpOnStatusDataPacket::RtmpOnStatusDataPacket() {
+    kind = KIND;
     command_name = "onStatus";
     data = RtmpAmf0Any::object();
 }
@@ -2218,6 +2540,7 @@ int RtmpOnStatusDataPacket::encode_pkg(uint8_t * payload, int size) {
 }
 
 RtmpSampleAccessPacket::RtmpSampleAccessPacket() {
+    kind = KIND;
     command_name = "|RtmpSampleAccess";
     video_sample_access = false;
     audio_sample_access = false;
@@ -2265,6 +2588,7 @@ int RtmpSampleAccessPacket::encode_pkg(uint8_t * payload, int size) {
 }
 
 RtmpOnMetaDataPacket::RtmpOnMetaDataPacket() {
+    kind = KIND;
     command_name = "onMetaData";
     metadata = RtmpAmf0Any::object();
 }
@@ -2346,3 +2670,76 @@ int RtmpOnMetaDataPacket::encode_pkg(uint8_t * payload, int size) {
     return offset;
 }
 
+RtmpAmf0ViewPacket::RtmpAmf0ViewPacket(RtmpAmf0Arena *arena, uint8_t msg_type) {
+    kind = KIND;
+    this->arena = arena;
+    this->msg_type = msg_type;
+    number = 0;
+    values = nullptr;
+    count = 0;
+}
+
+RtmpAmf0ViewPacket::~RtmpAmf0ViewPacket() {
+    // values live in arena
+}
+
+RtmpAmf0View* RtmpAmf0ViewPacket::value_at(int index) {
+    RtmpAmf0View *p = values;
+
+    for (int i = 0; i < index && p != nullptr; i++) {
+        p = p->next;
+    }
+    return p;
+}
+
+int RtmpAmf0ViewPacket::decode(uint8_t *data, int len) {
+    int ret;
+    int offset = 0;
+    RtmpAmf0View **tail = &values;
+
+    ret = rtmp_amf0_read_string(data+offset, len-offset, command_name);
+    if (ret < 0) {
+        return ret;
+    }
+    offset += ret;
+    if (msg_type == RTMP_MSG_AMF0CommandMessage || msg_type == RTMP_MSG_AMF3CommandMessage) {
+        ret = rtmp_amf0_read_number(data+offset, len-offset, number);
+        if (ret < 0) {
+            return ret;
+        }
+        offset += ret;
+    }
+    else if (command_name == "@setDataFrame") {
+        ret = rtmp_amf0_read_string(data+offset, len-offset, command_name);
+        if (ret < 0) {
+            return ret;
+        }
+        offset += ret;
+    }
+    while (offset < len) {
+        ret = rtmp_amf0_read_view(data+offset, len-offset, arena, tail);
+        if (ret < 0) {
+            return ret;
+        }
+        offset += ret;
+        tail = &(*tail)->next;
+        count++;
+    }
+    return offset;
+}
+
+int RtmpAmf0ViewPacket::get_pkg_len() {
+    return 0;
+}
+
+int RtmpAmf0ViewPacket::get_cs_id() {
+    return RTMP_CID_OverConnection;
+}
+
+int RtmpAmf0ViewPacket::get_msg_type() {
+    return msg_type;
+}
+
+int RtmpAmf0ViewPacket::encode_pkg(uint8_t *payload, int size) {
+    return -1;
+}
@@ -8,6 +8,7 @@
 #include <string>
 #include <vector>
 #include "app_protocol/rtmp/rtmp_stack_amf0.h"
+#include "DataBuf.h"
 
 #define RTMP_AMF0_NUMBER  0x00
 #define RTMP_AMF0_BOOLEAN 0x01
@@ -35,10 +36,12 @@
 #define RTMP_CHUNK_FMT2_TYPE 2
 #define RTMP_CHUNK_FMT3_TYPE 3
 
-#define RTMP_CHUNK_FMT0_HEADER_MAX_SIZE 16
-#define RTMP_CHUNK_FMT1_HEADER_MAX_SIZE 12
-#define RTMP_CHUNK_FMT2_HEADER_MAX_SIZE 8
-#define RTMP_CHUNK_FMT3_HEADER_MAX_SIZE 5
+// basic header is 1 byte for cs id < 64, 2 bytes < 320, else 3 bytes
+#define RTMP_CHUNK_BASIC_HEADER_MAX_SIZE 3
+#define RTMP_CHUNK_FMT0_HEADER_MAX_SIZE 18
+#define RTMP_CHUNK_FMT1_HEADER_MAX_SIZE 14
+#define RTMP_CHUNK_FMT2_HEADER_MAX_SIZE 10
+#define RTMP_CHUNK_FMT3_HEADER_MAX_SIZE 7
 
 #define RTMP_EXTENDED_TIMESTAMP    0xffffff
 
@@ -162,6 +165,7 @@ private:
     int decode_msg_header(uint8_t *data, int length);
 
 private:
+    int encode_basic_header(uint8_t *data, uint8_t fmt);
     int encode_fmt0_chunk_header(uint8_t *data, int size);
     int encode_fmt1_chunk_header(uint8_t *data, int size);
     int encode_fmt2_chunk_header(uint8_t *data, int size);
@@ -176,33 +180,71 @@ public:
     virtual ~RtmpChunkData();
 
 public:
+    // buffer of last message is reused when no view of it is alive,
+    // otherwise a new one is leased from pool
     void create_payload(int length);
     void copy_payload(uint8_t *data, int len);
     uint32_t get_current_len() const { return current_payload_len; }
-    void reset() { current_payload_len = 0; payload = nullptr;}
-    uint8_t* getPaylaod() const { return payload; }
+    // message complete, return view of body and caller own one reference
+    SharedBuffer* finish_payload();
 
 public:
     RtmpHeader h;
     uint32_t time_delta;
+    bool extended_timestamp;
 
 private:
-    uint8_t *payload;
+    SharedBuffer *payload;
     uint32_t current_payload_len;
 };
 
+// concrete type of packet, checked by rtmp_packet_cast instead of dynamic_cast
+enum RtmpPacketKind
+{
+    RTMP_PACKET_UNKNOWN = 0,
+    RTMP_PACKET_AUDIO,
+    RTMP_PACKET_AVC,
+    RTMP_PACKET_VIDEO,
+    RTMP_PACKET_CONNECT,
+    RTMP_PACKET_CONNECT_RESPONSE,
+    RTMP_PACKET_SET_WINDOW_ACK_SIZE,
+    RTMP_PACKET_ACKNOWLEDGEMENT,
+    RTMP_PACKET_SET_CHUNK_SIZE,
+    RTMP_PACKET_SET_PEER_BANDWIDTH,
+    RTMP_PACKET_USER_CONTROL,
+    RTMP_PACKET_CALL,
+    RTMP_PACKET_CALL_RESPONSE,
+    RTMP_PACKET_CREATE_STREAM,
+    RTMP_PACKET_CREATE_STREAM_RESPONSE,
+    RTMP_PACKET_CLOSE_STREAM,
+    RTMP_PACKET_FMLE_START,
+    RTMP_PACKET_FMLE_START_RESPONSE,
+    RTMP_PACKET_PUBLISH,
+    RTMP_PACKET_PAUSE,
+    RTMP_PACKET_PLAY,
+    RTMP_PACKET_PLAY_RESPONSE,
+    RTMP_PACKET_ON_BW_DONE,
+    RTMP_PACKET_ON_STATUS_CALL,
+    RTMP_PACKET_ON_STATUS_DATA,
+    RTMP_PACKET_SAMPLE_ACCESS,
+    RTMP_PACKET_ON_METADATA,
+    RTMP_PACKET_AMF0_VIEW,
+    RTMP_PACKET_MEDIA,
+};
+
 class RtmpBasePacket
 {
 public:
     RtmpBasePacket() {
-
+        kind = RTMP_PACKET_UNKNOWN;
     }
     virtual ~RtmpBasePacket() {
 
     }
 
 public:
-    virtual int encode(uint8_t *&payload, int &size) ;
+    // payload point into buffer, caller own one reference of buffer
+    virtual int encode(SharedBuffer *&buffer, uint8_t *&payload, int &size);
     virtual uint32_t getTimestamp() {return 0;}
 
 public:
@@ -213,11 +255,29 @@ public:
 public:
     virtual int get_cs_id() = 0;
     virtual int get_msg_type() = 0;
+
+public:
+    // RtmpPacketKind, set by constructor of sub class
+    uint8_t kind;
 };
 
+template<typename T>
+T* rtmp_packet_cast(RtmpBasePacket *pkg)
+{
+    return (pkg != nullptr && pkg->kind == T::KIND) ? static_cast<T*>(pkg) : nullptr;
+}
+
+// fnv-1a of amf command name, constexpr so it can be case label and table key
+constexpr uint32_t rtmp_command_hash(const char *name, uint32_t hash = 2166136261u)
+{
+    return *name ? rtmp_command_hash(name + 1, (hash ^ (uint8_t)*name) * 16777619u) : hash;
+}
+
 class RtmpAudioPacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_AUDIO;
+
     // only pcmu
     uint8_t flag;
     uint32_t timestamp;
@@ -227,12 +287,15 @@ public:
 public:
     RtmpAudioPacket();
     RtmpAudioPacket(int len);
+    // reference body, tag header is written in body headroom when encode
+    RtmpAudioPacket(SharedBuffer *body);
     virtual ~RtmpAudioPacket();
 
 public:
     virtual uint32_t getTimestamp();
 
 public:
+    virtual int encode(SharedBuffer *&buffer, uint8_t *&payload, int &size);
     virtual int encode_pkg(uint8_t *payload, int size);
     virtual int decode(uint8_t *data, int len);
     virtual int get_pkg_len();
@@ -240,11 +303,16 @@ public:
 public:
     virtual int get_cs_id();
     virtual int get_msg_type();
+
+private:
+    SharedBuffer *body;
 };
 
 class RtmpAVCPacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_AVC;
+
     uint8_t *sps;
     int spslen;
     uint8_t *pps;
@@ -267,6 +335,9 @@ public:
 
 class RtmpVideoPacket : public RtmpBasePacket
 {
+public:
+    static const uint8_t KIND = RTMP_PACKET_VIDEO;
+
     class H264Nalu
     {
     public:
@@ -291,12 +362,15 @@ public:
 public:
     RtmpVideoPacket();
     RtmpVideoPacket(int len);
+    // reference one frame in body as avcc nalus, tag header is written in body headroom when encode
+    RtmpVideoPacket(SharedBuffer *body);
     virtual ~RtmpVideoPacket();
 
 public:
     virtual uint32_t getTimestamp();
 
 public:
+    virtual int encode(SharedBuffer *&buffer, uint8_t *&payload, int &size);
     virtual int encode_pkg(uint8_t *payload, int size);
     virtual int decode(uint8_t *data, int len);
     virtual int get_pkg_len();
@@ -304,11 +378,74 @@ public:
 public:
     virtual int get_cs_id();
     virtual int get_msg_type();
+
+private:
+    int encode_header(uint8_t *payload);
+
+private:
+    SharedBuffer *body;
+};
+
+// audio or video message in passthrough mode, reference the reassembled body
+// and only parse the tag header, nalus are walked on demand
+class RtmpMediaPacket : public RtmpBasePacket
+{
+public:
+    static const uint8_t KIND = RTMP_PACKET_MEDIA;
+
+public:
+    uint8_t msg_type;
+    uint32_t timestamp;
+    // video frame type, 1 keyframe 2 inter frame, 0 for audio
+    uint8_t frame_type;
+    // video codec id or audio sound format
+    uint8_t codec_id;
+    // avc or aac packet type, -1 when codec has none
+    int8_t packet_type;
+    int32_t composition_time;
+    // avc nalu length field size 1, 2 or 4, parsed from sequence header,
+    // transport apply it to later tags of the stream, 4 before any header
+    int nalu_length_size;
+
+public:
+    RtmpMediaPacket(uint8_t msg_type, SharedBuffer *body);
+    virtual ~RtmpMediaPacket();
+
+public:
+    SharedBuffer* get_body() const { return body; }
+    bool is_video() const { return msg_type == RTMP_MSG_VideoMessage; }
+    bool is_keyframe() const;
+    bool is_sequence_header() const;
+    // codec data after tag header
+    const uint8_t* payload() const;
+    int payload_len() const;
+    // offset start from 0, false at end or when nalu length exceed body
+    bool next_nalu(int &offset, const uint8_t *&nalu, int &nalulen) const;
+
+public:
+    virtual uint32_t getTimestamp();
+
+public:
+    // relay as it is, body is sent without copy
+    virtual int encode(SharedBuffer *&buffer, uint8_t *&payload, int &size);
+    virtual int encode_pkg(uint8_t *payload, int size);
+    virtual int decode(uint8_t *data, int len);
+    virtual int get_pkg_len();
+
+public:
+    virtual int get_cs_id();
+    virtual int get_msg_type();
+
+private:
+    SharedBuffer *body;
+    int header_len;
 };
 
 class RtmpConnectPacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_CONNECT;
+
     std::string command_name;
     double number;
     RtmpAmf0Object *command_object;
@@ -330,6 +467,8 @@ public:
 class RtmpConnectResponsePacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_CONNECT_RESPONSE;
+
     std::string command_name;
     double number;
     RtmpAmf0Object *object;
@@ -352,6 +491,8 @@ public:
 class RtmpSetWindowAckSizePacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_SET_WINDOW_ACK_SIZE;
+
     int32_t window_ack_size;
 
 public:
@@ -371,6 +512,8 @@ public:
 class RtmpAcknowledgementPacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_ACKNOWLEDGEMENT;
+
     uint32_t sequence_number;
 
 public:
@@ -391,6 +534,8 @@ public:
 class RtmpSetChunkSizePacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_SET_CHUNK_SIZE;
+
     int32_t chunk_size;
 
 public:
@@ -417,6 +562,8 @@ enum RtmpPeerBandwidthType
 class RtmpSetPeerBandwidthPacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_SET_PEER_BANDWIDTH;
+
     int32_t bandwidth;
     uint8_t type;
 
@@ -449,6 +596,8 @@ enum RtmpPCUCEventType
 class RtmpUserControlPacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_USER_CONTROL;
+
     int16_t event_type;
     int32_t event_data;
     int32_t extra_data;
@@ -470,6 +619,8 @@ public:
 class RtmpCallPacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_CALL;
+
     std::string command_name;
     double number;
     RtmpAmf0Any *object;
@@ -492,6 +643,8 @@ public:
 class RtmpCallResponsePacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_CALL_RESPONSE;
+
     std::string command_name;
     double number;
     RtmpAmf0Any *object;
@@ -514,6 +667,8 @@ public:
 class RtmpCreateStreamPacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_CREATE_STREAM;
+
     std::string command_name;
     double number;
     RtmpAmf0Any *object;
@@ -535,6 +690,8 @@ public:
 class RtmpCreateStreamResponsePacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_CREATE_STREAM_RESPONSE;
+
     std::string command_name;
     double number;
     RtmpAmf0Any *object;
@@ -557,6 +714,8 @@ public:
 class RtmpCloseStreamPacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_CLOSE_STREAM;
+
     std::string command_name;
     double number;
     RtmpAmf0Any *object;
@@ -578,6 +737,8 @@ public:
 class RtmpFMLEStartPacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_FMLE_START;
+
     std::string command_name;
     double number;
     RtmpAmf0Any *object;
@@ -604,6 +765,8 @@ public:
 class RtmpFMLEStartResponsePacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_FMLE_START_RESPONSE;
+
     std::string command_name;
     double number;
     RtmpAmf0Any *object;
@@ -626,6 +789,8 @@ public:
 class RtmpPublishPacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_PUBLISH;
+
     std::string command_name;
     double number;
     RtmpAmf0Any *object;
@@ -649,6 +814,8 @@ public:
 class RtmpPausePacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_PAUSE;
+
     std::string command_name;
     double number;
     RtmpAmf0Any *object;
@@ -672,6 +839,8 @@ public:
 class RtmpPlayPacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_PLAY;
+
     std::string command_name;
     double number;
     RtmpAmf0Any *object;
@@ -697,6 +866,8 @@ public:
 class RtmpPlayResponsePacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_PLAY_RESPONSE;
+
     std::string command_name;
     double number;
     RtmpAmf0Any *object;
@@ -719,6 +890,8 @@ public:
 class RtmpOnBWDonePacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_ON_BW_DONE;
+
     std::string command_name;
     double number;
     RtmpAmf0Any *args;
@@ -740,6 +913,8 @@ public:
 class RtmpOnStatusCallPacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_ON_STATUS_CALL;
+
     std::string command_name;
     double number;
     RtmpAmf0Any *args;
@@ -762,6 +937,8 @@ public:
 class RtmpOnStatusDataPacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_ON_STATUS_DATA;
+
     std::string command_name;
     RtmpAmf0Object *data;
 
@@ -782,6 +959,8 @@ public:
 class RtmpSampleAccessPacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_SAMPLE_ACCESS;
+
     std::string command_name;
     bool video_sample_access;
     bool audio_sample_access;
@@ -803,6 +982,8 @@ public:
 class RtmpOnMetaDataPacket : public RtmpBasePacket
 {
 public:
+    static const uint8_t KIND = RTMP_PACKET_ON_METADATA;
+
     std::string command_name;
     RtmpAmf0Object *metadata;
 
@@ -820,4 +1001,38 @@ public:
     virtual int encode_pkg(uint8_t *payload, int size);
 };
 
+// received command or data message, e.g. onStatus, onMetaData, onCuePoint
+// values are views into arena and message body owned by transport, only valid until next message is decoded
+class RtmpAmf0ViewPacket : public RtmpBasePacket
+{
+public:
+    static const uint8_t KIND = RTMP_PACKET_AMF0_VIEW;
+
+    std::string command_name;
+    double number;  // transaction id, 0 for data message
+    RtmpAmf0View *values;   // arguments after name and transaction id, in order
+    int count;
+
+public:
+    RtmpAmf0ViewPacket(RtmpAmf0Arena *arena, uint8_t msg_type);
+    virtual ~RtmpAmf0ViewPacket();
+
+public:
+    RtmpAmf0View* value_at(int index);
+
+public:
+    virtual int decode(uint8_t *data, int len);
+    virtual int get_pkg_len();
+    virtual int get_cs_id();
+    virtual int get_msg_type();
+
+public:
+    // decode only
+    virtual int encode_pkg(uint8_t *payload, int size);
+
+private:
+    RtmpAmf0Arena *arena;
+    uint8_t msg_type;
+};
+
 #endif //RTMP_CLIENT_RTMP_STACK_PACKET_H
@@ -203,30 +203,40 @@ WebSocketProtocolServer::~WebSocketProtocolServer()
 	DLOG("delete ws protocol server\n");
 }
 
-int WebSocketProtocolServer::doHandShake(std::string &handshakedata)
+int WebSocketProtocolServer::parseRequest(std::string &requestdata)
 {
-	char p[32] = { 0 };
-	if (handshakedata.find("\r\n\r\n") != std::string::npos)
+	if (requestdata.find("\r\n\r\n") == std::string::npos)
 	{
-		std::istringstream is(handshakedata);
-		std::string line;
-		while (getline(is, line))
-		{
-			parse_line(line);
-		}
-		if (upgrade != "websocket" || connection != "Upgrade" || version != "13" || key.empty())
+		return -1;
+	}
+	std::istringstream is(requestdata);
+	std::string line;
+	method = -1;
+	while (getline(is, line))
+	{
+		if (parse_line(line) < 0)
 		{
 			return -1;
 		}
-		std::string tmp = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-		shacalc(tmp.data(), p);
-		accept.append(p);
-		return 0;
 	}
-	else
+	return 0;
+}
+
+int WebSocketProtocolServer::doHandShake(std::string &handshakedata)
+{
+	char p[32] = { 0 };
+	if (parseRequest(handshakedata) != 0)
 	{
 		return -1;
 	}
+	if (upgrade != "websocket" || connection != "Upgrade" || version != "13" || key.empty())
+	{
+		return -1;
+	}
+	std::string tmp = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+	shacalc(tmp.data(), p);
+	accept.append(p);
+	return 0;
 }
 
 int WebSocketProtocolServer::doResponse(std::string &responsedata)
@@ -81,6 +81,11 @@ public:
 	virtual int doHandShake(std::string &handshakedata);
 	virtual int doResponse(std::string &responsedata);
 	virtual void initParam(int method, std::string &path, std::string &host, std::string &extensions);
+	// request line and headers only, for plain http served on same port, 0 success -1 fail
+	int parseRequest(std::string &requestdata);
+	int getMethod() const { return method; }
+	const std::string& getPath() const { return path; }
+	bool isUpgrade() const { return upgrade == "websocket"; }
 
 private:
 	int parse_line(std::string &line);
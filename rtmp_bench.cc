@@ -0,0 +1,200 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <ctime>
+#include <functional>
+#include <unistd.h>
+
+#include "net/NetCore.h"
+#include "base/logger.h"
+#include "rtmpclient.h"
+#include "rtmp_metrics.h"
+
+struct BenchStage
+{
+    const char *name;
+    std::function<const LatencyHistogram&(RtmpSessionMetrics*)> histogram;
+};
+
+static void printStages(std::vector<RtmpPublishClient*> &clients)
+{
+    std::vector<BenchStage> stages = {
+        {"capture", [](RtmpSessionMetrics *m) -> const LatencyHistogram& { return m->capture_time; }},
+        {"encode", [](RtmpSessionMetrics *m) -> const LatencyHistogram& { return m->encode_time; }},
+        {"queue", [](RtmpSessionMetrics *m) -> const LatencyHistogram& { return m->encode_to_send; }},
+        {"chunk", [](RtmpSessionMetrics *m) -> const LatencyHistogram& { return m->chunk_time; }},
+        {"write", [](RtmpSessionMetrics *m) -> const LatencyHistogram& { return m->write_time; }},
+        {"total", [](RtmpSessionMetrics *m) -> const LatencyHistogram& { return m->capture_to_send; }},
+    };
+
+    printf("%-8s %10s %10s %10s %10s %10s\n", "stage", "count", "mean_ms", "p50_ms", "p99_ms", "p999_ms");
+    for (auto iter = stages.begin(); iter != stages.end(); ++iter) {
+        LatencyHistogram all;
+        for (auto client = clients.begin(); client != clients.end(); ++client) {
+            all.merge(iter->histogram((*client)->metrics()));
+        }
+        uint64_t count = all.count();
+        printf("%-8s %10llu %10.3f %10.3f %10.3f %10.3f\n", iter->name, (unsigned long long)count,
+               count ? all.sumUs() / 1000.0 / count : 0.0, all.quantile(0.5) / 1000.0,
+               all.quantile(0.99) / 1000.0, all.quantile(0.999) / 1000.0);
+    }
+}
+
+static void sumCounters(std::vector<RtmpClient*> &clients, bool in, uint64_t &bytes, uint64_t &frames, uint64_t &dropped)
+{
+    bytes = frames = dropped = 0;
+    for (auto iter = clients.begin(); iter != clients.end(); ++iter) {
+        RtmpSessionMetrics *m = (*iter)->metrics();
+        if (in) {
+            bytes += m->bytes_in.load(std::memory_order_relaxed);
+            frames += m->video_frames_in.load(std::memory_order_relaxed);
+        }
+        else {
+            bytes += m->bytes_out.load(std::memory_order_relaxed);
+            frames += m->video_frames_out.load(std::memory_order_relaxed);
+        }
+        dropped += m->media_dropped.load(std::memory_order_relaxed);
+    }
+}
+
+// print every second until duration, cpu is of whole process
+static void runReport(std::vector<RtmpClient*> &clients, bool in, int seconds)
+{
+    uint64_t lastBytes = 0, lastFrames = 0;
+    uint64_t bytes, frames, dropped;
+    std::clock_t lastCpu = std::clock();
+    int sessions = (int)clients.size();
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+    for (int i = 1; i <= seconds; i++) {
+        std::this_thread::sleep_until(begin + std::chrono::seconds(i));
+        sumCounters(clients, in, bytes, frames, dropped);
+        std::clock_t cpu = std::clock();
+        printf("%4d s  %s %8.3f Mbps  video %6.1f fps/session  dropped %llu  cpu %5.1f%%\n", i, in ? "recv" : "send",
+               (bytes - lastBytes) * 8 / 1000000.0, (double)(frames - lastFrames) / sessions,
+               (unsigned long long)dropped, (cpu - lastCpu) * 100.0 / CLOCKS_PER_SEC);
+        lastBytes = bytes;
+        lastFrames = frames;
+        lastCpu = cpu;
+    }
+
+    sumCounters(clients, in, bytes, frames, dropped);
+    printf("sustained %.3f Mbps total, %.3f Mbps and %.1f fps per session, dropped %llu\n",
+           bytes * 8 / 1000000.0 / seconds, bytes * 8 / 1000000.0 / seconds / sessions,
+           (double)frames / seconds / sessions, (unsigned long long)dropped);
+}
+
+// usage: rtmp_bench play [url] [players] [seconds] [passthrough, 0 decode every nalu]
+static int runPlay(int argc, char *argv[])
+{
+    std::string url = "rtmp://127.0.0.1:1935/live/bench";
+    int players = 100;
+    int seconds = 30;
+    bool passthrough = true;
+
+    if (argc > 2) {
+        url = argv[2];
+    }
+    if (argc > 3) {
+        players = atoi(argv[3]);
+    }
+    if (argc > 4) {
+        seconds = atoi(argv[4]);
+    }
+    if (argc > 5) {
+        passthrough = atoi(argv[5]) != 0;
+    }
+
+    LogCore::Logger::instance()->startup();
+    NETIOMANAGER->init(0);
+
+    std::vector<RtmpClient*> clients;
+    for (int i = 0; i < players; i++) {
+        RtmpPlayClient *client = new RtmpPlayClient(url, true);
+        client->setMediaPassthrough(passthrough);
+        client->start(0, 0, 0);
+        clients.push_back(client);
+    }
+    printf("bench %d players %s for %d s from %s\n", players, passthrough ? "passthrough" : "decode", seconds, url.c_str());
+
+    NETIOMANAGER->startup(false);
+    runReport(clients, true, seconds);
+    fflush(stdout);
+
+    LogCore::Logger::instance()->shutdown();
+    _exit(0);
+}
+
+// usage: rtmp_bench [url] [publishers] [seconds] [width] [height] [fps] [bitrate] [i420 file] [pcm file]
+// publisher i push to url_i when more than one, capture use generated pattern when file is empty or missing
+int main(int argc, char *argv[]) {
+
+    std::string url = "rtmp://127.0.0.1:1935/live/bench";
+    int publishers = 1;
+    int seconds = 30;
+    int width = 640;
+    int height = 480;
+    int fps = 25;
+    int bitrate = 800000;
+    std::string videoSource;
+    std::string audioSource;
+
+    if (argc > 1 && std::string(argv[1]) == "play") {
+        return runPlay(argc, argv);
+    }
+    if (argc > 1) {
+        url = argv[1];
+    }
+    if (argc > 2) {
+        publishers = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        seconds = atoi(argv[3]);
+    }
+    if (argc > 4) {
+        width = atoi(argv[4]);
+    }
+    if (argc > 5) {
+        height = atoi(argv[5]);
+    }
+    if (argc > 6) {
+        fps = atoi(argv[6]);
+    }
+    if (argc > 7) {
+        bitrate = atoi(argv[7]);
+    }
+    if (argc > 8) {
+        videoSource = argv[8];
+    }
+    if (argc > 9) {
+        audioSource = argv[9];
+    }
+
+    LogCore::Logger::instance()->startup();
+    NETIOMANAGER->init(0);
+
+    std::vector<RtmpPublishClient*> clients;
+    std::vector<RtmpClient*> sessions;
+    for (int i = 0; i < publishers; i++) {
+        std::string streamUrl = publishers > 1 ? url + "_" + std::to_string(i) : url;
+        RtmpPublishClient *client = new RtmpPublishClient(streamUrl, true);
+        client->setCaptureSource(videoSource, audioSource, fps);
+        client->start(width, height, bitrate);
+        clients.push_back(client);
+        sessions.push_back(client);
+    }
+    printf("bench %d publishers %dx%d@%d %d bps for %d s to %s\n", publishers, width, height, fps, bitrate, seconds, url.c_str());
+
+    // every loop run in own thread, main thread only report
+    NETIOMANAGER->startup(false);
+    runReport(sessions, false, seconds);
+    printStages(clients);
+    fflush(stdout);
+
+    // sessions are not torn down, sockets are closed by process exit
+    LogCore::Logger::instance()->shutdown();
+    _exit(0);
+}
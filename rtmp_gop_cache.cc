@@ -0,0 +1,186 @@
+#include "rtmp_gop_cache.h"
+#include "app_protocol/rtmp/rtmp_stack_packet.h"
+#include "logger.h"
+
+RtmpGopCache::RtmpGopCache(int maxTags)
+{
+    max_tags_ = maxTags;
+    seq_ = 0;
+}
+
+RtmpGopCache::~RtmpGopCache()
+{
+    clear();
+    consumers_.clear();
+}
+
+bool RtmpGopCache::isMetaData(uint8_t type, const uint8_t *body, int length)
+{
+    std::string name;
+
+    if (type == RTMP_MSG_AMF3DataMessage) {
+        body++;
+        length--;
+    }
+    else if (type != RTMP_MSG_AMF0DataMessage) {
+        return false;
+    }
+    if (rtmp_amf0_read_string((uint8_t*)body, length, name) < 0) {
+        return false;
+    }
+    return name == "onMetaData" || name == "@setDataFrame";
+}
+
+bool RtmpGopCache::isVideoSequenceHeader(const uint8_t *body, int length)
+{
+    // avc codec and avc packet type 0
+    return length >= 2 && (body[0] & 0x0f) == 7 && body[1] == 0x00;
+}
+
+bool RtmpGopCache::isVideoKeyframe(const uint8_t *body, int length)
+{
+    return length >= 2 && (body[0] >> 4) == 1 && !isVideoSequenceHeader(body, length);
+}
+
+bool RtmpGopCache::isAudioSequenceHeader(const uint8_t *body, int length)
+{
+    // aac and aac packet type 0
+    return length >= 2 && (body[0] >> 4) == 10 && body[1] == 0x00;
+}
+
+void RtmpGopCache::setTag(RtmpMediaTag &dst, const RtmpMediaTag &src)
+{
+    if (src.body) {
+        src.body->ref();
+    }
+    if (dst.body) {
+        dst.body->unref();
+    }
+    dst = src;
+}
+
+void RtmpGopCache::clearGop()
+{
+    for (auto iter = gop_.begin(); iter != gop_.end(); ++iter) {
+        iter->body->unref();
+    }
+    gop_.clear();
+}
+
+void RtmpGopCache::onMessage(uint8_t type, uint32_t timestamp, SharedBuffer *buffer)
+{
+    RtmpMediaTag tag;
+    const uint8_t *body = buffer->data();
+    int length = buffer->len();
+
+    if (length <= 0) {
+        return;
+    }
+    tag.type = type;
+    tag.timestamp = timestamp;
+    tag.body = buffer;
+    buffer->ref();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    tag.seq = ++seq_;
+    if (type == RTMP_MSG_AMF0DataMessage || type == RTMP_MSG_AMF3DataMessage) {
+        if (isMetaData(type, body, length)) {
+            setTag(metadata_, tag);
+        }
+    }
+    else if (type == RTMP_MSG_VideoMessage && length >= 2) {
+        bool keyframe = isVideoKeyframe(body, length);
+        if (isVideoSequenceHeader(body, length)) {
+            setTag(video_header_, tag);
+        }
+        else if (keyframe || (!gop_.empty() && (int)gop_.size() < max_tags_)) {
+            if (keyframe) {
+                clearGop();
+            }
+            tag.body->ref();
+            gop_.push_back(tag);
+        }
+        else if (!gop_.empty()) {
+            // gop too long, new consumer wait for next keyframe
+            WLOG("gop cache exceed %d tags, drop it\n", max_tags_);
+            clearGop();
+        }
+    }
+    else if (type == RTMP_MSG_AudioMessage && length >= 2) {
+        if (isAudioSequenceHeader(body, length)) {
+            setTag(audio_header_, tag);
+        }
+        else if (!gop_.empty() && (int)gop_.size() < max_tags_) {
+            tag.body->ref();
+            gop_.push_back(tag);
+        }
+    }
+    for (auto iter = consumers_.begin(); iter != consumers_.end(); ++iter) {
+        (*iter)->onMediaTag(tag);
+    }
+    tag.body->unref();
+}
+
+void RtmpGopCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    RtmpMediaTag empty;
+    setTag(metadata_, empty);
+    setTag(video_header_, empty);
+    setTag(audio_header_, empty);
+    clearGop();
+}
+
+void RtmpGopCache::replayTags(IRtmpMediaConsumer *consumer)
+{
+    if (metadata_.body) {
+        consumer->onMediaTag(metadata_);
+    }
+    if (video_header_.body) {
+        consumer->onMediaTag(video_header_);
+    }
+    if (audio_header_.body) {
+        consumer->onMediaTag(audio_header_);
+    }
+    for (auto iter = gop_.begin(); iter != gop_.end(); ++iter) {
+        consumer->onMediaTag(*iter);
+    }
+}
+
+void RtmpGopCache::attach(IRtmpMediaConsumer *consumer)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto iter = consumers_.begin(); iter != consumers_.end(); ++iter) {
+        if (*iter == consumer) {
+            return;
+        }
+    }
+    // hold lock while replay, so no live tag can slip in between
+    replayTags(consumer);
+    consumers_.push_back(consumer);
+    ILOG("media consumer attach, replay %d tags\n", (int)gop_.size());
+}
+
+void RtmpGopCache::detach(IRtmpMediaConsumer *consumer)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto iter = consumers_.begin(); iter != consumers_.end(); ++iter) {
+        if (*iter == consumer) {
+            consumers_.erase(iter);
+            break;
+        }
+    }
+}
+
+uint64_t RtmpGopCache::replay(IRtmpMediaConsumer *consumer)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    replayTags(consumer);
+    return seq_;
+}
+
+int RtmpGopCache::size()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return (int)gop_.size();
+}
@@ -0,0 +1,85 @@
+#ifndef RTMP_CLIENT_RTMP_GOP_CACHE_H
+#define RTMP_CLIENT_RTMP_GOP_CACHE_H
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include "DataBuf.h"
+
+// tags since last keyframe, cache restart from next keyframe when exceed
+const int RTMP_GOP_CACHE_MAX_TAGS = 1024;
+
+// one rtmp audio/video/data message, body is the flv tag body
+struct RtmpMediaTag
+{
+    uint8_t type;
+    uint32_t timestamp;
+    SharedBuffer *body;
+    uint64_t seq;   // order of message in cache, 0 when not from cache
+
+    RtmpMediaTag() {
+        type = 0;
+        timestamp = 0;
+        body = nullptr;
+        seq = 0;
+    }
+};
+
+class IRtmpMediaConsumer
+{
+public:
+    IRtmpMediaConsumer() = default;
+    virtual ~IRtmpMediaConsumer() = default;
+
+public:
+    // calls are serialized, body is only valid in call, ref it to keep
+    virtual void onMediaTag(const RtmpMediaTag &tag) = 0;
+};
+
+// keep metadata, sequence headers and current gop of a play session,
+// consumer attached at any time start from keyframe without asking origin again
+class RtmpGopCache
+{
+public:
+    RtmpGopCache(int maxTags = RTMP_GOP_CACHE_MAX_TAGS);
+    virtual ~RtmpGopCache();
+
+public:
+    // called by session loop thread for every media message, body is referenced not copied
+    void onMessage(uint8_t type, uint32_t timestamp, SharedBuffer *body);
+    // stream restart, e.g. reconnect
+    void clear();
+
+public:
+    // can call in any thread, cached tags are replayed in caller thread before return
+    void attach(IRtmpMediaConsumer *consumer);
+    void detach(IRtmpMediaConsumer *consumer);
+    // replay cached tags without attach, return seq of last message seen by cache,
+    // consumer already attached skip live tags up to it
+    uint64_t replay(IRtmpMediaConsumer *consumer);
+    int size();
+
+public:
+    // flv tag body inspect
+    static bool isMetaData(uint8_t type, const uint8_t *body, int length);
+    static bool isVideoSequenceHeader(const uint8_t *body, int length);
+    static bool isVideoKeyframe(const uint8_t *body, int length);
+    static bool isAudioSequenceHeader(const uint8_t *body, int length);
+
+private:
+    void replayTags(IRtmpMediaConsumer *consumer);
+    void setTag(RtmpMediaTag &dst, const RtmpMediaTag &src);
+    void clearGop();
+
+private:
+    std::mutex mutex_;
+    RtmpMediaTag metadata_;
+    RtmpMediaTag video_header_;
+    RtmpMediaTag audio_header_;
+    std::deque<RtmpMediaTag> gop_;
+    std::vector<IRtmpMediaConsumer*> consumers_;
+    int max_tags_;
+    uint64_t seq_;
+};
+
+#endif //RTMP_CLIENT_RTMP_GOP_CACHE_H
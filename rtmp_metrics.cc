@@ -0,0 +1,396 @@
+#include "rtmp_metrics.h"
+#include "app_protocol/rtmp/rtmp_stack_packet.h"
+#include "logger.h"
+#include "utils.h"
+
+static const char* message_type_name(int type)
+{
+    switch (type)
+    {
+        case RTMP_MSG_SetChunkSize:
+            return "set_chunk_size";
+        case RTMP_MSG_AbortMessage:
+            return "abort";
+        case RTMP_MSG_Acknowledgement:
+            return "ack";
+        case RTMP_MSG_UserControlMessage:
+            return "user_control";
+        case RTMP_MSG_WindowAcknowledgementSize:
+            return "window_ack_size";
+        case RTMP_MSG_SetPeerBandwidth:
+            return "set_peer_bandwidth";
+        case RTMP_MSG_AudioMessage:
+            return "audio";
+        case RTMP_MSG_VideoMessage:
+            return "video";
+        case RTMP_MSG_AMF0DataMessage:
+            return "amf0_data";
+        case RTMP_MSG_AMF0CommandMessage:
+            return "amf0_command";
+        case RTMP_MSG_AMF3DataMessage:
+            return "amf3_data";
+        case RTMP_MSG_AMF3CommandMessage:
+            return "amf3_command";
+        case RTMP_MSG_AggregateMessage:
+            return "aggregate";
+        default:
+            return nullptr;
+    }
+}
+
+static std::string escape_label(const std::string &value)
+{
+    std::string out;
+    out.reserve(value.size());
+    for (size_t i = 0; i < value.size(); i++)
+    {
+        char c = value[i];
+        if (c == '\\' || c == '"')
+        {
+            out.push_back('\\');
+            out.push_back(c);
+        }
+        else if (c == '\n')
+        {
+            out.append("\\n");
+        }
+        else
+        {
+            out.push_back(c);
+        }
+    }
+    return out;
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+    for (int i = 0; i <= RTMP_METRICS_HISTOGRAM_BUCKETS; i++)
+    {
+        buckets_[i] = 0;
+    }
+    sum_ = 0;
+}
+
+int LatencyHistogram::bucketIndex(int64_t us)
+{
+    uint64_t value;
+    int bits;
+    int sub;
+
+    if (us <= (1LL << RTMP_METRICS_HISTOGRAM_MIN_BITS))
+    {
+        return 0;
+    }
+    // value in (2^bits, 2^(bits+1)], the top SUB_BITS below the highest bit select the sub bucket
+    value = (uint64_t)us - 1;
+    bits = 63 - __builtin_clzll(value);
+    if (bits >= RTMP_METRICS_HISTOGRAM_MAX_BITS)
+    {
+        return RTMP_METRICS_HISTOGRAM_BUCKETS;
+    }
+    sub = (int)(value >> (bits - RTMP_METRICS_HISTOGRAM_SUB_BITS)) & ((1 << RTMP_METRICS_HISTOGRAM_SUB_BITS) - 1);
+    return 1 + ((bits - RTMP_METRICS_HISTOGRAM_MIN_BITS) << RTMP_METRICS_HISTOGRAM_SUB_BITS) + sub;
+}
+
+int64_t LatencyHistogram::bucketBound(int index)
+{
+    int bits;
+    int sub;
+
+    if (index <= 0)
+    {
+        return 1LL << RTMP_METRICS_HISTOGRAM_MIN_BITS;
+    }
+    bits = RTMP_METRICS_HISTOGRAM_MIN_BITS + ((index - 1) >> RTMP_METRICS_HISTOGRAM_SUB_BITS);
+    sub = (index - 1) & ((1 << RTMP_METRICS_HISTOGRAM_SUB_BITS) - 1);
+    return (1LL << bits) + ((int64_t)(sub + 1) << (bits - RTMP_METRICS_HISTOGRAM_SUB_BITS));
+}
+
+void LatencyHistogram::record(int64_t us)
+{
+    if (us < 0)
+    {
+        us = 0;
+    }
+    buckets_[bucketIndex(us)].fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add((uint64_t)us, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::write(std::stringstream &ss, const std::string &name, const std::string &labels) const
+{
+    uint64_t cumulative = 0;
+
+    for (int i = 0; i < RTMP_METRICS_HISTOGRAM_BUCKETS; i++)
+    {
+        cumulative += buckets_[i].load(std::memory_order_relaxed);
+        ss << name << "_bucket{" << labels << ",le=\"" << bucketBound(i) / 1000000.0 << "\"} " << cumulative << "\n";
+    }
+    cumulative += buckets_[RTMP_METRICS_HISTOGRAM_BUCKETS].load(std::memory_order_relaxed);
+    // use bucket total as count, so +Inf and count always match in one scrape
+    ss << name << "_bucket{" << labels << ",le=\"+Inf\"} " << cumulative << "\n";
+    ss << name << "_sum{" << labels << "} " << sum_.load(std::memory_order_relaxed) / 1000000.0 << "\n";
+    ss << name << "_count{" << labels << "} " << cumulative << "\n";
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+    for (int i = 0; i <= RTMP_METRICS_HISTOGRAM_BUCKETS; i++)
+    {
+        buckets_[i].fetch_add(other.buckets_[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    sum_.fetch_add(other.sum_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::count() const
+{
+    uint64_t total = 0;
+
+    for (int i = 0; i <= RTMP_METRICS_HISTOGRAM_BUCKETS; i++)
+    {
+        total += buckets_[i].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+int64_t LatencyHistogram::quantile(double q) const
+{
+    uint64_t total = count();
+    uint64_t rank;
+    uint64_t cumulative = 0;
+
+    if (total == 0)
+    {
+        return 0;
+    }
+    rank = (uint64_t)(q * total);
+    if (rank >= total)
+    {
+        rank = total - 1;
+    }
+    for (int i = 0; i < RTMP_METRICS_HISTOGRAM_BUCKETS; i++)
+    {
+        cumulative += buckets_[i].load(std::memory_order_relaxed);
+        if (cumulative > rank)
+        {
+            return bucketBound(i);
+        }
+    }
+    // overflow bucket, report the largest bound
+    return bucketBound(RTMP_METRICS_HISTOGRAM_BUCKETS - 1);
+}
+
+RtmpSessionMetrics::RtmpSessionMetrics(const std::string &url, int dir)
+{
+    bytes_in = bytes_out = 0;
+    chunks_in = chunks_out = 0;
+    for (int i = 0; i < RTMP_METRICS_MSG_TYPE_MAX; i++)
+    {
+        messages_in[i] = 0;
+        messages_out[i] = 0;
+    }
+    reconnects = 0;
+    media_dropped = 0;
+    video_frames_in = video_frames_out = 0;
+    video_queue_depth = audio_queue_depth = 0;
+    write_pending_bytes = 0;
+    estimated_send_bps = 0;
+    video_target_bitrate = 0;
+    rtt_us = 0;
+    id_ = 0;
+    dir_ = dir;
+    url_ = url;
+    RTMPMETRICS->add(this);
+}
+
+RtmpSessionMetrics::~RtmpSessionMetrics()
+{
+    RTMPMETRICS->remove(this);
+}
+
+void RtmpSessionMetrics::addMessageIn(uint8_t type)
+{
+    if (type < RTMP_METRICS_MSG_TYPE_MAX)
+    {
+        messages_in[type].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void RtmpSessionMetrics::addMessageOut(uint8_t type)
+{
+    if (type < RTMP_METRICS_MSG_TYPE_MAX)
+    {
+        messages_out[type].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void RtmpSessionMetrics::recordSend(int64_t captureTime, int64_t encodeStartTime, int64_t encodeEndTime)
+{
+    int64_t now;
+
+    if (captureTime == 0 || encodeEndTime == 0)
+    {
+        return;
+    }
+    now = Utils::Util::getSteadyTimeUs();
+    encode_time.record(encodeEndTime - encodeStartTime);
+    capture_to_encode.record(encodeEndTime - captureTime);
+    encode_to_send.record(now - encodeEndTime);
+    capture_to_send.record(now - captureTime);
+}
+
+std::string RtmpSessionMetrics::labels() const
+{
+    std::stringstream ss;
+    ss << "session=\"" << id_ << "\",dir=\"" << (dir_ == 0 ? "publish" : "play") << "\",url=\"" << escape_label(url_) << "\"";
+    return ss.str();
+}
+
+RtmpMetricsRegistry::RtmpMetricsRegistry()
+{
+    next_id_ = 0;
+}
+
+RtmpMetricsRegistry::~RtmpMetricsRegistry()
+{
+    sessions_.clear();
+}
+
+void RtmpMetricsRegistry::add(RtmpSessionMetrics *metrics)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    metrics->id_ = next_id_++;
+    sessions_.push_back(metrics);
+}
+
+void RtmpMetricsRegistry::remove(RtmpSessionMetrics *metrics)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto iter = sessions_.begin(); iter != sessions_.end(); ++iter)
+    {
+        if (*iter == metrics)
+        {
+            sessions_.erase(iter);
+            break;
+        }
+    }
+}
+
+void RtmpMetricsRegistry::writeCounter(std::stringstream &ss, const std::string &name, const std::string &help, const std::string &type,
+                                       std::function<int64_t(RtmpSessionMetrics*)> value)
+{
+    ss << "# HELP " << name << " " << help << "\n";
+    ss << "# TYPE " << name << " " << type << "\n";
+    for (auto iter = sessions_.begin(); iter != sessions_.end(); ++iter)
+    {
+        ss << name << "{" << (*iter)->labels() << "} " << value(*iter) << "\n";
+    }
+}
+
+void RtmpMetricsRegistry::writeMessages(std::stringstream &ss, const std::string &name, const std::string &help, bool in)
+{
+    ss << "# HELP " << name << " " << help << "\n";
+    ss << "# TYPE " << name << " counter\n";
+    for (auto iter = sessions_.begin(); iter != sessions_.end(); ++iter)
+    {
+        std::string labels = (*iter)->labels();
+        for (int type = 0; type < RTMP_METRICS_MSG_TYPE_MAX; type++)
+        {
+            uint64_t count = in ? (*iter)->messages_in[type].load(std::memory_order_relaxed)
+                                : (*iter)->messages_out[type].load(std::memory_order_relaxed);
+            const char *typeName = message_type_name(type);
+            if (count == 0)
+            {
+                continue;
+            }
+            ss << name << "{" << labels << ",type=\"";
+            if (typeName != nullptr)
+            {
+                ss << typeName;
+            }
+            else
+            {
+                ss << type;
+            }
+            ss << "\"} " << count << "\n";
+        }
+    }
+}
+
+void RtmpMetricsRegistry::writeHistogram(std::stringstream &ss, const std::string &name, const std::string &help,
+                                         std::function<const LatencyHistogram&(RtmpSessionMetrics*)> histogram)
+{
+    ss << "# HELP " << name << " " << help << "\n";
+    ss << "# TYPE " << name << " histogram\n";
+    for (auto iter = sessions_.begin(); iter != sessions_.end(); ++iter)
+    {
+        histogram(*iter).write(ss, name, (*iter)->labels());
+    }
+}
+
+void RtmpMetricsRegistry::render(std::string &out)
+{
+    std::stringstream ss;
+    // session unregister in destructor, hold lock so it can not be freed while reading
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // latency sum is in seconds, default precision lose the us part
+    ss.precision(12);
+    writeCounter(ss, "rtmp_client_received_bytes_total", "Bytes received from rtmp server.", "counter",
+                 [](RtmpSessionMetrics *m) { return (int64_t)m->bytes_in.load(std::memory_order_relaxed); });
+    writeCounter(ss, "rtmp_client_sent_bytes_total", "Bytes sent to rtmp server.", "counter",
+                 [](RtmpSessionMetrics *m) { return (int64_t)m->bytes_out.load(std::memory_order_relaxed); });
+    writeCounter(ss, "rtmp_client_received_chunks_total", "Rtmp chunks received.", "counter",
+                 [](RtmpSessionMetrics *m) { return (int64_t)m->chunks_in.load(std::memory_order_relaxed); });
+    writeCounter(ss, "rtmp_client_sent_chunks_total", "Rtmp chunks sent.", "counter",
+                 [](RtmpSessionMetrics *m) { return (int64_t)m->chunks_out.load(std::memory_order_relaxed); });
+    writeMessages(ss, "rtmp_client_received_messages_total", "Rtmp messages decoded by type.", true);
+    writeMessages(ss, "rtmp_client_sent_messages_total", "Rtmp messages sent by type.", false);
+    writeCounter(ss, "rtmp_client_reconnects_total", "Reconnect attempts after connection lost.", "counter",
+                 [](RtmpSessionMetrics *m) { return (int64_t)m->reconnects.load(std::memory_order_relaxed); });
+    writeCounter(ss, "rtmp_client_media_dropped_total", "Frames or packets dropped because a queue is full.", "counter",
+                 [](RtmpSessionMetrics *m) { return (int64_t)m->media_dropped.load(std::memory_order_relaxed); });
+    writeCounter(ss, "rtmp_client_received_video_frames_total", "Video frames received, sequence headers excluded.", "counter",
+                 [](RtmpSessionMetrics *m) { return (int64_t)m->video_frames_in.load(std::memory_order_relaxed); });
+    writeCounter(ss, "rtmp_client_sent_video_frames_total", "Video frames sent, sequence headers excluded.", "counter",
+                 [](RtmpSessionMetrics *m) { return (int64_t)m->video_frames_out.load(std::memory_order_relaxed); });
+    writeCounter(ss, "rtmp_client_video_queue_depth", "Encoded video packets waiting for loop thread.", "gauge",
+                 [](RtmpSessionMetrics *m) { return m->video_queue_depth.load(std::memory_order_relaxed); });
+    writeCounter(ss, "rtmp_client_audio_queue_depth", "Encoded audio packets waiting for loop thread.", "gauge",
+                 [](RtmpSessionMetrics *m) { return m->audio_queue_depth.load(std::memory_order_relaxed); });
+    writeCounter(ss, "rtmp_client_write_pending_bytes", "Bytes queued in uv_write and not written to kernel.", "gauge",
+                 [](RtmpSessionMetrics *m) { return m->write_pending_bytes.load(std::memory_order_relaxed); });
+    writeCounter(ss, "rtmp_client_estimated_send_bps", "Uplink throughput measured from completed socket writes.", "gauge",
+                 [](RtmpSessionMetrics *m) { return m->estimated_send_bps.load(std::memory_order_relaxed); });
+    writeCounter(ss, "rtmp_client_video_target_bitrate", "Video encoder bitrate chosen by the publish controller.", "gauge",
+                 [](RtmpSessionMetrics *m) { return m->video_target_bitrate.load(std::memory_order_relaxed); });
+    writeCounter(ss, "rtmp_client_rtt_us", "Smoothed round trip time of user control ping.", "gauge",
+                 [](RtmpSessionMetrics *m) { return m->rtt_us.load(std::memory_order_relaxed); });
+    writeHistogram(ss, "rtmp_client_video_capture_seconds", "Time spent in capture device per video frame.",
+                   [](RtmpSessionMetrics *m) -> const LatencyHistogram& { return m->capture_time; });
+    writeHistogram(ss, "rtmp_client_video_encode_seconds", "Time spent in video encoder per frame.",
+                   [](RtmpSessionMetrics *m) -> const LatencyHistogram& { return m->encode_time; });
+    writeHistogram(ss, "rtmp_client_video_capture_to_encode_seconds", "Latency from capture to encoded packet.",
+                   [](RtmpSessionMetrics *m) -> const LatencyHistogram& { return m->capture_to_encode; });
+    writeHistogram(ss, "rtmp_client_video_encode_to_send_seconds", "Latency from encoded packet to socket write.",
+                   [](RtmpSessionMetrics *m) -> const LatencyHistogram& { return m->encode_to_send; });
+    writeHistogram(ss, "rtmp_client_video_capture_to_send_seconds", "Latency from capture to socket write.",
+                   [](RtmpSessionMetrics *m) -> const LatencyHistogram& { return m->capture_to_send; });
+    writeHistogram(ss, "rtmp_client_video_chunk_seconds", "Time to chunk one video message and submit it to socket.",
+                   [](RtmpSessionMetrics *m) -> const LatencyHistogram& { return m->chunk_time; });
+    writeHistogram(ss, "rtmp_client_write_seconds", "Latency from socket write submit to complete.",
+                   [](RtmpSessionMetrics *m) -> const LatencyHistogram& { return m->write_time; });
+    writeHistogram(ss, "rtmp_client_rtt_seconds", "Round trip time of user control ping.",
+                   [](RtmpSessionMetrics *m) -> const LatencyHistogram& { return m->rtt; });
+    out = ss.str();
+}
+
+int RtmpMetricsHttpHandle::http_server_handle(NetCore::HttpResponseWriter *writer, const std::string &data)
+{
+    std::string body;
+
+    RTMPMETRICS->render(body);
+    writer->set("Content-Type", "text/plain; version=0.0.4; charset=utf-8");
+    writer->set_content_len(body.length());
+    writer->set_body(body);
+    return 0;
+}
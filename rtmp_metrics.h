@@ -0,0 +1,142 @@
+#ifndef RTMP_CLIENT_RTMP_METRICS_H
+#define RTMP_CLIENT_RTMP_METRICS_H
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include "singleton.h"
+#include "NetCore.h"
+
+// rtmp message type id is less than 32
+const int RTMP_METRICS_MSG_TYPE_MAX = 32;
+// latency bucket start at 2^6 us, every power of 2 split into 2^SUB_BITS buckets, up to 2^24 us
+const int RTMP_METRICS_HISTOGRAM_MIN_BITS = 6;
+const int RTMP_METRICS_HISTOGRAM_MAX_BITS = 24;
+const int RTMP_METRICS_HISTOGRAM_SUB_BITS = 1;
+const int RTMP_METRICS_HISTOGRAM_BUCKETS = 1 + ((RTMP_METRICS_HISTOGRAM_MAX_BITS - RTMP_METRICS_HISTOGRAM_MIN_BITS) << RTMP_METRICS_HISTOGRAM_SUB_BITS);
+
+// log linear buckets like hdr histogram, record is lock free and can be called by any thread
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+    virtual ~LatencyHistogram() = default;
+
+public:
+    void record(int64_t us);
+    // upper bound in us of bucket index
+    static int64_t bucketBound(int index);
+    void write(std::stringstream &ss, const std::string &name, const std::string &labels) const;
+
+public:
+    // add counts of other, e.g. sum all sessions in a report
+    void merge(const LatencyHistogram &other);
+    uint64_t count() const;
+    int64_t sumUs() const { return (int64_t)sum_.load(std::memory_order_relaxed); }
+    // upper bound in us of bucket holding quantile q in [0, 1], 0 when empty
+    int64_t quantile(double q) const;
+
+private:
+    static int bucketIndex(int64_t us);
+
+private:
+    // last one count value larger than all bounds
+    std::atomic<uint64_t> buckets_[RTMP_METRICS_HISTOGRAM_BUCKETS + 1];
+    std::atomic<uint64_t> sum_;
+};
+
+// counters of one rtmp session, written by session threads and read by metrics http handle
+class RtmpSessionMetrics
+{
+public:
+    RtmpSessionMetrics(const std::string &url, int dir);
+    virtual ~RtmpSessionMetrics();
+
+public:
+    void addMessageIn(uint8_t type);
+    void addMessageOut(uint8_t type);
+    // latency of video packet from capture to encode and send, times from MediaData
+    void recordSend(int64_t captureTime, int64_t encodeStartTime, int64_t encodeEndTime);
+    std::string labels() const;
+
+public:
+    std::atomic<uint64_t> bytes_in;
+    std::atomic<uint64_t> bytes_out;
+    std::atomic<uint64_t> chunks_in;
+    std::atomic<uint64_t> chunks_out;
+    std::atomic<uint64_t> messages_in[RTMP_METRICS_MSG_TYPE_MAX];
+    std::atomic<uint64_t> messages_out[RTMP_METRICS_MSG_TYPE_MAX];
+    std::atomic<uint64_t> reconnects;
+    std::atomic<uint64_t> media_dropped;
+    // whole video frames, sequence headers not counted
+    std::atomic<uint64_t> video_frames_in;
+    std::atomic<uint64_t> video_frames_out;
+
+public:
+    // gauges
+    std::atomic<int64_t> video_queue_depth;
+    std::atomic<int64_t> audio_queue_depth;
+    std::atomic<int64_t> write_pending_bytes;
+    std::atomic<int64_t> estimated_send_bps;
+    std::atomic<int64_t> video_target_bitrate;
+    std::atomic<int64_t> rtt_us;    // smoothed ping rtt
+
+public:
+    LatencyHistogram capture_time;  // device produce one video frame
+    LatencyHistogram encode_time;
+    LatencyHistogram capture_to_encode;
+    LatencyHistogram encode_to_send;
+    LatencyHistogram capture_to_send;
+    LatencyHistogram chunk_time;    // chunk one video message and submit to socket
+    LatencyHistogram write_time;    // socket write submit to complete
+    LatencyHistogram rtt;
+
+private:
+    friend class RtmpMetricsRegistry;
+    int id_;
+    int dir_;
+    std::string url_;
+};
+
+class RtmpMetricsRegistry : public core::Singleton<RtmpMetricsRegistry>
+{
+public:
+    RtmpMetricsRegistry();
+    virtual ~RtmpMetricsRegistry();
+
+public:
+    void add(RtmpSessionMetrics *metrics);
+    void remove(RtmpSessionMetrics *metrics);
+    // prometheus text exposition format
+    void render(std::string &out);
+
+private:
+    void writeCounter(std::stringstream &ss, const std::string &name, const std::string &help, const std::string &type,
+                      std::function<int64_t(RtmpSessionMetrics*)> value);
+    void writeMessages(std::stringstream &ss, const std::string &name, const std::string &help, bool in);
+    void writeHistogram(std::stringstream &ss, const std::string &name, const std::string &help,
+                        std::function<const LatencyHistogram&(RtmpSessionMetrics*)> histogram);
+
+private:
+    std::mutex mutex_;
+    std::vector<RtmpSessionMetrics*> sessions_;
+    int next_id_;
+};
+
+#define RTMPMETRICS RtmpMetricsRegistry::instance()
+
+// register to HttpServer, e.g. registerHandle("/metrics", handle)
+class RtmpMetricsHttpHandle : public NetCore::IHttpServerHandle
+{
+public:
+    RtmpMetricsHttpHandle() = default;
+    virtual ~RtmpMetricsHttpHandle() = default;
+
+public:
+    virtual int http_server_handle(NetCore::HttpResponseWriter *writer, const std::string &data);
+};
+
+#endif //RTMP_CLIENT_RTMP_METRICS_H
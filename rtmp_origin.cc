@@ -0,0 +1,604 @@
+#include "rtmp_origin.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "autofree.h"
+#include "logger.h"
+#include "netio.h"
+
+static uint32_t read_flv_uint24(const uint8_t *p)
+{
+    return (p[0] << 16) | (p[1] << 8) | p[2];
+}
+
+static bool is_header_tag(const RtmpMediaTag &tag)
+{
+    const uint8_t *body = tag.body->data();
+    int length = tag.body->len();
+
+    if (tag.type == RTMP_MSG_VideoMessage) {
+        return RtmpGopCache::isVideoSequenceHeader(body, length);
+    }
+    if (tag.type == RTMP_MSG_AudioMessage) {
+        return RtmpGopCache::isAudioSequenceHeader(body, length);
+    }
+    return true;
+}
+
+RtmpFlvFixture::RtmpFlvFixture()
+{
+    headers_ = 0;
+    duration_ = 0;
+}
+
+RtmpFlvFixture::~RtmpFlvFixture()
+{
+    for (auto iter = tags_.begin(); iter != tags_.end(); ++iter) {
+        iter->body->unref();
+    }
+    tags_.clear();
+}
+
+int RtmpFlvFixture::load(const std::string &filename)
+{
+    FILE *fp;
+    long size;
+    uint8_t *data;
+    uint32_t header_size;
+    long offset;
+
+    fp = fopen(filename.c_str(), "rb");
+    if (fp == nullptr) {
+        ELOG("open flv fixture %s fail\n", filename.c_str());
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    data = new uint8_t[size > 0 ? size : 1];
+    AutoFreeA(uint8_t, data);
+    if (size < 13 || fread(data, 1, size, fp) != (size_t)size || memcmp(data, "FLV", 3) != 0) {
+        ELOG("%s is not a flv file\n", filename.c_str());
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    // header size from flv header, then PreviousTagSize0
+    read_uint32(data + 5, &header_size);
+    offset = header_size + 4;
+    while (offset + 11 <= size) {
+        RtmpMediaTag tag;
+        uint8_t type = data[offset] & 0x1f;
+        int length = read_flv_uint24(data + offset + 1);
+
+        if (offset + 11 + length + 4 > size) {
+            WLOG("flv fixture truncated at %ld\n", offset);
+            break;
+        }
+        tag.timestamp = read_flv_uint24(data + offset + 4) | ((uint32_t)data[offset + 7] << 24);
+        if ((type == 8 || type == 9 || type == 18) && length > 0) {
+            // flv tag type is the rtmp message type
+            tag.type = type;
+            tag.body = SHAREDBUFFERPOOL->alloc(data + offset + 11, length);
+            tags_.push_back(tag);
+        }
+        offset += 11 + length + 4;
+    }
+
+    headers_ = 0;
+    while (headers_ < (int)tags_.size() && is_header_tag(tags_[headers_])) {
+        headers_++;
+    }
+    if (headers_ == (int)tags_.size()) {
+        ELOG("flv fixture %s has no frame\n", filename.c_str());
+        return -1;
+    }
+    duration_ = tags_.back().timestamp - tags_[headers_].timestamp;
+    ILOG("flv fixture %s load %d tags, %u ms\n", filename.c_str(), (int)tags_.size(), duration_);
+    return 0;
+}
+
+RtmpOriginStream::RtmpOriginStream(const std::string &name) : name(name)
+{
+    publisher = nullptr;
+    players = 0;
+}
+
+RtmpOriginSession::RtmpOriginSession(RtmpOrigin *origin, uint64_t key, NetCore::TcpSocketConn *conn) : key(key)
+{
+    role = RTMP_ORIGIN_IDLE;
+    origin_ = origin;
+    socket_ = conn;
+    transport_ = new RtmpMessageTransport(conn, origin->metrics());
+    status_ = RTMP_HANDSHAKE_SERVER_START;
+    stream_ = nullptr;
+    closing_ = false;
+    dropping_ = false;
+    replay_index_ = 0;
+    replay_offset_ = 0;
+}
+
+RtmpOriginSession::~RtmpOriginSession()
+{
+    delete transport_;
+}
+
+void RtmpOriginSession::onRecvData(const char *data, int size)
+{
+    if (closing_) {
+        return;
+    }
+    // all replies produced by this read are written together
+    transport_->cork();
+    if (status_ < RTMP_HANDSHAKE_SERVER_DONE) {
+        doHandshake(data, size);
+    }
+    else {
+        processData(data, size);
+    }
+    transport_->uncork();
+}
+
+void RtmpOriginSession::doHandshake(const char *data, int size)
+{
+    data_cache_.push_data((char*)data, size);
+    if (status_ == RTMP_HANDSHAKE_SERVER_START) {
+        if (!data_cache_.require(1537)) {
+            return;
+        }
+        if (handshake_.create_s0s1s2(data_cache_.data(), data_cache_.len()) < 0) {
+            close();
+            return;
+        }
+        data_cache_.pop_data(1537);
+        transport_->sendRawData((const uint8_t*)handshake_.s0s1s2, 3073);
+        status_ = RTMP_HANDSHAKE_SEND_S0S1S2;
+    }
+    if (status_ == RTMP_HANDSHAKE_SEND_S0S1S2) {
+        if (!data_cache_.require(1536)) {
+            return;
+        }
+        // c2 echo s1, nothing to check in simple handshake
+        data_cache_.pop_data(1536);
+        status_ = RTMP_HANDSHAKE_SERVER_DONE;
+        if (data_cache_.len() > 0) {
+            // connect arrive together with c2
+            int left = data_cache_.len();
+            processData(data_cache_.data(), left);
+            data_cache_.pop_data(left);
+        }
+    }
+}
+
+void RtmpOriginSession::processData(const char *data, int length)
+{
+    RtmpBasePacket *packet = nullptr;
+    int ret = 0;
+    int offset = 0;
+
+    while (offset < length && !closing_)
+    {
+        packet = nullptr;
+        ret = transport_->recvRtmpMessage(data+offset, length-offset, &packet);
+        if (ret < 0) {
+            ELOG("origin session %lu chunk decode error %d\n", key, ret);
+            close();
+            return;
+        }
+        offset += ret;
+        if (packet == nullptr) {
+            continue;
+        }
+        AutoFree(RtmpBasePacket, packet);
+        switch (packet->kind) {
+            case RTMP_PACKET_CONNECT:
+                onConnect(static_cast<RtmpConnectPacket*>(packet));
+                break;
+            case RTMP_PACKET_FMLE_START:
+                sendPacket(new RtmpFMLEStartResponsePacket(static_cast<RtmpFMLEStartPacket*>(packet)->number), 0);
+                break;
+            case RTMP_PACKET_CREATE_STREAM:
+                sendPacket(new RtmpCreateStreamResponsePacket(static_cast<RtmpCreateStreamPacket*>(packet)->number, RTMP_ORIGIN_STREAM_ID), 0);
+                break;
+            case RTMP_PACKET_PUBLISH:
+                onPublish(static_cast<RtmpPublishPacket*>(packet));
+                break;
+            case RTMP_PACKET_PLAY:
+                onPlay(static_cast<RtmpPlayPacket*>(packet));
+                break;
+            case RTMP_PACKET_CLOSE_STREAM:
+                detach();
+                break;
+            default:
+                // media come from media callback, other calls need no answer
+                break;
+        }
+    }
+}
+
+void RtmpOriginSession::onConnect(RtmpConnectPacket *pkg)
+{
+    RtmpAmf0Any *app = pkg->command_object->get_property("app");
+    if (app && app->is_string()) {
+        app_ = app->to_str();
+    }
+    ILOG("origin session %lu connect app %s\n", key, app_.c_str());
+    if (true) {
+        RtmpSetWindowAckSizePacket *packet = new RtmpSetWindowAckSizePacket();
+        packet->window_ack_size = RTMP_ORIGIN_WINDOW_ACK_SIZE;
+        sendPacket(packet, 0);
+    }
+    if (true) {
+        RtmpSetPeerBandwidthPacket *packet = new RtmpSetPeerBandwidthPacket();
+        packet->bandwidth = RTMP_ORIGIN_WINDOW_ACK_SIZE;
+        packet->type = RtmpPeerBandwidthDynamic;
+        sendPacket(packet, 0);
+    }
+    if (true) {
+        RtmpSetChunkSizePacket *packet = new RtmpSetChunkSizePacket();
+        packet->chunk_size = RTMP_ORIGIN_CHUNK_SIZE;
+        sendPacket(packet, 0);
+    }
+    if (true) {
+        RtmpConnectResponsePacket *packet = new RtmpConnectResponsePacket();
+        packet->number = pkg->number;
+        packet->object->set("fmsVer", RtmpAmf0Any::str("FMS/3,5,3,888"));
+        packet->object->set("capabilities", RtmpAmf0Any::number(127));
+        packet->object->set("mode", RtmpAmf0Any::number(1));
+        packet->info->set("level", RtmpAmf0Any::str("status"));
+        packet->info->set("code", RtmpAmf0Any::str("NetConnection.Connect.Success"));
+        packet->info->set("description", RtmpAmf0Any::str("Connection succeeded"));
+        packet->info->set("objectEncoding", RtmpAmf0Any::number(0));
+        sendPacket(packet, 0);
+    }
+    sendPacket(new RtmpOnBWDonePacket(), 0);
+}
+
+void RtmpOriginSession::onPublish(RtmpPublishPacket *pkg)
+{
+    RtmpOriginStream *stream;
+
+    if (role != RTMP_ORIGIN_IDLE) {
+        return;
+    }
+    stream = origin_->findStream(app_ + "/" + pkg->stream_name.substr(0, pkg->stream_name.find('?')));
+    if (stream->publisher != nullptr) {
+        WLOG("origin stream %s already published\n", stream->name.c_str());
+        sendStatus("error", "NetStream.Publish.BadName", "Stream already publishing");
+        origin_->releaseStream(stream);
+        return;
+    }
+    ILOG("origin session %lu publish %s\n", key, stream->name.c_str());
+    role = RTMP_ORIGIN_PUBLISHER;
+    stream_ = stream;
+    stream->publisher = this;
+    // tag header is only parsed, the body go to players as it is
+    transport_->setMediaPassthrough(true);
+    transport_->setMediaMessageCallback([this](uint8_t type, uint32_t timestamp, SharedBuffer *body) {
+        onMediaMessage(type, timestamp, body);
+    });
+    sendStatus("status", "NetStream.Publish.Start", "Started publishing stream");
+}
+
+void RtmpOriginSession::onPlay(RtmpPlayPacket *pkg)
+{
+    RtmpOriginStream *stream;
+
+    if (role != RTMP_ORIGIN_IDLE) {
+        return;
+    }
+    stream = origin_->findStream(app_ + "/" + pkg->stream_name.substr(0, pkg->stream_name.find('?')));
+    ILOG("origin session %lu play %s\n", key, stream->name.c_str());
+    if (true) {
+        RtmpUserControlPacket *packet = new RtmpUserControlPacket();
+        packet->event_type = RtmpPCUCStreamBegin;
+        packet->event_data = RTMP_ORIGIN_STREAM_ID;
+        sendPacket(packet, 0);
+    }
+    sendStatus("status", "NetStream.Play.Reset", "Playing and resetting stream");
+    sendStatus("status", "NetStream.Play.Start", "Started playing stream");
+    if (true) {
+        RtmpSampleAccessPacket *packet = new RtmpSampleAccessPacket();
+        packet->video_sample_access = true;
+        packet->audio_sample_access = true;
+        sendPacket(packet, RTMP_ORIGIN_STREAM_ID);
+    }
+    if (stream->publisher == nullptr && origin_->hasFixture()) {
+        origin_->releaseStream(stream);
+        role = RTMP_ORIGIN_REPLAY_PLAYER;
+        origin_->startReplay(this);
+        return;
+    }
+    // wait for publisher when stream is not published yet
+    role = RTMP_ORIGIN_PLAYER;
+    stream_ = stream;
+    stream->players++;
+    stream->cache.attach(this);
+}
+
+void RtmpOriginSession::onMediaMessage(uint8_t type, uint32_t timestamp, SharedBuffer *body)
+{
+    if (stream_ != nullptr && body->len() > 0) {
+        stream_->cache.onMessage(type, timestamp, body);
+    }
+}
+
+void RtmpOriginSession::onMediaTag(const RtmpMediaTag &tag)
+{
+    const uint8_t *body = tag.body->data();
+    int length = tag.body->len();
+
+    if (closing_) {
+        return;
+    }
+    if (!is_header_tag(tag)) {
+        size_t queued = socket_->writeQueueSize();
+        if (dropping_) {
+            // only restart from keyframe, player never see a broken gop
+            if (!RtmpGopCache::isVideoKeyframe(body, length) || queued > RTMP_ORIGIN_PLAYER_MAX_QUEUE) {
+                origin_->metrics()->media_dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            dropping_ = false;
+        }
+        else if (queued > RTMP_ORIGIN_PLAYER_MAX_QUEUE) {
+            WLOG_RATE(1000, "origin player %lu too slow, %zu bytes pending, wait for keyframe\n", key, queued);
+            dropping_ = true;
+            origin_->metrics()->media_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+    sendTag(tag.type, tag.timestamp, tag.body);
+}
+
+bool RtmpOriginSession::replay()
+{
+    const RtmpFlvFixture &fixture = origin_->fixture();
+    int bytes = 0;
+
+    if (closing_ || socket_->writeQueueSize() >= RTMP_ORIGIN_REPLAY_WATERMARK) {
+        return false;
+    }
+    transport_->cork();
+    while (bytes < RTMP_ORIGIN_REPLAY_BURST) {
+        if (replay_index_ >= fixture.size()) {
+            // headers were sent in first round, keep timestamp increasing
+            replay_index_ = fixture.headers();
+            replay_offset_ += fixture.duration() + RTMP_ORIGIN_REPLAY_LOOP_GAP_MS;
+        }
+        const RtmpMediaTag &tag = fixture.tag(replay_index_++);
+        sendTag(tag.type, tag.timestamp + replay_offset_, tag.body);
+        bytes += tag.body->len();
+    }
+    transport_->uncork();
+    return socket_->writeQueueSize() < RTMP_ORIGIN_REPLAY_WATERMARK;
+}
+
+void RtmpOriginSession::detach()
+{
+    if (stream_ == nullptr) {
+        return;
+    }
+    if (role == RTMP_ORIGIN_PUBLISHER) {
+        ILOG("origin stream %s unpublish\n", stream_->name.c_str());
+        stream_->publisher = nullptr;
+        // next publisher start with new headers
+        stream_->cache.clear();
+    }
+    else if (role == RTMP_ORIGIN_PLAYER) {
+        stream_->cache.detach(this);
+        stream_->players--;
+    }
+    origin_->releaseStream(stream_);
+    stream_ = nullptr;
+    role = RTMP_ORIGIN_IDLE;
+}
+
+void RtmpOriginSession::sendStatus(const char *level, const char *code, const char *description)
+{
+    RtmpOnStatusCallPacket *pkg = new RtmpOnStatusCallPacket();
+    pkg->data->set("level", RtmpAmf0Any::str(level));
+    pkg->data->set("code", RtmpAmf0Any::str(code));
+    pkg->data->set("description", RtmpAmf0Any::str(description));
+    sendPacket(pkg, RTMP_ORIGIN_STREAM_ID);
+}
+
+void RtmpOriginSession::sendTag(uint8_t type, uint32_t timestamp, SharedBuffer *body)
+{
+    // body is shared by every player, chunk header is written around it
+    RtmpMediaPacket pkg(type, body);
+    pkg.timestamp = timestamp;
+    transport_->sendRtmpMessage(&pkg, RTMP_ORIGIN_STREAM_ID);
+}
+
+void RtmpOriginSession::sendPacket(RtmpBasePacket *pkg, int streamid)
+{
+    transport_->sendRtmpMessage(pkg, streamid);
+    delete pkg;
+}
+
+void RtmpOriginSession::close()
+{
+    if (!closing_) {
+        closing_ = true;
+        origin_->closeSession(this);
+    }
+}
+
+RtmpOrigin::RtmpOrigin(uv_loop_t *loop, uint16_t port) : loop_(loop), port_(port)
+{
+    server_ = new NetCore::TcpSocketServer(loop, port);
+    metrics_ = new RtmpSessionMetrics("rtmp://0.0.0.0:" + std::to_string(port), 1);
+    replay_check_ = nullptr;
+    replay_idle_ = nullptr;
+    stats_timer_ = nullptr;
+    last_bytes_in_ = last_bytes_out_ = 0;
+}
+
+RtmpOrigin::~RtmpOrigin()
+{
+    for (auto iter = sessions_.begin(); iter != sessions_.end(); ++iter) {
+        iter->second->detach();
+        delete iter->second;
+    }
+    sessions_.clear();
+    replaying_.clear();
+    for (auto iter = streams_.begin(); iter != streams_.end(); ++iter) {
+        delete iter->second;
+    }
+    streams_.clear();
+    delete server_;
+    if (replay_check_) {
+        uv_close((uv_handle_t*)replay_check_, [](uv_handle_t *handle) {
+            delete (uv_check_t*)handle;
+        });
+        uv_close((uv_handle_t*)replay_idle_, [](uv_handle_t *handle) {
+            delete (uv_idle_t*)handle;
+        });
+        uv_close((uv_handle_t*)stats_timer_, [](uv_handle_t *handle) {
+            delete (uv_timer_t*)handle;
+        });
+    }
+    delete metrics_;
+}
+
+int RtmpOrigin::setFixture(const std::string &filename)
+{
+    return fixture_.load(filename);
+}
+
+void RtmpOrigin::start()
+{
+    replay_check_ = new uv_check_t;
+    replay_check_->data = static_cast<void*>(this);
+    uv_check_init(loop_, replay_check_);
+    uv_check_start(replay_check_, &RtmpOrigin::on_replay_check);
+    replay_idle_ = new uv_idle_t;
+    replay_idle_->data = static_cast<void*>(this);
+    uv_idle_init(loop_, replay_idle_);
+    stats_timer_ = new uv_timer_t;
+    stats_timer_->data = static_cast<void*>(this);
+    uv_timer_init(loop_, stats_timer_);
+    uv_timer_start(stats_timer_, &RtmpOrigin::on_stats_timer, RTMP_ORIGIN_STATS_INTERVAL_MS, RTMP_ORIGIN_STATS_INTERVAL_MS);
+
+    server_->setRecvDataCallback(std::bind(&RtmpOrigin::onRecvData, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4));
+    server_->setCloseCallback(std::bind(&RtmpOrigin::onClosed, this, std::placeholders::_1, std::placeholders::_2));
+    server_->bindAndStart();
+    ILOG("rtmp origin listen on %d\n", port_);
+}
+
+RtmpOriginStream* RtmpOrigin::findStream(const std::string &name)
+{
+    auto iter = streams_.find(name);
+    if (iter != streams_.end()) {
+        return iter->second;
+    }
+    RtmpOriginStream *stream = new RtmpOriginStream(name);
+    streams_[name] = stream;
+    return stream;
+}
+
+void RtmpOrigin::releaseStream(RtmpOriginStream *stream)
+{
+    if (stream->publisher == nullptr && stream->players == 0) {
+        streams_.erase(stream->name);
+        delete stream;
+    }
+}
+
+void RtmpOrigin::startReplay(RtmpOriginSession *session)
+{
+    replaying_.push_back(session);
+    uv_idle_start(replay_idle_, &RtmpOrigin::on_replay_idle);
+}
+
+void RtmpOrigin::closeSession(RtmpOriginSession *session)
+{
+    server_->close(session->key);
+}
+
+void RtmpOrigin::onRecvData(const char *data, ssize_t len, uint64_t key, NetCore::TcpSocketConn *conn)
+{
+    RtmpOriginSession *session;
+    auto iter = sessions_.find(key);
+
+    if (iter == sessions_.end()) {
+        session = new RtmpOriginSession(this, key, conn);
+        sessions_[key] = session;
+    }
+    else {
+        session = iter->second;
+    }
+    session->onRecvData(data, (int)len);
+}
+
+void RtmpOrigin::onClosed(uint64_t key, NetCore::TcpSocketConn *conn)
+{
+    auto iter = sessions_.find(key);
+    if (iter != sessions_.end()) {
+        RtmpOriginSession *session = iter->second;
+        DLOG("origin session %lu closed\n", key);
+        session->detach();
+        replaying_.erase(std::remove(replaying_.begin(), replaying_.end(), session), replaying_.end());
+        sessions_.erase(iter);
+        delete session;
+    }
+}
+
+void RtmpOrigin::pumpReplay()
+{
+    bool more = false;
+
+    for (auto iter = replaying_.begin(); iter != replaying_.end(); ++iter) {
+        if ((*iter)->replay()) {
+            more = true;
+        }
+    }
+    // every player wait for socket write, poll wake up again on write complete
+    if (more) {
+        uv_idle_start(replay_idle_, &RtmpOrigin::on_replay_idle);
+    }
+    else {
+        uv_idle_stop(replay_idle_);
+    }
+}
+
+void RtmpOrigin::printStats()
+{
+    uint64_t in = metrics_->bytes_in.load(std::memory_order_relaxed);
+    uint64_t out = metrics_->bytes_out.load(std::memory_order_relaxed);
+    int publishers = 0;
+
+    for (auto iter = streams_.begin(); iter != streams_.end(); ++iter) {
+        if (iter->second->publisher) {
+            publishers++;
+        }
+    }
+    ILOG("origin %d sessions %d publishers %d replaying, in %.3f Mbps out %.3f Mbps, dropped %lu\n",
+         (int)sessions_.size(), publishers, (int)replaying_.size(),
+         (in - last_bytes_in_) * 8.0 / 1000.0 / RTMP_ORIGIN_STATS_INTERVAL_MS,
+         (out - last_bytes_out_) * 8.0 / 1000.0 / RTMP_ORIGIN_STATS_INTERVAL_MS,
+         metrics_->media_dropped.load(std::memory_order_relaxed));
+    last_bytes_in_ = in;
+    last_bytes_out_ = out;
+}
+
+void RtmpOrigin::on_replay_check(uv_check_t *handle)
+{
+    RtmpOrigin *origin = static_cast<RtmpOrigin*>(handle->data);
+    if (!origin->replaying_.empty()) {
+        origin->pumpReplay();
+    }
+}
+
+void RtmpOrigin::on_replay_idle(uv_idle_t *handle)
+{
+    // nothing to do, only keep loop from blocking so check run again
+}
+
+void RtmpOrigin::on_stats_timer(uv_timer_t *handle)
+{
+    RtmpOrigin *origin = static_cast<RtmpOrigin*>(handle->data);
+    origin->printStats();
+}
@@ -0,0 +1,178 @@
+#ifndef RTMP_CLIENT_RTMP_ORIGIN_H
+#define RTMP_CLIENT_RTMP_ORIGIN_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "net/NetCore.h"
+#include "rtmp/rtmp_stack_handshake.h"
+#include "app_protocol/rtmp/rtmp_stack_packet.h"
+#include "rtmp_transport.h"
+#include "rtmp_metrics.h"
+#include "rtmp_gop_cache.h"
+#include "DataBuf.h"
+
+const int RTMP_ORIGIN_CHUNK_SIZE = 60000;
+const int RTMP_ORIGIN_WINDOW_ACK_SIZE = 2500000;
+// stream id answered to every createStream, one stream per connection
+const int RTMP_ORIGIN_STREAM_ID = 1;
+// live player with more bytes in socket queue skip tags until next keyframe
+const size_t RTMP_ORIGIN_PLAYER_MAX_QUEUE = 1024 * 1024;
+// fixture replay keep socket queue of each player about this full, every burst is one vectored write
+const size_t RTMP_ORIGIN_REPLAY_WATERMARK = 256 * 1024;
+const int RTMP_ORIGIN_REPLAY_BURST = 64 * 1024;
+// timestamp gap between last and first tag when fixture wrap around
+const uint32_t RTMP_ORIGIN_REPLAY_LOOP_GAP_MS = 40;
+const int RTMP_ORIGIN_STATS_INTERVAL_MS = 5000;
+
+enum RtmpOriginHandshakeStatus {
+    RTMP_HANDSHAKE_SERVER_START,
+    RTMP_HANDSHAKE_SEND_S0S1S2,
+    RTMP_HANDSHAKE_SERVER_DONE,
+};
+
+enum RtmpOriginSessionRole {
+    RTMP_ORIGIN_IDLE,
+    RTMP_ORIGIN_PUBLISHER,
+    RTMP_ORIGIN_PLAYER,
+    RTMP_ORIGIN_REPLAY_PLAYER,
+};
+
+// flv file loaded once, every replay player walk it at its own pace
+class RtmpFlvFixture
+{
+public:
+    RtmpFlvFixture();
+    virtual ~RtmpFlvFixture();
+
+public:
+    int load(const std::string &filename);
+    int size() const { return (int)tags_.size(); }
+    const RtmpMediaTag& tag(int index) const { return tags_[index]; }
+    // metadata and sequence headers before first frame, skipped when wrap around
+    int headers() const { return headers_; }
+    uint32_t duration() const { return duration_; }
+
+private:
+    std::vector<RtmpMediaTag> tags_;
+    int headers_;
+    uint32_t duration_;
+};
+
+class RtmpOrigin;
+class RtmpOriginStream;
+
+// one accepted connection, publisher or player decided by command
+class RtmpOriginSession : public IRtmpMediaConsumer
+{
+public:
+    RtmpOriginSession(RtmpOrigin *origin, uint64_t key, NetCore::TcpSocketConn *conn);
+    virtual ~RtmpOriginSession();
+
+public:
+    void onRecvData(const char *data, int size);
+    // live tag of played stream
+    virtual void onMediaTag(const RtmpMediaTag &tag);
+    // write next fixture burst, false when socket queue is full
+    bool replay();
+    // detach from stream, called before destroy
+    void detach();
+
+public:
+    uint64_t key;
+    int role;
+
+private:
+    void doHandshake(const char *data, int size);
+    void processData(const char *data, int length);
+    void onConnect(RtmpConnectPacket *pkg);
+    void onPublish(RtmpPublishPacket *pkg);
+    void onPlay(RtmpPlayPacket *pkg);
+    void onMediaMessage(uint8_t type, uint32_t timestamp, SharedBuffer *body);
+    void sendStatus(const char *level, const char *code, const char *description);
+    void sendTag(uint8_t type, uint32_t timestamp, SharedBuffer *body);
+    void sendPacket(RtmpBasePacket *pkg, int streamid);
+    void close();
+
+private:
+    RtmpOrigin *origin_;
+    NetCore::BaseSocket *socket_;
+    RtmpMessageTransport *transport_;
+    rtmp_handshake handshake_;
+    DataCacheBuf data_cache_;
+    int status_;
+    std::string app_;
+    RtmpOriginStream *stream_;
+    bool closing_;
+    bool dropping_;     // live player congested, wait for keyframe
+    int replay_index_;
+    uint32_t replay_offset_;    // added to fixture timestamp, grow on every wrap
+};
+
+// publisher and live players of app/stream, new player start from cached gop
+class RtmpOriginStream
+{
+public:
+    RtmpOriginStream(const std::string &name);
+    virtual ~RtmpOriginStream() = default;
+
+public:
+    std::string name;
+    RtmpOriginSession *publisher;
+    RtmpGopCache cache;
+    int players;
+};
+
+// minimal rtmp server for local test, publish is looped back to players of same
+// app/stream, player of stream without publisher get the flv fixture at line rate
+// all sessions run in one loop thread
+class RtmpOrigin
+{
+public:
+    RtmpOrigin(uv_loop_t *loop, uint16_t port);
+    virtual ~RtmpOrigin();
+
+public:
+    // call before start
+    int setFixture(const std::string &filename);
+    void start();
+
+public:
+    RtmpSessionMetrics* metrics() const { return metrics_; }
+    const RtmpFlvFixture& fixture() const { return fixture_; }
+    bool hasFixture() const { return fixture_.size() > 0; }
+    RtmpOriginStream* findStream(const std::string &name);
+    // free stream when no publisher and no player left
+    void releaseStream(RtmpOriginStream *stream);
+    void startReplay(RtmpOriginSession *session);
+    void closeSession(RtmpOriginSession *session);
+
+private:
+    void onRecvData(const char *data, ssize_t len, uint64_t key, NetCore::TcpSocketConn *conn);
+    void onClosed(uint64_t key, NetCore::TcpSocketConn *conn);
+    void pumpReplay();
+    void printStats();
+    static void on_replay_check(uv_check_t *handle);
+    static void on_replay_idle(uv_idle_t *handle);
+    static void on_stats_timer(uv_timer_t *handle);
+
+private:
+    uv_loop_t *loop_;
+    uint16_t port_;
+    NetCore::TcpSocketServer *server_;
+    RtmpSessionMetrics *metrics_;
+    std::unordered_map<uint64_t, RtmpOriginSession*> sessions_;
+    std::unordered_map<std::string, RtmpOriginStream*> streams_;
+    RtmpFlvFixture fixture_;
+
+private:
+    // check run after every poll, idle keep poll from blocking while a player can take more
+    std::vector<RtmpOriginSession*> replaying_;
+    uv_check_t *replay_check_;
+    uv_idle_t *replay_idle_;
+    uv_timer_t *stats_timer_;
+    uint64_t last_bytes_in_;
+    uint64_t last_bytes_out_;
+};
+
+#endif //RTMP_CLIENT_RTMP_ORIGIN_H
@@ -0,0 +1,55 @@
+#include <string>
+
+#include "net/NetCore.h"
+#include "base/logger.h"
+#include "rtmp_origin.h"
+#include "rtmp_metrics.h"
+
+// usage: rtmp_origin [port] [flv fixture, played when stream has no publisher] [metrics http port, 0 disable]
+int main(int argc, char *argv[]) {
+
+    int port = 1935;
+    std::string fixture;
+    int metricsPort = 0;
+
+    if (argc > 1) {
+        port = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        fixture = argv[2];
+    }
+    if (argc > 3) {
+        metricsPort = atoi(argv[3]);
+    }
+
+    LogCore::Logger::instance()->startup();
+
+    ILOG("rtmp origin start...\n");
+
+    // all sessions in one loop, clients under test use the other cores
+    NETIOMANAGER->init(1);
+
+    NetCore::HttpServer *metricsServer = nullptr;
+    RtmpMetricsHttpHandle metricsHandle;
+    if (metricsPort > 0) {
+        metricsServer = new NetCore::HttpServer(NETIOMANAGER->loop_, metricsPort);
+        metricsServer->registerHandle("/metrics", &metricsHandle);
+        metricsServer->start();
+    }
+
+    RtmpOrigin *origin = new RtmpOrigin(NETIOMANAGER->loop_, port);
+    if (!fixture.empty() && origin->setFixture(fixture) < 0) {
+        ELOG("load fixture %s fail, only live streams are served\n", fixture.c_str());
+    }
+    origin->start();
+
+    NETIOMANAGER->startup();
+
+    delete origin;
+    if (metricsServer) {
+        delete metricsServer;
+    }
+
+    LogCore::Logger::instance()->shutdown();
+    return 0;
+}
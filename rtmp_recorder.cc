@@ -0,0 +1,492 @@
+#include "rtmp_recorder.h"
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "app_protocol/rtmp/rtmp_stack_packet.h"
+#include "logger.h"
+#include "annexb.h"
+#include "netio.h"
+#include "utils.h"
+#include "flv_tag.h"
+
+RecordIoThread::RecordIoThread()
+{
+    running_ = true;
+    thread_ = std::thread(&RecordIoThread::ioThread, this);
+}
+
+RecordIoThread::~RecordIoThread()
+{
+    shutdown();
+    for (auto iter = freeBlocks_.begin(); iter != freeBlocks_.end(); ++iter) {
+        free(*iter);
+    }
+    freeBlocks_.clear();
+}
+
+void RecordIoThread::shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_ = false;
+    }
+    cond_.notify_one();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void RecordIoThread::submit(RecordIoJob &job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(job);
+    }
+    cond_.notify_one();
+}
+
+RecordBlock RecordIoThread::allocBlock()
+{
+    RecordBlock block;
+    void *data = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(blockMutex_);
+        if (!freeBlocks_.empty()) {
+            block.data = freeBlocks_.back();
+            freeBlocks_.pop_back();
+            return block;
+        }
+    }
+    if (posix_memalign(&data, RTMP_RECORD_BLOCK_ALIGN, RTMP_RECORD_BLOCK_SIZE) != 0) {
+        ELOG("alloc record block fail\n");
+        return block;
+    }
+    block.data = static_cast<uint8_t*>(data);
+    return block;
+}
+
+void RecordIoThread::releaseBlock(RecordBlock &block)
+{
+    if (block.data == nullptr) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(blockMutex_);
+        if ((int)freeBlocks_.size() < RTMP_RECORD_MAX_FREE_BLOCKS) {
+            freeBlocks_.push_back(block.data);
+            block.data = nullptr;
+        }
+    }
+    if (block.data) {
+        free(block.data);
+    }
+    block.data = nullptr;
+    block.len = 0;
+}
+
+void RecordIoThread::ioThread()
+{
+    std::deque<RecordIoJob> jobs;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this]() {
+                return !jobs_.empty() || !running_;
+            });
+            if (jobs_.empty()) {
+                break;
+            }
+            jobs.swap(jobs_);
+        }
+        process(jobs);
+        jobs.clear();
+    }
+}
+
+void RecordIoThread::process(std::deque<RecordIoJob> &jobs)
+{
+    struct iovec iov[RTMP_RECORD_MAX_IOV];
+    size_t i = 0;
+
+    while (i < jobs.size()) {
+        RecordIoJob &job = jobs[i];
+        RecordSink *sink = job.sink.get();
+        if (job.op == RECORD_IO_OPEN) {
+            sink->fd = ::open(sink->filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (sink->fd < 0) {
+                ELOG("open record file %s fail, errno %d\n", sink->filename.c_str(), errno);
+            }
+            else {
+                ILOG("record to %s\n", sink->filename.c_str());
+            }
+            i++;
+        }
+        else if (job.op == RECORD_IO_CLOSE) {
+            if (sink->fd >= 0) {
+                ::close(sink->fd);
+                sink->fd = -1;
+            }
+            i++;
+        }
+        else {
+            // merge following blocks of the same file into one writev
+            int count = 0;
+            int64_t bytes = 0;
+            size_t j = i;
+            while (j < jobs.size() && count < RTMP_RECORD_MAX_IOV &&
+                   jobs[j].op == RECORD_IO_WRITE && jobs[j].sink.get() == sink) {
+                iov[count].iov_base = jobs[j].block.data;
+                iov[count].iov_len = jobs[j].block.len;
+                bytes += jobs[j].block.len;
+                count++;
+                j++;
+            }
+            if (sink->fd >= 0) {
+                writeBlocks(sink, iov, count);
+            }
+            for (; i < j; i++) {
+                releaseBlock(jobs[i].block);
+            }
+            sink->pending.fetch_sub(bytes, std::memory_order_relaxed);
+        }
+    }
+}
+
+void RecordIoThread::writeBlocks(RecordSink *sink, struct iovec *iov, int count)
+{
+    ssize_t n;
+
+    while (count > 0) {
+        n = ::writev(sink->fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ELOG_RATE(1000, "write record file %s fail, errno %d\n", sink->filename.c_str(), errno);
+            return;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+RtmpRecorder::RtmpRecorder(const std::string &filename, int format) : filename_(filename), format_(format)
+{
+    segment_duration_ms_ = 0;
+    segment_bytes_ = 0;
+    segment_index_ = 0;
+    segment_start_ts_ = 0;
+    segment_written_ = 0;
+    wait_keyframe_ = true;
+    dropped_gops_ = 0;
+    nalu_length_size_ = 4;
+}
+
+RtmpRecorder::~RtmpRecorder()
+{
+    stop();
+    RECORDIOTHREAD->releaseBlock(block_);
+}
+
+void RtmpRecorder::setSegment(int durationMs, int64_t bytes)
+{
+    segment_duration_ms_ = durationMs;
+    segment_bytes_ = bytes;
+}
+
+int RtmpRecorder::start()
+{
+    if (sink_) {
+        return 0;
+    }
+    segment_index_ = 0;
+    wait_keyframe_ = true;
+    openSegment();
+    return 0;
+}
+
+void RtmpRecorder::stop()
+{
+    if (sink_) {
+        closeSegment();
+    }
+}
+
+void RtmpRecorder::openSegment()
+{
+    RecordIoJob job;
+
+    segment_index_++;
+    segment_written_ = 0;
+    sink_ = std::make_shared<RecordSink>();
+    sink_->filename = segmentName();
+    job.op = RECORD_IO_OPEN;
+    job.sink = sink_;
+    RECORDIOTHREAD->submit(job);
+}
+
+void RtmpRecorder::closeSegment()
+{
+    RecordIoJob job;
+
+    flush();
+    job.op = RECORD_IO_CLOSE;
+    job.sink = sink_;
+    RECORDIOTHREAD->submit(job);
+    sink_.reset();
+}
+
+std::string RtmpRecorder::segmentName()
+{
+    size_t dot = filename_.find_last_of('.');
+    size_t slash = filename_.find_last_of('/');
+
+    if (segment_duration_ms_ <= 0 && segment_bytes_ <= 0) {
+        return filename_;
+    }
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return filename_ + "-" + std::to_string(segment_index_);
+    }
+    return filename_.substr(0, dot) + "-" + std::to_string(segment_index_) + filename_.substr(dot);
+}
+
+void RtmpRecorder::append(const uint8_t *data, int len)
+{
+    int n;
+
+    while (len > 0) {
+        if (block_.data == nullptr) {
+            block_ = RECORDIOTHREAD->allocBlock();
+            if (block_.data == nullptr) {
+                return;
+            }
+        }
+        n = UTILS_MIN(len, RTMP_RECORD_BLOCK_SIZE - block_.len);
+        memcpy(block_.data + block_.len, data, n);
+        block_.len += n;
+        data += n;
+        len -= n;
+        segment_written_ += n;
+        if (block_.len == RTMP_RECORD_BLOCK_SIZE) {
+            flush();
+        }
+    }
+}
+
+void RtmpRecorder::flush()
+{
+    RecordIoJob job;
+
+    if (block_.data == nullptr || block_.len == 0) {
+        return;
+    }
+    job.op = RECORD_IO_WRITE;
+    job.sink = sink_;
+    job.block = block_;
+    sink_->pending.fetch_add(block_.len, std::memory_order_relaxed);
+    RECORDIOTHREAD->submit(job);
+    block_ = RecordBlock();
+}
+
+bool RtmpRecorder::onKeyframe(uint32_t timestamp)
+{
+    // at most one write per gop for low bitrate stream
+    flush();
+    if (sink_->pending.load(std::memory_order_relaxed) > RTMP_RECORD_MAX_PENDING) {
+        if (!wait_keyframe_) {
+            dropped_gops_++;
+            wait_keyframe_ = true;
+        }
+        WLOG_RATE(1000, "record %s disk too slow, %lu gops dropped\n", sink_->filename.c_str(), dropped_gops_);
+        return false;
+    }
+    if (segment_written_ > 0) {
+        if ((segment_duration_ms_ > 0 && (int32_t)(timestamp - segment_start_ts_) >= segment_duration_ms_) ||
+            (segment_bytes_ > 0 && segment_written_ >= segment_bytes_)) {
+            closeSegment();
+            openSegment();
+        }
+    }
+    if (segment_written_ == 0) {
+        segment_start_ts_ = timestamp;
+        writeHeaders();
+    }
+    wait_keyframe_ = false;
+    return true;
+}
+
+void RtmpRecorder::writeHeaders()
+{
+    if (format_ == RTMP_RECORD_FLV) {
+        append(flv_header, FLV_HEADER_SIZE);
+        if (!metadata_.empty()) {
+            writeFlvTag(18, 0, (const uint8_t*)metadata_.data(), metadata_.length());
+        }
+        if (!video_header_.empty()) {
+            writeFlvTag(9, segment_start_ts_, (const uint8_t*)video_header_.data(), video_header_.length());
+        }
+        if (!audio_header_.empty()) {
+            writeFlvTag(8, segment_start_ts_, (const uint8_t*)audio_header_.data(), audio_header_.length());
+        }
+    }
+    else {
+        append((const uint8_t*)spspps_.data(), spspps_.length());
+    }
+}
+
+void RtmpRecorder::writeFlvTag(uint8_t type, uint32_t timestamp, const uint8_t *body, int length)
+{
+    uint8_t header[FLV_TAG_HEADER_SIZE];
+    uint8_t size[FLV_PREV_TAG_SIZE];
+
+    flv_write_tag_header(header, type, length, timestamp);
+    write_uint32(size, sizeof(header) + length);
+    append(header, sizeof(header));
+    append(body, length);
+    append(size, sizeof(size));
+}
+
+void RtmpRecorder::writeNalu(const uint8_t *nalu, int len)
+{
+    int startCodeLen;
+    // some encoder put annexb start code inside avcc nalu, do not write it twice
+    if (len >= 3 && Utils::AnnexB::findStartCode(nalu, UTILS_MIN(len, 4), startCodeLen) == 0) {
+        nalu += startCodeLen;
+        len -= startCodeLen;
+    }
+    append(Utils::AnnexB::START_CODE, 4);
+    append(nalu, len);
+}
+
+void RtmpRecorder::onMediaTag(const RtmpMediaTag &tag)
+{
+    if (!sink_) {
+        return;
+    }
+    if (format_ == RTMP_RECORD_FLV) {
+        onFlvTag(tag);
+    }
+    else if (tag.type == RTMP_MSG_VideoMessage) {
+        onAnnexB(tag);
+    }
+}
+
+void RtmpRecorder::onFlvTag(const RtmpMediaTag &tag)
+{
+    const uint8_t *body = tag.body->data();
+    int length = tag.body->len();
+    uint8_t type;
+
+    if (tag.type == RTMP_MSG_AudioMessage) {
+        type = 8;
+        if (RtmpGopCache::isAudioSequenceHeader(body, length)) {
+            audio_header_.assign((const char*)body, length);
+        }
+    }
+    else if (tag.type == RTMP_MSG_VideoMessage) {
+        type = 9;
+        if (RtmpGopCache::isVideoSequenceHeader(body, length)) {
+            video_header_.assign((const char*)body, length);
+        }
+        else if (RtmpGopCache::isVideoKeyframe(body, length) && !onKeyframe(tag.timestamp)) {
+            return;
+        }
+    }
+    else if (tag.type == RTMP_MSG_AMF0DataMessage || tag.type == RTMP_MSG_AMF3DataMessage) {
+        type = 18;
+        bool metadata = RtmpGopCache::isMetaData(tag.type, body, length);
+        if (tag.type == RTMP_MSG_AMF3DataMessage) {
+            body++;
+            length--;
+        }
+        if (metadata) {
+            metadata_.assign((const char*)body, length);
+        }
+    }
+    else {
+        return;
+    }
+    if (length <= 0 || wait_keyframe_) {
+        // headers are cached and written before first keyframe
+        return;
+    }
+    writeFlvTag(type, tag.timestamp, body, length);
+}
+
+void RtmpRecorder::onAnnexB(const RtmpMediaTag &tag)
+{
+    const uint8_t *body = tag.body->data();
+    int length = tag.body->len();
+    const uint8_t *p = body + 5;
+    int n = length - 5;
+    int offset;
+    uint16_t len16;
+    uint32_t len;
+
+    // frame type/codec, avc packet type, composition time, then avcc payload
+    if (length <= 5 || (body[0] & 0x0f) != 7) {
+        return;
+    }
+    if (RtmpGopCache::isVideoSequenceHeader(body, length)) {
+        // AVCDecoderConfigurationRecord
+        if (n < 7) {
+            return;
+        }
+        nalu_length_size_ = (p[4] & 0x03) + 1;
+        spspps_.clear();
+        offset = 5;
+        for (int set = 0; set < 2 && offset < n; set++) {
+            int num = set == 0 ? (p[offset] & 0x1f) : p[offset];
+            offset++;
+            for (int i = 0; i < num && offset + 2 <= n; i++) {
+                read_uint16(p + offset, &len16);
+                offset += 2;
+                if (offset + len16 > n) {
+                    break;
+                }
+                spspps_.append((const char*)Utils::AnnexB::START_CODE, 4);
+                spspps_.append((const char*)p + offset, len16);
+                offset += len16;
+            }
+        }
+        if (!wait_keyframe_) {
+            append((const uint8_t*)spspps_.data(), spspps_.length());
+        }
+        return;
+    }
+    if (body[1] != 0x01) {
+        return;
+    }
+    if (RtmpGopCache::isVideoKeyframe(body, length)) {
+        if (!onKeyframe(tag.timestamp)) {
+            return;
+        }
+    }
+    else if (wait_keyframe_) {
+        return;
+    }
+    offset = 0;
+    while (offset + nalu_length_size_ <= n) {
+        len = 0;
+        for (int i = 0; i < nalu_length_size_; i++) {
+            len = (len << 8) | p[offset + i];
+        }
+        offset += nalu_length_size_;
+        if (len == 0 || len > (uint32_t)(n - offset)) {
+            break;
+        }
+        writeNalu(p + offset, len);
+        offset += len;
+    }
+}
@@ -0,0 +1,151 @@
+#ifndef RTMP_CLIENT_RTMP_RECORDER_H
+#define RTMP_CLIENT_RTMP_RECORDER_H
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "singleton.h"
+#include "rtmp_gop_cache.h"
+
+enum RtmpRecordFormat
+{
+    RTMP_RECORD_FLV = 0,
+    RTMP_RECORD_ANNEXB = 1,
+};
+
+// recorder fill one block then hand it to io thread, block is page aligned
+const int RTMP_RECORD_BLOCK_SIZE = 256 * 1024;
+const int RTMP_RECORD_BLOCK_ALIGN = 4096;
+const int RTMP_RECORD_MAX_FREE_BLOCKS = 64;
+// gop is dropped when disk can not catch up and pending bytes of one file exceed it
+const int64_t RTMP_RECORD_MAX_PENDING = 64 * 1024 * 1024;
+const int RTMP_RECORD_MAX_IOV = 64;
+
+struct RecordBlock
+{
+    uint8_t *data;
+    int len;
+
+    RecordBlock() {
+        data = nullptr;
+        len = 0;
+    }
+};
+
+// opened file, shared by recorder and queued jobs
+struct RecordSink
+{
+    int fd;
+    std::string filename;
+    std::atomic<int64_t> pending;   // bytes queued but not written
+
+    RecordSink() : fd(-1), pending(0) {}
+};
+
+enum RecordIoOp
+{
+    RECORD_IO_OPEN = 0,
+    RECORD_IO_WRITE = 1,
+    RECORD_IO_CLOSE = 2,
+};
+
+struct RecordIoJob
+{
+    int op;
+    std::shared_ptr<RecordSink> sink;
+    RecordBlock block;
+};
+
+// one thread write all recording files, network loop never wait for disk
+class RecordIoThread : public core::Singleton<RecordIoThread>
+{
+public:
+    RecordIoThread();
+    virtual ~RecordIoThread();
+
+public:
+    // write all queued jobs then exit
+    void shutdown();
+
+public:
+    // jobs of one sink run in submit order
+    void submit(RecordIoJob &job);
+    RecordBlock allocBlock();
+    void releaseBlock(RecordBlock &block);
+
+private:
+    void ioThread();
+    void process(std::deque<RecordIoJob> &jobs);
+    void writeBlocks(RecordSink *sink, struct iovec *iov, int count);
+
+private:
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<RecordIoJob> jobs_;
+    bool running_;
+    std::mutex blockMutex_;
+    std::vector<uint8_t*> freeBlocks_;
+};
+
+#define RECORDIOTHREAD RecordIoThread::instance()
+
+// record a play session as flv or h264 annexb, attach it to RtmpPlayClient
+// segment file is name-1.flv, name-2.flv ... when segment duration or size is set
+class RtmpRecorder : public IRtmpMediaConsumer
+{
+public:
+    RtmpRecorder(const std::string &filename, int format = RTMP_RECORD_FLV);
+    virtual ~RtmpRecorder();
+
+public:
+    // 0 no limit, new segment always start at keyframe
+    void setSegment(int durationMs, int64_t bytes);
+    int start();
+    // detach from play client before stop
+    void stop();
+
+public:
+    virtual void onMediaTag(const RtmpMediaTag &tag);
+
+private:
+    void onFlvTag(const RtmpMediaTag &tag);
+    void onAnnexB(const RtmpMediaTag &tag);
+    bool onKeyframe(uint32_t timestamp);
+    void openSegment();
+    void closeSegment();
+    void writeHeaders();
+    void writeFlvTag(uint8_t type, uint32_t timestamp, const uint8_t *body, int length);
+    void writeNalu(const uint8_t *nalu, int len);
+    void append(const uint8_t *data, int len);
+    void flush();
+    std::string segmentName();
+
+private:
+    std::string filename_;
+    int format_;
+    int segment_duration_ms_;
+    int64_t segment_bytes_;
+    int segment_index_;
+    uint32_t segment_start_ts_;
+    int64_t segment_written_;
+    std::shared_ptr<RecordSink> sink_;
+    RecordBlock block_;
+    bool wait_keyframe_;
+    uint64_t dropped_gops_;
+
+private:
+    // written at start of every segment
+    std::string metadata_;
+    std::string video_header_;
+    std::string audio_header_;
+    std::string spspps_;
+    int nalu_length_size_;
+};
+
+#endif //RTMP_CLIENT_RTMP_RECORDER_H
@@ -10,61 +10,176 @@
 
 const uint32_t RTMP_DEFAULT_CHUNKSIZE = 128;
 const uint32_t RTMP_MAX_CHUNKSIZE = 65535;
-const uint32_t RTMP_DEFAULT_CACHE_BUFFER_SIZE = (32*1024);
 const uint8_t RTMP_DEFAULT_CHUNK_SIZE = 16;
+// ping response later than this is not a reply of ours
+const uint32_t RTMP_PING_MAX_RTT_US = 60 * 1000 * 1000;
 
 RtmpMessage::RtmpMessage()
 {
+    rtmp_buffer = nullptr;
     rtmp_body = nullptr;
     rtmp_body_len = 0;
 }
 
 RtmpMessage::~RtmpMessage()
 {
-    if (rtmp_body)
+    if (rtmp_buffer)
     {
-        delete[] rtmp_body;
+        rtmp_buffer->unref();
     }
 }
 
-void RtmpMessage::create_msg(RtmpHeader *header, uint8_t *body, uint32_t length)
+void RtmpMessage::create_msg(RtmpHeader *header, SharedBuffer *body)
 {
     rtmp_header = *header;
-    rtmp_body = body;
-    rtmp_body_len = length;
+    rtmp_buffer = body;
+    rtmp_body = body->data();
+    rtmp_body_len = body->len();
 }
 
-RtmpMessageTransport::RtmpMessageTransport(NetCore::BaseSocket *socket)
+RtmpMessageTransport::RtmpMessageTransport(NetCore::BaseSocket *socket, RtmpSessionMetrics *metrics)
 {
     out_chunk_size = RTMP_DEFAULT_CHUNKSIZE;
     in_chunk_size = RTMP_DEFAULT_CHUNKSIZE;
     in_buffer_length = 0;
-    send_cache_buf = new uint8_t[RTMP_DEFAULT_CACHE_BUFFER_SIZE];
+    decode_state_ = RTMP_CHUNK_DECODE_BASIC_HEADER;
+    decode_chunk_ = nullptr;
+    decode_timestamp_ = 0;
+    header_len_ = header_need_ = 0;
+    chunk_payload_left_ = 0;
+    srtt_us_ = 0;
+    view_body_ = nullptr;
+    media_passthrough_ = false;
     chunk_cache_.clear();
     for (int i = 0; i < RTMP_DEFAULT_CHUNK_SIZE; i++)
     {
         chunk_cache_.insert(std::make_pair(i, new RtmpChunkData()));
     }
+    cork_depth_ = 0;
     socket_ = socket;
+    metrics_ = metrics;
 }
 
 RtmpMessageTransport::~RtmpMessageTransport()
 {
-    if (send_cache_buf)
-    {
-        delete[] send_cache_buf;
-    }
     for (auto iter = chunk_cache_.begin(); iter != chunk_cache_.end(); ++iter)
     {
         RtmpChunkData *data = iter->second;
         delete data;
     }
     chunk_cache_.clear();
+    release_view();
+    for (auto iter = cork_buffers_.begin(); iter != cork_buffers_.end(); ++iter)
+    {
+        (*iter)->unref();
+    }
+    cork_buffers_.clear();
+    cork_bufs_.clear();
     socket_ = nullptr;
 }
 
+void RtmpMessageTransport::cork()
+{
+    cork_depth_++;
+}
+
+int RtmpMessageTransport::uncork()
+{
+    std::vector<uv_buf_t> bufs;
+    std::vector<SharedBuffer*> buffers;
+    int ret;
+
+    if (cork_depth_ > 0)
+    {
+        cork_depth_--;
+    }
+    if (cork_depth_ > 0 || cork_bufs_.empty())
+    {
+        return 0;
+    }
+    // all messages queued while corked go out in one vectored write
+    bufs.swap(cork_bufs_);
+    buffers.swap(cork_buffers_);
+    RtmpSessionMetrics *metrics = metrics_;
+    int64_t start = metrics ? Utils::Util::getSteadyTimeUs() : 0;
+    ret = socket_->sendDataVec(&bufs[0], (int)bufs.size(), [buffers, metrics, start](int status) {
+        for (auto iter = buffers.begin(); iter != buffers.end(); ++iter)
+        {
+            (*iter)->unref();
+        }
+        // cancelled write may complete after session is gone
+        if (metrics && status == 0)
+        {
+            metrics->write_time.record(Utils::Util::getSteadyTimeUs() - start);
+        }
+    });
+    update_write_pending();
+    return ret;
+}
+
+int RtmpMessageTransport::sendRawData(const uint8_t *data, int length)
+{
+    SharedBuffer *buffer = nullptr;
+    std::vector<uv_buf_t> bufs;
+
+    if (length <= 0)
+    {
+        return 0;
+    }
+    buffer = SHAREDBUFFERPOOL->alloc(data, length);
+    bufs.push_back(uv_buf_init((char*)buffer->data(), length));
+    return send_bufs(bufs, buffer, nullptr);
+}
+
+int RtmpMessageTransport::send_bufs(std::vector<uv_buf_t> &bufs, SharedBuffer *buffer, SharedBuffer *header_buffer)
+{
+    int ret;
+
+    if (metrics_)
+    {
+        for (auto iter = bufs.begin(); iter != bufs.end(); ++iter)
+        {
+            metrics_->bytes_out.fetch_add(iter->len, std::memory_order_relaxed);
+        }
+    }
+    if (cork_depth_ > 0)
+    {
+        cork_bufs_.insert(cork_bufs_.end(), bufs.begin(), bufs.end());
+        cork_buffers_.push_back(buffer);
+        if (header_buffer)
+        {
+            cork_buffers_.push_back(header_buffer);
+        }
+        return 0;
+    }
+    RtmpSessionMetrics *metrics = metrics_;
+    int64_t start = metrics ? Utils::Util::getSteadyTimeUs() : 0;
+    ret = socket_->sendDataVec(&bufs[0], (int)bufs.size(), [buffer, header_buffer, metrics, start](int status) {
+        if (header_buffer)
+        {
+            header_buffer->unref();
+        }
+        buffer->unref();
+        if (metrics && status == 0)
+        {
+            metrics->write_time.record(Utils::Util::getSteadyTimeUs() - start);
+        }
+    });
+    update_write_pending();
+    return ret;
+}
+
+void RtmpMessageTransport::update_write_pending()
+{
+    if (metrics_)
+    {
+        metrics_->write_pending_bytes.store((int64_t)socket_->writeQueueSize(), std::memory_order_relaxed);
+    }
+}
+
 int RtmpMessageTransport::sendRtmpMessage(RtmpBasePacket *pkg, int streamid)
 {
+    SharedBuffer *buffer = nullptr;
     uint8_t *payload = nullptr;
     int size;
     int ret;
@@ -75,273 +190,460 @@ int RtmpMessageTransport::sendRtmpMessage(RtmpBasePacket *pkg, int streamid)
     header.msg_stream_id = streamid;
     header.msg_length = pkg->get_pkg_len();
     header.timestamp = pkg->getTimestamp();
-    ret = pkg->encode(payload, size);
+    ret = pkg->encode(buffer, payload, size);
     if (ret < 0)
     {
         return -1;
     }
-    do_send_message(&header, payload, size);
+    // buffer reference is owned by the socket write now, it will be unref when write complete
+    do_send_message(&header, buffer, payload, size);
     on_send_message(pkg);
-    delete[] payload;
     return 0;
 }
 
 int RtmpMessageTransport::recvRtmpMessage(const char *data, int length, RtmpBasePacket **ppkg)
 {
+    const uint8_t *p = (const uint8_t*)data;
     int offset = 0;
-    int ret;
-    bool first_recv_msg = false;
-    uint32_t cs_id;
-    RtmpChunkData *chunk = nullptr;
+    int ret = 0;
+    bool finish = false;
 
-    RtmpHeader header;
-    ret = header.decode((uint8_t*)data+offset, length-offset);
-    if (ret < 0)
+    // every byte is consumed only once, a chunk header split by socket read
+    // is kept in header_buf_ and continued on next call
+    while (offset < length && !finish)
     {
-        return ret;
-    }
-    offset += ret;
-    cs_id = header.chunk_stream_id;
-    if (chunk_cache_.find(cs_id) != chunk_cache_.end())
-    {
-        chunk = chunk_cache_[cs_id];
-    }
-    else
-    {
-        chunk = new RtmpChunkData();
-        chunk_cache_.insert(std::make_pair(cs_id, chunk));
+        switch (decode_state_)
+        {
+            case RTMP_CHUNK_DECODE_BASIC_HEADER:
+                ret = decode_basic_header(p+offset, length-offset);
+                break;
+            case RTMP_CHUNK_DECODE_MSG_HEADER:
+                ret = decode_msg_header(p+offset, length-offset);
+                break;
+            case RTMP_CHUNK_DECODE_EXTENDED_TIMESTAMP:
+                ret = decode_extended_timestamp(p+offset, length-offset);
+                break;
+            case RTMP_CHUNK_DECODE_PAYLOAD:
+            default:
+                ret = do_recv_payload(decode_chunk_, p+offset, length-offset, finish);
+                break;
+        }
+        if (ret < 0)
+        {
+            return ret;
+        }
+        offset += ret;
     }
-    if (chunk->get_current_len() <= 0)
+    if (metrics_)
     {
-        // this chunk first recv msg;
-        first_recv_msg = true;
+        metrics_->bytes_in.fetch_add(offset, std::memory_order_relaxed);
     }
-    chunk->h.chunk_type = header.chunk_type;
-    chunk->h.chunk_stream_id = header.chunk_stream_id;
-    if (header.chunk_type <= RTMP_CHUNK_FMT2_TYPE)
+    on_recv_bytes(offset);
+    if (finish)
     {
-        chunk->time_delta = header.timestamp;
-        if (header.timestamp < RTMP_EXTENDED_TIMESTAMP)
+        // rtmp message recv complete
+        RtmpChunkData *chunk = decode_chunk_;
+        // packet of last message is freed by caller before it recv again
+        release_view();
+        decode_chunk_ = nullptr;
+        if (metrics_)
         {
-            if (header.chunk_type == RTMP_CHUNK_FMT0_TYPE)
-            {
-                chunk->h.timestamp = header.timestamp;
+            metrics_->addMessageIn(chunk->h.msg_type_id);
+        }
+        RtmpMessage rtmpmsg;
+        rtmpmsg.create_msg(&chunk->h, chunk->finish_payload());
+        uint8_t type = rtmpmsg.rtmp_header.msg_type_id;
+        if (media_callback_ && (type == RTMP_MSG_AudioMessage || type == RTMP_MSG_VideoMessage
+            || type == RTMP_MSG_AMF0DataMessage || type == RTMP_MSG_AMF3DataMessage)) {
+            media_callback_(type, rtmpmsg.rtmp_header.timestamp, rtmpmsg.rtmp_buffer);
+        }
+        if (type == RTMP_MSG_AudioMessage || type == RTMP_MSG_VideoMessage) {
+            // media never go through command dispatch
+            if (media_passthrough_) {
+                decode_passthrough_msg(&rtmpmsg, ppkg);
             }
-            else
-            {
-                chunk->h.timestamp += header.timestamp;
+            else {
+                decode_media_msg(&rtmpmsg, ppkg);
             }
+            return offset;
         }
-        if (header.chunk_type <= RTMP_CHUNK_FMT1_TYPE)
-        {
-            if (!first_recv_msg && header.msg_length != chunk->h.msg_length)
+        if (decode_msg(&rtmpmsg, ppkg) >= 0 && *ppkg != nullptr) {
+            on_recv_message(*ppkg);
+        }
+    }
+    return offset;
+}
+
+void RtmpMessageTransport::on_recv_bytes(int length)
+{
+    // counted once per read, sequence number is bytes received so far and wrap at 2^32
+    in_ack_size.recv_bytes += length;
+    if (in_ack_size.window == 0 || in_ack_size.recv_bytes - in_ack_size.seq < in_ack_size.window)
+    {
+        return;
+    }
+    in_ack_size.seq = in_ack_size.recv_bytes;
+    RtmpAcknowledgementPacket *pkg = new RtmpAcknowledgementPacket();
+    AutoFree(RtmpAcknowledgementPacket, pkg);
+    pkg->sequence_number = in_ack_size.seq;
+    sendRtmpMessage(pkg, 0);
+}
+
+int RtmpMessageTransport::send_user_control(int16_t type, int32_t data)
+{
+    RtmpUserControlPacket *pkg = new RtmpUserControlPacket();
+    AutoFree(RtmpUserControlPacket, pkg);
+    pkg->event_type = type;
+    pkg->event_data = data;
+    return sendRtmpMessage(pkg, 0);
+}
+
+int RtmpMessageTransport::sendPing()
+{
+    // low 32 bits of us clock, the difference is right even after wrap
+    return send_user_control(RtmpPCUCPingRequest, (int32_t)(uint32_t)Utils::Util::getSteadyTimeUs());
+}
+
+void RtmpMessageTransport::on_user_control(RtmpUserControlPacket *packet)
+{
+    uint32_t rtt;
+
+    switch (packet->event_type)
+    {
+        case RtmpPCUCSetBufferLength:
+            in_buffer_length = packet->extra_data;
+            break;
+        case RtmpPCUCStreamBegin:
+            ILOG("stream begin\n");
+            break;
+        case RtmpPCUCPingRequest:
+            // server drop client that do not answer
+            send_user_control(RtmpPCUCPingResponse, packet->event_data);
+            break;
+        case RtmpPCUCPingResponse:
+            rtt = (uint32_t)Utils::Util::getSteadyTimeUs() - (uint32_t)packet->event_data;
+            if (rtt > RTMP_PING_MAX_RTT_US)
             {
-                // msg length changed it is not allow
-                ELOG("can not change message len from %d to %d\n", chunk->h.msg_length, header.msg_length);
-                return -2;
+                WLOG("drop ping response, rtt %u us\n", rtt);
+                break;
             }
-            chunk->h.msg_length = header.msg_length;
-            chunk->h.msg_type_id = header.msg_type_id;
-            if (header.chunk_stream_id == RTMP_CHUNK_FMT0_TYPE)
+            srtt_us_ = (srtt_us_ == 0) ? rtt : (srtt_us_ * 7 + rtt) / 8;
+            if (metrics_)
             {
-                chunk->h.msg_stream_id = header.msg_stream_id;
+                metrics_->rtt.record(rtt);
+                metrics_->rtt_us.store(srtt_us_, std::memory_order_relaxed);
             }
-        }
+            DLOG("ping rtt %u us, smoothed %d us\n", rtt, (int)srtt_us_);
+            break;
+        default:
+            break;
     }
-    else
+}
+
+void RtmpMessageTransport::setMediaMessageCallback(RtmpMediaMessageCallback callback)
+{
+    media_callback_ = callback;
+}
+
+int RtmpMessageTransport::do_send_message(RtmpHeader *header, SharedBuffer *buffer, uint8_t *payload, int length)
+{
+    uint8_t *start = payload;
+    uint8_t *end = payload+length;
+    SharedBuffer *header_buffer = nullptr;
+    uint8_t *headers = nullptr;
+    int header_length = 0;
+    int fmt3_length = 0;
+    int chunk_count;
+    int len;
+    std::vector<uv_buf_t> bufs;
+
+    if (length <= 0)
     {
-        // fmt3
-        // only base header
-        if (first_recv_msg && chunk->time_delta < RTMP_EXTENDED_TIMESTAMP)
+        if (buffer)
         {
-            WLOG("update timestamp in fmt3 other data use last time\n");
-            chunk->h.timestamp += chunk->time_delta;
+            buffer->unref();
         }
+        return 0;
     }
-    if (chunk->time_delta >= RTMP_EXTENDED_TIMESTAMP)
+    // headers are encoded once per message in one side buffer and the payload is not copied,
+    // every chunk is a header buf followed by a buf point to the payload, all fmt3 chunks share one header
+    chunk_count = (length + out_chunk_size - 1) / out_chunk_size;
+    header_buffer = SHAREDBUFFERPOOL->alloc(RTMP_CHUNK_FMT0_HEADER_MAX_SIZE + RTMP_CHUNK_FMT3_HEADER_MAX_SIZE);
+    headers = header_buffer->data();
+    bufs.reserve(chunk_count * 2);
+    if (metrics_)
     {
-        // have 4 bytes extend time
-        if (length - offset < 4)
-        {
-            return -1;
-        }
-        uint32_t time;
-        char *pp = (char*)&time;
-        pp[3] = data[offset++];
-        pp[2] = data[offset++];
-        pp[1] = data[offset++];
-        pp[0] = data[offset++];
-        // use 31bits timestamp
-        time &= 0x7fffffff;
-        chunk->h.timestamp = time;
+        metrics_->chunks_out.fetch_add(chunk_count, std::memory_order_relaxed);
+        metrics_->addMessageOut(header->msg_type_id);
     }
-    bool finish = false;
-    ret = do_recv_payload(chunk, (uint8_t*)data+offset, length-offset, finish);
-    if (ret < 0)
+    header->chunk_type = select_chunk_type(header);
+    header_length = header->encode(headers, RTMP_CHUNK_FMT0_HEADER_MAX_SIZE);
+    if (chunk_count > 1)
     {
-        chunk->h.timestamp -= chunk->time_delta;
-        return ret;
+        header->chunk_type = RTMP_CHUNK_FMT3_TYPE;
+        fmt3_length = header->encode(headers+header_length, RTMP_CHUNK_FMT3_HEADER_MAX_SIZE);
     }
-    offset += ret;
-    if (finish)
+    while(start < end)
     {
-        // rtmp message recv complete
-        RtmpMessage *rtmpmsg = new RtmpMessage();
-        AutoFree(RtmpMessage, rtmpmsg);
-        rtmpmsg->create_msg(&chunk->h, chunk->getPaylaod(), chunk->h.msg_length);
-        on_recv_message(rtmpmsg);
-        if (rtmpmsg->rtmp_header.msg_type_id == RTMP_MSG_AudioMessage
-            || rtmpmsg->rtmp_header.msg_type_id == RTMP_MSG_VideoMessage) {
-            ILOG("video/audio msg\n");
-            decode_media_msg(rtmpmsg, ppkg);
+        if (start == payload)
+        {
+            bufs.push_back(uv_buf_init((char*)headers, header_length));
         }
-        else {
-            decode_msg(rtmpmsg, ppkg);
+        else
+        {
+            bufs.push_back(uv_buf_init((char*)headers+header_length, fmt3_length));
         }
-        chunk->reset();
+        len = UTILS_MIN(out_chunk_size, (int)(end-start));
+        bufs.push_back(uv_buf_init((char*)start, len));
+        start += len;
     }
-    return offset;
+    send_bufs(bufs, buffer, header_buffer);
+    return 0;
 }
 
-int RtmpMessageTransport::do_send_message(RtmpHeader *header, uint8_t *payload, int length)
+uint8_t RtmpMessageTransport::select_chunk_type(RtmpHeader *header)
 {
-    uint8_t *start = payload;
-    uint8_t *end = payload+length;
-    uint8_t header_data[16] = {0};
-    int header_length = 0;
-    int index = 0;
+    RtmpOutChunkStream &last = out_streams_[header->chunk_stream_id];
+    uint32_t timestamp = header->timestamp;
+    uint8_t fmt = RTMP_CHUNK_FMT0_TYPE;
 
-    while(start < end)
+    // audio and video use their own chunk stream, timestamp delta and often length repeat
+    if (last.valid && (header->msg_type_id == RTMP_MSG_AudioMessage || header->msg_type_id == RTMP_MSG_VideoMessage) &&
+        header->msg_stream_id == last.msg_stream_id && timestamp >= last.timestamp &&
+        timestamp - last.timestamp < RTMP_EXTENDED_TIMESTAMP)
     {
-        if (start == payload)
+        if (header->msg_length == last.msg_length && header->msg_type_id == last.msg_type_id)
         {
-            // first packet use fmt0 chunk header 12(16) bytes
-            header->chunk_type = 0;
+            fmt = RTMP_CHUNK_FMT2_TYPE;
         }
         else
         {
-            // use fmt3 chunk header 1(5) bytes
-            header->chunk_type = 3;
-        }
-        header_length = header->encode(header_data, sizeof(header_data));
-        memcpy(send_cache_buf+index, header_data, header_length);
-        index += header_length;
-        int len = UTILS_MIN(out_chunk_size, (int)(end-start));
-        //ILOG("header len %d payload len %d data\n", header_length, len);
-        memcpy(send_cache_buf+index, start, len);
-        index += len;
-        start += len;
-        int cache_left = RTMP_DEFAULT_CACHE_BUFFER_SIZE - index;
-        if (cache_left <= RTMP_CHUNK_FMT0_HEADER_MAX_SIZE)
-        {
-            // cache not enough send data free it
-            // send data
-            //ILOG("cache not enouth send first\n");
-            socket_->sendData((const char*)send_cache_buf, index);
-            index = 0;
+            fmt = RTMP_CHUNK_FMT1_TYPE;
         }
+        // fmt1 and fmt2 carry timestamp delta
+        header->timestamp = timestamp - last.timestamp;
     }
-    if (index > 0)
+    last.valid = true;
+    last.timestamp = timestamp;
+    last.msg_length = header->msg_length;
+    last.msg_type_id = header->msg_type_id;
+    last.msg_stream_id = header->msg_stream_id;
+    return fmt;
+}
+
+int RtmpMessageTransport::fill_header(const uint8_t *data, int length)
+{
+    int len = UTILS_MIN(header_need_ - header_len_, length);
+    memcpy(header_buf_+header_len_, data, len);
+    header_len_ += len;
+    return len;
+}
+
+int RtmpMessageTransport::decode_basic_header(const uint8_t *data, int length)
+{
+    int offset = 0;
+    uint8_t fmt;
+    uint32_t cs_id;
+
+    if (header_len_ == 0)
     {
-        // send data
-        //ILOG("send %d data\n", index);
-        socket_->sendData((const char*)send_cache_buf, index);
-        index = 0;
+        // first byte tell us the basic header size 1, 2 or 3 bytes
+        header_buf_[header_len_++] = data[offset++];
+        cs_id = header_buf_[0] & 0x3f;
+        header_need_ = (cs_id == 0) ? 2 : ((cs_id == 1) ? 3 : 1);
     }
-    return 0;
+    offset += fill_header(data+offset, length-offset);
+    if (header_len_ < header_need_)
+    {
+        return offset;
+    }
+    fmt = (header_buf_[0] >> 6) & 0x03;
+    cs_id = header_buf_[0] & 0x3f;
+    if (cs_id == 0)
+    {
+        cs_id = header_buf_[1] + 64;
+    }
+    else if (cs_id == 1)
+    {
+        cs_id = header_buf_[1] + header_buf_[2] * 256 + 64;
+    }
+    if (chunk_cache_.find(cs_id) != chunk_cache_.end())
+    {
+        decode_chunk_ = chunk_cache_[cs_id];
+    }
+    else
+    {
+        decode_chunk_ = new RtmpChunkData();
+        chunk_cache_.insert(std::make_pair(cs_id, decode_chunk_));
+    }
+    decode_chunk_->h.chunk_type = fmt;
+    decode_chunk_->h.chunk_stream_id = cs_id;
+    header_len_ = 0;
+    if (fmt == RTMP_CHUNK_FMT0_TYPE)
+    {
+        header_need_ = 11;
+    }
+    else if (fmt == RTMP_CHUNK_FMT1_TYPE)
+    {
+        header_need_ = 7;
+    }
+    else if (fmt == RTMP_CHUNK_FMT2_TYPE)
+    {
+        header_need_ = 3;
+    }
+    else
+    {
+        // fmt3 only base header, extended timestamp follow last header of this chunk stream
+        decode_timestamp_ = decode_chunk_->time_delta;
+        if (decode_chunk_->extended_timestamp)
+        {
+            header_need_ = 4;
+            decode_state_ = RTMP_CHUNK_DECODE_EXTENDED_TIMESTAMP;
+            return offset;
+        }
+        on_chunk_header_complete();
+        return offset;
+    }
+    decode_state_ = RTMP_CHUNK_DECODE_MSG_HEADER;
+    return offset;
 }
 
-int RtmpMessageTransport::do_recv_payload(RtmpChunkData *chunk, uint8_t *data, int length, bool &finish)
+int RtmpMessageTransport::decode_msg_header(const uint8_t *data, int length)
 {
     int offset = 0;
-    int payload_len = 0;
+    uint8_t fmt = decode_chunk_->h.chunk_type;
+    uint8_t *p = header_buf_;
 
-    finish = false;
-    payload_len = chunk->h.msg_length - chunk->get_current_len();
-    payload_len = UTILS_MIN(payload_len, in_chunk_size);
-    if (payload_len > length - offset)
+    offset += fill_header(data+offset, length-offset);
+    if (header_len_ < header_need_)
     {
-        return -1;
+        return offset;
     }
-    if (chunk->get_current_len() <= 0)
+    decode_timestamp_ = (p[0] << 16) | (p[1] << 8) | p[2];
+    if (fmt <= RTMP_CHUNK_FMT1_TYPE)
     {
-        chunk->create_payload(chunk->h.msg_length);
+        uint32_t msg_length = (p[3] << 16) | (p[4] << 8) | p[5];
+        if (decode_chunk_->get_current_len() > 0 && msg_length != decode_chunk_->h.msg_length)
+        {
+            // msg length changed it is not allow
+            ELOG("can not change message len from %d to %d\n", decode_chunk_->h.msg_length, msg_length);
+            return -2;
+        }
+        decode_chunk_->h.msg_length = msg_length;
+        decode_chunk_->h.msg_type_id = p[6];
+        if (fmt == RTMP_CHUNK_FMT0_TYPE)
+        {
+            // message stream id is little endian
+            decode_chunk_->h.msg_stream_id = p[7] | (p[8] << 8) | (p[9] << 16) | ((uint32_t)p[10] << 24);
+        }
     }
-    chunk->copy_payload(data+offset, payload_len);
-    offset += payload_len;
-    if (chunk->get_current_len() == chunk->h.msg_length)
+    decode_chunk_->extended_timestamp = (decode_timestamp_ >= RTMP_EXTENDED_TIMESTAMP);
+    header_len_ = 0;
+    if (decode_chunk_->extended_timestamp)
     {
-        ILOG("complete recv rtmp message\n");
-        finish = true;
+        header_need_ = 4;
+        decode_state_ = RTMP_CHUNK_DECODE_EXTENDED_TIMESTAMP;
+        return offset;
     }
+    on_chunk_header_complete();
     return offset;
 }
 
-int RtmpMessageTransport::on_recv_message(RtmpMessage *msg)
+int RtmpMessageTransport::decode_extended_timestamp(const uint8_t *data, int length)
 {
-    int ret = 0;
-    RtmpBasePacket *pkg = nullptr;
+    int offset = 0;
+    uint8_t *p = header_buf_;
 
-    switch(msg->rtmp_header.msg_type_id)
+    offset += fill_header(data+offset, length-offset);
+    if (header_len_ < header_need_)
     {
-        case RTMP_MSG_SetChunkSize:
-        case RTMP_MSG_UserControlMessage:
-        case RTMP_MSG_WindowAcknowledgementSize:
-            ret = decode_msg(msg, &pkg);
-            if (ret < 0)
-            {
-                return ret;
-            }
-            break;
-        case RTMP_MSG_VideoMessage:
-        case RTMP_MSG_AudioMessage:
-            DLOG("recv audio/video msg\n");
-        default:
-            DLOG("recv other(%d) msg\n", msg->rtmp_header.msg_type_id);
-            return 0;
+        return offset;
     }
-    if (pkg == nullptr)
+    // use 31bits timestamp
+    decode_timestamp_ = ((p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]) & 0x7fffffff;
+    header_len_ = 0;
+    on_chunk_header_complete();
+    return offset;
+}
+
+void RtmpMessageTransport::on_chunk_header_complete()
+{
+    RtmpChunkData *chunk = decode_chunk_;
+    uint8_t fmt = chunk->h.chunk_type;
+    bool first_recv_msg = (chunk->get_current_len() == 0);
+
+    if (first_recv_msg)
     {
-        ELOG("pkg decode error\n");
-        return -1;
+        // timestamp only update on the first chunk of message
+        if (fmt == RTMP_CHUNK_FMT0_TYPE)
+        {
+            chunk->h.timestamp = decode_timestamp_;
+        }
+        else
+        {
+            chunk->h.timestamp += decode_timestamp_;
+        }
+    }
+    chunk->time_delta = decode_timestamp_;
+    header_need_ = 0;
+    if (metrics_)
+    {
+        metrics_->chunks_in.fetch_add(1, std::memory_order_relaxed);
     }
-    AutoFree(RtmpBasePacket, pkg);
-    if (msg->rtmp_header.msg_type_id == RTMP_MSG_UserControlMessage)
+    if (chunk->h.msg_length == 0)
     {
-        RtmpUserControlPacket *packet = dynamic_cast<RtmpUserControlPacket*>(pkg);
-        if (packet != nullptr)
+        DLOG("drop empty message type=%d\n", chunk->h.msg_type_id);
+        decode_chunk_ = nullptr;
+        decode_state_ = RTMP_CHUNK_DECODE_BASIC_HEADER;
+        return;
+    }
+    if (first_recv_msg)
+    {
+        chunk->create_payload(chunk->h.msg_length);
+    }
+    chunk_payload_left_ = UTILS_MIN(chunk->h.msg_length - chunk->get_current_len(), in_chunk_size);
+    decode_state_ = RTMP_CHUNK_DECODE_PAYLOAD;
+}
+
+int RtmpMessageTransport::do_recv_payload(RtmpChunkData *chunk, const uint8_t *data, int length, bool &finish)
+{
+    int payload_len = 0;
+
+    finish = false;
+    // copy payload slice directly into the message buffer of chunk stream
+    payload_len = UTILS_MIN(chunk_payload_left_, (uint32_t)length);
+    chunk->copy_payload((uint8_t*)data, payload_len);
+    chunk_payload_left_ -= payload_len;
+    if (chunk_payload_left_ == 0)
+    {
+        decode_state_ = RTMP_CHUNK_DECODE_BASIC_HEADER;
+        if (chunk->get_current_len() == chunk->h.msg_length)
         {
-            if (packet->event_type == RtmpPCUCSetBufferLength)
-            {
-                in_buffer_length = packet->event_data;
-            }
-            if (packet->event_type == RtmpPCUCStreamBegin)
-            {
-                ILOG("stream begin\n");
-            }
-            if (packet->event_type == RtmpPCUCPingRequest)
-            {
-                // send ping message
-            }
+            DLOG("complete recv rtmp message\n");
+            finish = true;
         }
     }
-    else if (msg->rtmp_header.msg_type_id == RTMP_MSG_WindowAcknowledgementSize)
+    return payload_len;
+}
+
+int RtmpMessageTransport::on_recv_message(RtmpBasePacket *pkg)
+{
+    switch (pkg->kind)
     {
-        RtmpSetWindowAckSizePacket *packet = dynamic_cast<RtmpSetWindowAckSizePacket*>(pkg);
-        if (packet != nullptr)
-        {
+        case RTMP_PACKET_USER_CONTROL:
+            on_user_control(static_cast<RtmpUserControlPacket*>(pkg));
+            break;
+        case RTMP_PACKET_SET_WINDOW_ACK_SIZE: {
+            RtmpSetWindowAckSizePacket *packet = static_cast<RtmpSetWindowAckSizePacket*>(pkg);
             if (packet->window_ack_size > 0)
             {
                 in_ack_size.window = (uint32_t)packet->window_ack_size;
                 ILOG("set window in ack size %d\n", packet->window_ack_size);
             }
         }
-    }
-    else if (msg->rtmp_header.msg_type_id == RTMP_MSG_SetChunkSize)
-    {
-        RtmpSetChunkSizePacket *packet = dynamic_cast<RtmpSetChunkSizePacket*>(pkg);
-        if (packet != nullptr)
-        {
+            break;
+        case RTMP_PACKET_SET_CHUNK_SIZE: {
+            RtmpSetChunkSizePacket *packet = static_cast<RtmpSetChunkSizePacket*>(pkg);
             if (packet->chunk_size < RTMP_DEFAULT_CHUNKSIZE || packet->chunk_size > RTMP_MAX_CHUNKSIZE)
             {
                 WLOG("chunk should in [%d, %d], this chunk size is %d\n", RTMP_DEFAULT_CHUNKSIZE, RTMP_MAX_CHUNKSIZE, packet->chunk_size);
@@ -354,57 +656,41 @@ int RtmpMessageTransport::on_recv_message(RtmpMessage *msg)
             ILOG("set chunk size %d\n", packet->chunk_size);
             in_chunk_size = packet->chunk_size;
         }
-    }
-    else
-    {
-        ILOG("other msg type %d\n", msg->rtmp_header.msg_type_id);
-        return 0;
+            break;
+        default:
+            DLOG("recv other(%d) msg\n", pkg->get_msg_type());
+            break;
     }
     return 0;
 }
 
 int RtmpMessageTransport::on_send_message(RtmpBasePacket *pkg)
 {
-    switch(pkg->get_msg_type())
+    switch (pkg->kind)
     {
-        case RTMP_MSG_SetChunkSize: {
-            RtmpSetChunkSizePacket *packet = dynamic_cast<RtmpSetChunkSizePacket *>(pkg);
-            if (packet) {
-                out_chunk_size = packet->chunk_size;
-            }
+        case RTMP_PACKET_SET_CHUNK_SIZE:
+            out_chunk_size = static_cast<RtmpSetChunkSizePacket*>(pkg)->chunk_size;
+            break;
+        case RTMP_PACKET_SET_WINDOW_ACK_SIZE:
+            out_ack_size.window = static_cast<RtmpSetWindowAckSizePacket*>(pkg)->window_ack_size;
+            break;
+        case RTMP_PACKET_CONNECT: {
+            RtmpConnectPacket *packet = static_cast<RtmpConnectPacket*>(pkg);
+            requestsMap_[packet->number] = packet->command_name;
         }
             break;
-        case RTMP_MSG_WindowAcknowledgementSize: {
-            RtmpSetWindowAckSizePacket *packet = dynamic_cast<RtmpSetWindowAckSizePacket *>(pkg);
-            if (packet) {
-                out_ack_size.window = packet->window_ack_size;
-            }
+        case RTMP_PACKET_CREATE_STREAM: {
+            RtmpCreateStreamPacket *packet = static_cast<RtmpCreateStreamPacket*>(pkg);
+            requestsMap_[packet->number] = packet->command_name;
         }
             break;
-        case RTMP_MSG_AMF0CommandMessage:
-        case RTMP_MSG_AMF3CommandMessage: {
-            if (true) {
-                RtmpConnectPacket *packet = dynamic_cast<RtmpConnectPacket *>(pkg);
-                if (packet) {
-                    requestsMap_[packet->number] = packet->command_name;
-                }
-            }
-            if (true) {
-                RtmpCreateStreamPacket *packet = dynamic_cast<RtmpCreateStreamPacket *>(pkg);
-                if (packet) {
-                    requestsMap_[packet->number] = packet->command_name;
-                }
-            }
-            if (true) {
-                RtmpFMLEStartPacket *packet = dynamic_cast<RtmpFMLEStartPacket *>(pkg);
-                if (packet) {
-                    requestsMap_[packet->number] = packet->command_name;
-                }
-            }
+        case RTMP_PACKET_FMLE_START: {
+            RtmpFMLEStartPacket *packet = static_cast<RtmpFMLEStartPacket*>(pkg);
+            requestsMap_[packet->number] = packet->command_name;
         }
             break;
         default:
-            return 0;
+            break;
     }
     return 0;
 }
@@ -412,245 +698,241 @@ int RtmpMessageTransport::on_send_message(RtmpBasePacket *pkg)
 int RtmpMessageTransport::decode_media_msg(RtmpMessage *msg, RtmpBasePacket **ppacket)
 {
     int ret = 0;
-    int offset = 0;
-    //RtmpBasePacket *pkg = nullptr;
+    RtmpBasePacket *pkg = nullptr;
     uint8_t *body = msg->rtmp_body;
     uint32_t bodylen = msg->rtmp_body_len;
 
     if (msg->rtmp_header.msg_type_id == RTMP_MSG_AudioMessage) {
         // audio msg
-        RtmpAudioPacket *pkg = new RtmpAudioPacket();
-        pkg->timestamp = msg->rtmp_header.timestamp;
-        pkg->decode(body, bodylen);
-        *ppacket = pkg;
+        RtmpAudioPacket *audio = new RtmpAudioPacket();
+        audio->timestamp = msg->rtmp_header.timestamp;
+        pkg = audio;
+    }
+    else if (bodylen >= 2 && body[1] == 0x00) {
+        // avc packet
+        pkg = new RtmpAVCPacket();
+    }
+    else if (bodylen >= 2 && body[1] == 0x01) {
+        // nalu packet
+        RtmpVideoPacket *video = new RtmpVideoPacket();
+        video->timestamp = msg->rtmp_header.timestamp;
+        pkg = video;
     }
     else {
-        // video msg
-        if (body[1] == 0x00) {
-            // avc packet
-            RtmpAVCPacket *pkg = new RtmpAVCPacket();
-            pkg->decode(body, bodylen);
-            *ppacket = pkg;
+        return 0;
+    }
+    ret = pkg->decode(body, bodylen);
+    if (ret < 0) {
+        WLOG("decode media msg type=%d len=%u error\n", msg->rtmp_header.msg_type_id, bodylen);
+        delete pkg;
+        return ret;
+    }
+    *ppacket = pkg;
+    return 0;
+}
+
+int RtmpMessageTransport::decode_passthrough_msg(RtmpMessage *msg, RtmpBasePacket **ppacket)
+{
+    RtmpMediaPacket *pkg = new RtmpMediaPacket(msg->rtmp_header.msg_type_id, msg->rtmp_buffer);
+    pkg->timestamp = msg->rtmp_header.timestamp;
+    if (pkg->decode(msg->rtmp_body, msg->rtmp_body_len) < 0) {
+        WLOG("decode media msg type=%d len=%u error\n", msg->rtmp_header.msg_type_id, msg->rtmp_body_len);
+        delete pkg;
+        return -1;
+    }
+    if (pkg->is_video() && pkg->codec_id == 7) {
+        if (pkg->is_sequence_header()) {
+            nalu_length_sizes_[msg->rtmp_header.msg_stream_id] = pkg->nalu_length_size;
         }
-        else if (body[1] == 0x01) {
-            // nalu packet
-            RtmpVideoPacket *pkg = new RtmpVideoPacket();
-            pkg->timestamp = msg->rtmp_header.timestamp;
-            pkg->decode(body, bodylen);
-            *ppacket = pkg;
+        else {
+            auto iter = nalu_length_sizes_.find(msg->rtmp_header.msg_stream_id);
+            if (iter != nalu_length_sizes_.end()) {
+                pkg->nalu_length_size = iter->second;
+            }
         }
     }
+    *ppacket = pkg;
     return 0;
 }
 
-int RtmpMessageTransport::decode_msg(RtmpMessage *msg, RtmpBasePacket **ppacket)
+int RtmpMessageTransport::decode_view_msg(RtmpMessage *msg, int offset, RtmpBasePacket **ppacket)
+{
+    int ret;
+    RtmpAmf0ViewPacket *pkg = new RtmpAmf0ViewPacket(&amf0_arena_, msg->rtmp_header.msg_type_id);
+
+    ret = pkg->decode(msg->rtmp_body+offset, msg->rtmp_body_len-offset);
+    if (ret < 0) {
+        ELOG("decode %s error\n", pkg->command_name.c_str());
+        delete pkg;
+        return ret;
+    }
+    // strings point into body, keep it with the arena
+    msg->rtmp_buffer->ref();
+    view_body_ = msg->rtmp_buffer;
+    *ppacket = pkg;
+    return offset + ret;
+}
+
+void RtmpMessageTransport::release_view()
+{
+    amf0_arena_.reset();
+    if (view_body_) {
+        view_body_->unref();
+        view_body_ = nullptr;
+    }
+}
+
+template<typename T>
+static RtmpBasePacket* create_packet()
+{
+    return new T();
+}
+
+static RtmpBasePacket* create_create_stream_response()
+{
+    return new RtmpCreateStreamResponsePacket(0, 0);
+}
+
+static RtmpBasePacket* create_fmle_start_response()
+{
+    return new RtmpFMLEStartResponsePacket(0);
+}
+
+struct RtmpCommandDecoder
+{
+    uint32_t hash;
+    const char *name;
+    RtmpBasePacket* (*create)();
+};
+
+// commands sent by peer, other names are decoded as amf0 view
+static const RtmpCommandDecoder rtmp_request_decoders[] = {
+    { rtmp_command_hash("connect"), "connect", create_packet<RtmpConnectPacket> },
+    { rtmp_command_hash("createStream"), "createStream", create_packet<RtmpCreateStreamPacket> },
+    { rtmp_command_hash("play"), "play", create_packet<RtmpPlayPacket> },
+    { rtmp_command_hash("pause"), "pause", create_packet<RtmpPausePacket> },
+    { rtmp_command_hash("releaseStream"), "releaseStream", create_packet<RtmpFMLEStartPacket> },
+    { rtmp_command_hash("FCPublish"), "FCPublish", create_packet<RtmpFMLEStartPacket> },
+    { rtmp_command_hash("publish"), "publish", create_packet<RtmpPublishPacket> },
+    { rtmp_command_hash("FCUnpublish"), "FCUnpublish", create_packet<RtmpFMLEStartPacket> },
+    { rtmp_command_hash("closeStream"), "closeStream", create_packet<RtmpCloseStreamPacket> },
+};
+
+// _result and _error, keyed on name of our request with same transaction id
+static const RtmpCommandDecoder rtmp_response_decoders[] = {
+    { rtmp_command_hash("connect"), "connect", create_packet<RtmpConnectResponsePacket> },
+    { rtmp_command_hash("createStream"), "createStream", create_create_stream_response },
+    { rtmp_command_hash("releaseStream"), "releaseStream", create_fmle_start_response },
+    { rtmp_command_hash("FCPublish"), "FCPublish", create_fmle_start_response },
+    { rtmp_command_hash("FCUnpublish"), "FCUnpublish", create_fmle_start_response },
+};
+
+template<int N>
+static const RtmpCommandDecoder* find_command_decoder(const RtmpCommandDecoder (&decoders)[N], const std::string &name)
+{
+    uint32_t hash = rtmp_command_hash(name.c_str());
+
+    for (int i = 0; i < N; i++) {
+        if (decoders[i].hash == hash && name == decoders[i].name) {
+            return &decoders[i];
+        }
+    }
+    return nullptr;
+}
+
+int RtmpMessageTransport::decode_command_msg(RtmpMessage *msg, RtmpBasePacket **ppacket)
 {
     int ret = 0;
     int offset = 0;
-    RtmpBasePacket *pkg = nullptr;
     uint8_t *body = msg->rtmp_body;
     uint32_t bodylen = msg->rtmp_body_len;
+    const RtmpCommandDecoder *decoder = nullptr;
+    std::string command;
 
-    if (msg->rtmp_header.msg_type_id == RTMP_MSG_AMF0CommandMessage
-        || msg->rtmp_header.msg_type_id == RTMP_MSG_AMF3CommandMessage
-        || msg->rtmp_header.msg_type_id == RTMP_MSG_AMF0DataMessage
-        || msg->rtmp_header.msg_type_id == RTMP_MSG_AMF3DataMessage) {
-        if (msg->rtmp_header.msg_type_id == RTMP_MSG_AMF3CommandMessage) {
-            offset++;
-        }
-        std::string command = "";
-        ret = rtmp_amf0_read_string(body+offset, bodylen-offset, command);
-        if (ret < 0) {
-            ELOG("deocde command error\n");
-            return ret;
-        }
-        offset += ret;
-        if (command == "_result" || command == "_error") {
-            // rtmp result response or error response
-            double number = 0.0;
-            ret = rtmp_amf0_read_number(body+offset, bodylen-offset, number);
-            if (ret < 0) {
-                ELOG("deocde number error for %s\n", command.c_str());
-                return ret;
-            }
-            // reset offset to 0 decode again
-            offset = 0;
-            if (msg->rtmp_header.msg_type_id == RTMP_MSG_AMF3CommandMessage) {
-                offset++;
-            }
-            if (requestsMap_.find(number) == requestsMap_.end()) {
-                ELOG("not find this request %s\n", command.c_str());
-                return -2;
-            }
-            std::string request_name = requestsMap_[number];
-            if (request_name == "connect") {
-                pkg = new RtmpConnectResponsePacket();
-                ret = pkg->decode(body+offset, bodylen-offset);
-                if (ret < 0) {
-                    ELOG("decode connect res error\n");
-                    return ret;
-                }
-                offset += ret;
-            } else if (request_name == "createStream") {
-                pkg = new RtmpCreateStreamResponsePacket(0, 0);
-                ret = pkg->decode(body+offset, bodylen-offset);
-                if (ret < 0) {
-                    ELOG("decode create stream res error\n");
-                    return ret;
-                }
-                offset += ret;
-            } else if (request_name == "releaseStream") {
-                pkg = new RtmpFMLEStartResponsePacket(0);
-                ret = pkg->decode(body+offset, bodylen-offset);
-                if (ret < 0) {
-                    ELOG("decode release stream res error\n");
-                    return ret;
-                }
-                offset += ret;
-            } else if (request_name == "FCPublish") {
-                pkg = new RtmpFMLEStartResponsePacket(0);
-                ret = pkg->decode(body+offset, bodylen-offset);
-                if (ret < 0) {
-                    ELOG("decode fcpublish res error\n");
-                    return ret;
-                }
-                offset += ret;
-            } else if (request_name == "FCUnpublish") {
-                pkg = new RtmpFMLEStartResponsePacket(0);
-                ret = pkg->decode(body+offset, bodylen-offset);
-                if (ret < 0) {
-                    ELOG("decode fcunpublish res error\n");
-                    return ret;
-                }
-                offset += ret;
-            } else {
-                ELOG("unkonw request name\n");
-                return -2;
-            }
-            *ppacket = pkg;
-            return offset;
+    if (msg->rtmp_header.msg_type_id == RTMP_MSG_AMF3CommandMessage) {
+        offset++;
+    }
+    ret = rtmp_amf0_read_string(body+offset, bodylen-offset, command);
+    if (ret < 0) {
+        ELOG("deocde command error\n");
+        return ret;
+    }
+    if (command == "_result" || command == "_error") {
+        // rtmp result response or error response
+        double number = 0.0;
+        int len = rtmp_amf0_read_number(body+offset+ret, bodylen-offset-ret, number);
+        if (len < 0) {
+            ELOG("deocde number error for %s\n", command.c_str());
+            return len;
         }
-        // reset offset to 0 decode again
-        offset = 0;
-        if (msg->rtmp_header.msg_type_id == RTMP_MSG_AMF3CommandMessage) {
-            offset++;
+        auto iter = requestsMap_.find(number);
+        if (iter == requestsMap_.end()) {
+            ELOG("not find this request %s\n", command.c_str());
+            return -2;
         }
-        if (command == "connect") {
-            pkg = new RtmpConnectPacket();
-            ret = pkg->decode(body+offset, bodylen-offset);
-            if (ret < 0) {
-                return ret;
-            }
-            offset += ret;
-        } else if (command == "createStream") {
-            pkg = new RtmpCloseStreamPacket();
-            ret = pkg->decode(body+offset, bodylen-offset);
-            if (ret < 0) {
-                return ret;
-            }
-            offset += ret;
-        } else if (command == "play") {
-            pkg = new RtmpPlayPacket();
-            ret = pkg->decode(body+offset, bodylen-offset);
-            if (ret < 0) {
-                return ret;
-            }
-            offset += ret;
-        } else if (command == "pause") {
-            pkg = new RtmpPausePacket();
-            ret = pkg->decode(body+offset, bodylen-offset);
-            if (ret < 0) {
-                return ret;
-            }
-            offset += ret;
-        } else if (command == "releaseStream") {
-            pkg = new RtmpFMLEStartPacket();
-            ret = pkg->decode(body+offset, bodylen-offset);
-            if (ret < 0) {
-                return ret;
-            }
-            offset += ret;
-        } else if (command == "FCPublish") {
-            pkg = new RtmpFMLEStartPacket();
-            ret = pkg->decode(body+offset, bodylen-offset);
-            if (ret < 0) {
-                return ret;
-            }
-            offset += ret;
-        } else if (command == "publish") {
-            pkg = new RtmpPublishPacket();
-            ret = pkg->decode(body+offset, bodylen-offset);
-            if (ret < 0) {
-                return ret;
-            }
-            offset += ret;
-        } else if (command == "FCUnpublish") {
-            pkg = new RtmpFMLEStartPacket();
-            ret = pkg->decode(body+offset, bodylen-offset);
-            if (ret < 0) {
-                return ret;
-            }
-            offset += ret;
-        } else if (command == "@setDataFrame") {
-            pkg = new RtmpOnMetaDataPacket();
-            ret = pkg->decode(body+offset, bodylen-offset);
-            if (ret < 0) {
-                return ret;
-            }
-            offset += ret;
-        } else if (command == "onMetaData") {
-            pkg = new RtmpOnMetaDataPacket();
-            ret = pkg->decode(body+offset, bodylen-offset);
-            if (ret < 0) {
-                return ret;
-            }
-            offset += ret;
-        } else if (command == "closeStream") {
-            pkg = new RtmpCloseStreamPacket();
-            ret = pkg->decode(body+offset, bodylen-offset);
-            if (ret < 0) {
-                return ret;
-            }
-            offset += ret;
-        } else if (msg->rtmp_header.msg_type_id == RTMP_MSG_AMF0CommandMessage
-                    || msg->rtmp_header.msg_type_id == RTMP_MSG_AMF3CommandMessage) {
-            pkg = new RtmpCallPacket();
-            ret = pkg->decode(body+offset, bodylen-offset);
-            if (ret < 0) {
-                return ret;
-            }
-            offset += ret;
-        } else {
-            ELOG("error command name %s\n", command.c_str());
+        decoder = find_command_decoder(rtmp_response_decoders, iter->second);
+        if (decoder == nullptr) {
+            ELOG("unkonw request name %s\n", iter->second.c_str());
             return -2;
         }
-        *ppacket = pkg;
-        return offset;
-    } else if (msg->rtmp_header.msg_type_id == RTMP_MSG_UserControlMessage) {
-        pkg = new RtmpUserControlPacket();
-        ret = pkg->decode(body+offset, bodylen-offset);
-        offset += ret;
-    } else if (msg->rtmp_header.msg_type_id == RTMP_MSG_WindowAcknowledgementSize) {
-        pkg = new RtmpSetWindowAckSizePacket();
-        ret = pkg->decode(body+offset, bodylen-offset);
-        offset += ret;
-    } else if (msg->rtmp_header.msg_type_id == RTMP_MSG_Acknowledgement) {
-        pkg = new RtmpAcknowledgementPacket();
-        ret = pkg->decode(body+offset, bodylen-offset);
-        offset += ret;
-    } else if (msg->rtmp_header.msg_type_id == RTMP_MSG_SetChunkSize) {
-        pkg = new RtmpSetChunkSizePacket();
-        ret = pkg->decode(body+offset, bodylen-offset);
-        offset += ret;
-    } else if (msg->rtmp_header.msg_type_id == RTMP_MSG_SetPeerBandwidth) {
-        pkg = new RtmpSetPeerBandwidthPacket();
-        ret = pkg->decode(body+offset, bodylen-offset);
-        offset += ret;
-    } else {
-        WLOG("drop unknow msg type=%d\n", msg->rtmp_header.msg_type_id);
-        return -2;
+        requestsMap_.erase(iter);
+    }
+    else {
+        decoder = find_command_decoder(rtmp_request_decoders, command);
+        if (decoder == nullptr) {
+            // onStatus, cue point and other call decode into arena, no tree is allocated
+            return decode_view_msg(msg, offset, ppacket);
+        }
+    }
+    RtmpBasePacket *pkg = decoder->create();
+    ret = pkg->decode(body+offset, bodylen-offset);
+    if (ret < 0) {
+        ELOG("decode %s %s error\n", command.c_str(), decoder->name);
+        delete pkg;
+        return ret;
     }
     *ppacket = pkg;
-    return offset;
+    return offset + ret;
 }
 
+int RtmpMessageTransport::decode_msg(RtmpMessage *msg, RtmpBasePacket **ppacket)
+{
+    int ret = 0;
+    RtmpBasePacket *pkg = nullptr;
+
+    switch (msg->rtmp_header.msg_type_id)
+    {
+        case RTMP_MSG_AMF0CommandMessage:
+        case RTMP_MSG_AMF3CommandMessage:
+            return decode_command_msg(msg, ppacket);
+        case RTMP_MSG_AMF0DataMessage:
+        case RTMP_MSG_AMF3DataMessage:
+            return decode_view_msg(msg, 0, ppacket);
+        case RTMP_MSG_UserControlMessage:
+            pkg = new RtmpUserControlPacket();
+            break;
+        case RTMP_MSG_WindowAcknowledgementSize:
+            pkg = new RtmpSetWindowAckSizePacket();
+            break;
+        case RTMP_MSG_Acknowledgement:
+            pkg = new RtmpAcknowledgementPacket();
+            break;
+        case RTMP_MSG_SetChunkSize:
+            pkg = new RtmpSetChunkSizePacket();
+            break;
+        case RTMP_MSG_SetPeerBandwidth:
+            pkg = new RtmpSetPeerBandwidthPacket();
+            break;
+        default:
+            WLOG("drop unknow msg type=%d\n", msg->rtmp_header.msg_type_id);
+            return -2;
+    }
+    ret = pkg->decode(msg->rtmp_body, msg->rtmp_body_len);
+    if (ret < 0) {
+        ELOG("decode msg type=%d error\n", msg->rtmp_header.msg_type_id);
+        delete pkg;
+        return ret;
+    }
+    *ppacket = pkg;
+    return ret;
+}
@@ -7,8 +7,11 @@
 
 #include <string>
 #include <unordered_map>
+#include <vector>
+#include <functional>
 #include "NetCore.h"
 #include "app_protocol/rtmp/rtmp_stack_packet.h"
+#include "rtmp_metrics.h"
 
 class RtmpMessage
 {
@@ -17,10 +20,12 @@ public:
     virtual ~RtmpMessage();
 
 public:
-    void create_msg(RtmpHeader *header, uint8_t *body, uint32_t length);
+    // take over one reference of body
+    void create_msg(RtmpHeader *header, SharedBuffer *body);
 
 public:
     RtmpHeader rtmp_header;
+    SharedBuffer *rtmp_buffer;
     uint8_t *rtmp_body;
     uint32_t rtmp_body_len;
 };
@@ -36,40 +41,123 @@ struct RtmpAckWindowSize
     }
 };
 
+// last message header sent on one chunk stream, later media message only send what changed
+struct RtmpOutChunkStream
+{
+    bool valid;
+    uint32_t timestamp;
+    uint32_t msg_length;
+    uint8_t msg_type_id;
+    uint32_t msg_stream_id;
+
+    RtmpOutChunkStream() {
+        valid = false;
+        timestamp = msg_length = msg_stream_id = 0;
+        msg_type_id = 0;
+    }
+};
+
+// raw body of audio/video/data message before decode, ref it to keep
+using RtmpMediaMessageCallback = std::function<void(uint8_t type, uint32_t timestamp, SharedBuffer *body)>;
+
+enum RtmpChunkDecodeState
+{
+    RTMP_CHUNK_DECODE_BASIC_HEADER,
+    RTMP_CHUNK_DECODE_MSG_HEADER,
+    RTMP_CHUNK_DECODE_EXTENDED_TIMESTAMP,
+    RTMP_CHUNK_DECODE_PAYLOAD,
+};
+
 class RtmpMessageTransport
 {
 public:
-    RtmpMessageTransport(NetCore::BaseSocket *socket);
+    // metrics is owned by session and can be null
+    RtmpMessageTransport(NetCore::BaseSocket *socket, RtmpSessionMetrics *metrics = nullptr);
     virtual ~RtmpMessageTransport();
 
 public:
     int sendRtmpMessage(RtmpBasePacket *pkg, int streamid);
     int recvRtmpMessage(const char *data, int length, RtmpBasePacket **pmsg);
+    void setMediaMessageCallback(RtmpMediaMessageCallback callback);
+    // audio/video is received as RtmpMediaPacket referencing message body, no nalu is split or copied
+    void setMediaPassthrough(bool enable) { media_passthrough_ = enable; }
+
+public:
+    // messages sent between cork and uncork are written once by uncork, can nest
+    void cork();
+    int uncork();
+    // bytes not in rtmp chunk, e.g. handshake c2, keep order with corked messages
+    int sendRawData(const uint8_t *data, int length);
+
+public:
+    // ping request carry the send time, rtt is measured when server echo it
+    int sendPing();
+    // smoothed, 0 before first ping response
+    int64_t rttUs() const { return srtt_us_; }
 
 private:
-    int do_send_message(RtmpHeader *header, uint8_t *payload, int length);
-    int do_recv_payload(RtmpChunkData *chunk, uint8_t *data, int length, bool &finish);
-    int on_recv_message(RtmpMessage *msg);
+    int do_send_message(RtmpHeader *header, SharedBuffer *buffer, uint8_t *payload, int length);
+    uint8_t select_chunk_type(RtmpHeader *header);
+    int send_bufs(std::vector<uv_buf_t> &bufs, SharedBuffer *buffer, SharedBuffer *header_buffer);
+    void update_write_pending();
+    void on_recv_bytes(int length);
+    void on_user_control(RtmpUserControlPacket *packet);
+    int send_user_control(int16_t type, int32_t data);
+    int do_recv_payload(RtmpChunkData *chunk, const uint8_t *data, int length, bool &finish);
+    int fill_header(const uint8_t *data, int length);
+    int decode_basic_header(const uint8_t *data, int length);
+    int decode_msg_header(const uint8_t *data, int length);
+    int decode_extended_timestamp(const uint8_t *data, int length);
+    void on_chunk_header_complete();
+    int on_recv_message(RtmpBasePacket *pkg);
     int on_send_message(RtmpBasePacket *pkg);
     int decode_media_msg(RtmpMessage *msg, RtmpBasePacket **ppacket);
+    int decode_passthrough_msg(RtmpMessage *msg, RtmpBasePacket **ppacket);
     int decode_msg(RtmpMessage *msg, RtmpBasePacket **ppacket);
+    int decode_command_msg(RtmpMessage *msg, RtmpBasePacket **ppacket);
+    int decode_view_msg(RtmpMessage *msg, int offset, RtmpBasePacket **ppacket);
+    void release_view();
 
 private:
     std::unordered_map<double, std::string> requestsMap_;
+    // amf0 values of last command or data packet, released when next message complete
+    RtmpAmf0Arena amf0_arena_;
+    SharedBuffer *view_body_;
 
 private:
     int32_t in_buffer_length;
     uint32_t in_chunk_size;
     RtmpAckWindowSize in_ack_size;
     std::unordered_map<uint32_t, RtmpChunkData*> chunk_cache_;
+    int64_t srtt_us_;
+
+private:
+    // incremental chunk decode state, survive between socket reads
+    RtmpChunkDecodeState decode_state_;
+    RtmpChunkData *decode_chunk_;
+    uint32_t decode_timestamp_;
+    uint8_t header_buf_[RTMP_CHUNK_FMT0_HEADER_MAX_SIZE];
+    int header_len_;
+    int header_need_;
+    uint32_t chunk_payload_left_;
 
 private:
     uint32_t out_chunk_size;
     RtmpAckWindowSize out_ack_size;
-    uint8_t *send_cache_buf;
+    std::unordered_map<uint32_t, RtmpOutChunkStream> out_streams_;
+
+private:
+    int cork_depth_;
+    std::vector<uv_buf_t> cork_bufs_;
+    std::vector<SharedBuffer*> cork_buffers_;
 
 private:
     NetCore::BaseSocket *socket_;
+    RtmpSessionMetrics *metrics_;
+    RtmpMediaMessageCallback media_callback_;
+    bool media_passthrough_;
+    // avc nalu length size of each message stream, from its sequence header
+    std::unordered_map<uint32_t, int> nalu_length_sizes_;
 };
 
 #endif //RTMP_CLIENT_RTMP_TRANSPORT_H
@@ -7,24 +7,7 @@
 #include "base/logger.h"
 #include "app_protocol/rtmp/rtmp_stack_packet.h"
 #include "autofree.h"
-
-FILE *fp;
-
-int write_spspps_data(uint8_t *sps, int spslen, uint8_t *pps, int ppslen) {
-    char startCode[4] = {0x00,0x00,0x00,0x01};
-    fwrite(startCode, 1, 4, fp);
-    fwrite(sps, 1, spslen, fp);
-    fwrite(startCode, 1, 4, fp);
-    fwrite(pps, 1, ppslen, fp);
-    return 0;
-}
-
-int write_frame_data(uint8_t *nalu, int len) {
-    char startCode[4] = {0x00,0x00,0x00,0x01};
-    fwrite(startCode, 1, 4, fp);
-    fwrite(nalu, 1, len, fp);
-    return 0;
-}
+#include "utils.h"
 
 RtmpClient::RtmpClient(std::string rtmpurl, int dir, bool audio) {
     size_t pos = rtmpurl.find("rtmp://");
@@ -51,8 +34,18 @@ RtmpClient::RtmpClient(std::string rtmpurl, int dir, bool audio) {
     pushPullStatus_ = RTMP_CONNECT_APP;
     data_cache_ = new DataCacheBuf();
     rtmp_transport_ = nullptr;
+    rtmp_socket_ = nullptr;
+    havestop = false;
+    reconnect_ = false;
+    reconnect_max_ = 0;
+    reconnect_count_ = 0;
+    reconnect_delay_ = RTMP_RECONNECT_MIN_DELAY_MS;
+    reconnect_timer_ = nullptr;
+    ping_timer_ = nullptr;
 
     this->audio = audio;
+    io_loop_ = NETIOMANAGER->allocLoop();
+    metrics_ = new RtmpSessionMetrics(rtmpurl, dir);
 }
 
 RtmpClient::~RtmpClient() {
@@ -61,26 +54,129 @@ RtmpClient::~RtmpClient() {
     if (rtmp_transport_) {
         delete rtmp_transport_;
     }
+    if (ping_timer_) {
+        // destroyed in loop thread, close stop the timer and free it later
+        uv_close((uv_handle_t*)ping_timer_, [](uv_handle_t *handle) {
+            delete (uv_timer_t*)handle;
+        });
+    }
+    if (reconnect_timer_) {
+        uv_close((uv_handle_t*)reconnect_timer_, [](uv_handle_t *handle) {
+            delete (uv_timer_t*)handle;
+        });
+    }
+    NETIOMANAGER->releaseLoop(io_loop_);
+    delete metrics_;
 }
 
 void RtmpClient::start(uint32_t w, uint32_t h, uint32_t b) {
-    rtmp_socket_ = new NetCore::TcpSocket(NETIOMANAGER->loop_);
-    rtmp_socket_->registerCallback(this);
-    rtmp_socket_->connectServer(serveraddr_);
-    rtmp_transport_ = new RtmpMessageTransport(rtmp_socket_);
     if (dir == 0) {
         width = w;
         heigth = h;
         bitrate = b;
     }
+    // all uv handle of this session must create and use in its own loop thread
+    io_loop_->post([this]() {
+        onStart();
+    });
+}
+
+void RtmpClient::setReconnect(bool enable, int maxRetry) {
+    reconnect_ = enable;
+    reconnect_max_ = maxRetry;
 }
 
 void RtmpClient::stop() {
-    if (dir == 0) {
-        stopPushStream();
+    // timers and transport belong to loop thread
+    io_loop_->post([this]() {
+        reconnect_ = false;
+        if (reconnect_timer_) {
+            // pending backoff must not connect again
+            uv_timer_stop(reconnect_timer_);
+        }
+        if (havestop) {
+            // already tearing down
+            return;
+        }
+        if (rtmp_transport_ == nullptr) {
+            // wait for reconnect, nothing on wire, tear down like a closed connection
+            havestop = true;
+            if (dir == 0) {
+                onPublishStop();
+            }
+            else {
+                onStoped();
+            }
+            return;
+        }
+        if (dir == 0) {
+            stopPushStream();
+        }
+        else {
+            stopPullStream();
+        }
+    });
+}
+
+void RtmpClient::onStart() {
+    ping_timer_ = new uv_timer_t;
+    ping_timer_->data = static_cast<void*>(this);
+    uv_timer_init(io_loop_->loop_, ping_timer_);
+    reconnect_timer_ = new uv_timer_t;
+    reconnect_timer_->data = static_cast<void*>(this);
+    uv_timer_init(io_loop_->loop_, reconnect_timer_);
+    doConnect();
+}
+
+void RtmpClient::doConnect() {
+    rtmp_socket_ = new NetCore::TcpSocket(io_loop_->loop_);
+    rtmp_socket_->registerCallback(this);
+    rtmp_socket_->setWriteWatermark(RTMP_WRITE_HIGH_WATERMARK, RTMP_WRITE_LOW_WATERMARK, [this](bool congested) {
+        onSendCongestion(congested);
+    });
+    rtmp_socket_->connectServer(serveraddr_);
+    rtmp_transport_ = new RtmpMessageTransport(rtmp_socket_, metrics_);
+}
+
+void RtmpClient::onDisconnect() {
+    // session state is per connection, media state is kept by sub class
+    status_ = RTMP_HANDSHAKE_CLIENT_START;
+    pushPullStatus_ = RTMP_CONNECT_APP;
+    data_cache_->pop_data(data_cache_->len());
+    if (rtmp_transport_) {
+        delete rtmp_transport_;
+        rtmp_transport_ = nullptr;
     }
-    else {
-        stopPullStream();
+}
+
+void RtmpClient::scheduleReconnect() {
+    reconnect_count_++;
+    metrics_->reconnects++;
+    WLOG("rtmp connection lost, reconnect %d after %d ms\n", reconnect_count_, reconnect_delay_);
+    uv_timer_start(reconnect_timer_, &RtmpClient::on_reconnect_timer, reconnect_delay_, 0);
+    reconnect_delay_ = UTILS_MIN(reconnect_delay_ * 2, RTMP_RECONNECT_MAX_DELAY_MS);
+}
+
+void RtmpClient::on_reconnect_timer(uv_timer_t *handle) {
+    RtmpClient *client = static_cast<RtmpClient*>(handle->data);
+    // stopped while waiting
+    if (!client->reconnect_ || client->havestop) {
+        return;
+    }
+    client->doConnect();
+}
+
+void RtmpClient::onStreamStarted() {
+    reconnect_count_ = 0;
+    reconnect_delay_ = RTMP_RECONNECT_MIN_DELAY_MS;
+    rtmp_transport_->sendPing();
+    uv_timer_start(ping_timer_, &RtmpClient::on_ping_timer, RTMP_PING_INTERVAL_MS, RTMP_PING_INTERVAL_MS);
+}
+
+void RtmpClient::on_ping_timer(uv_timer_t *handle) {
+    RtmpClient *client = static_cast<RtmpClient*>(handle->data);
+    if (client->rtmp_transport_) {
+        client->rtmp_transport_->sendPing();
     }
 }
 
@@ -112,6 +208,10 @@ void RtmpClient::onPlayStart() {
 
 }
 
+void RtmpClient::onSendCongestion(bool congested) {
+
+}
+
 void RtmpClient::processPlayOrPublishPkg(RtmpBasePacket *packet)
 {
 
@@ -134,24 +234,35 @@ int RtmpClient::onConnect(int status, NetCore::BaseSocket *pSock) {
     }
     else
     {
-
+        ELOG("rtmp server connect fail\n");
+        // onClose decide reconnect or stop
+        rtmp_socket_->close();
     }
     return 0;
 }
 
 int RtmpClient::onRecvData(const char *data, int size, const struct sockaddr *addr, NetCore::BaseSocket *pSock) {
+    // all replies produced by this read are written together
+    rtmp_transport_->cork();
     if (status_ < RTMP_HANDSHAKE_CLIENT_DONE) {
         doHandshake(data, size);
     }
     else {
-        ILOG("recv %d data\n", size);
+        DLOG("recv %d data\n", size);
         processData(data, size);
     }
+    rtmp_transport_->uncork();
     return 0;
 }
 
 int RtmpClient::onClose(NetCore::BaseSocket *pSock) {
     rtmp_socket_ = nullptr;
+    uv_timer_stop(ping_timer_);
+    if (!havestop && reconnect_ && (reconnect_max_ == 0 || reconnect_count_ < reconnect_max_)) {
+        onDisconnect();
+        scheduleReconnect();
+        return 0;
+    }
     if (!havestop) {
         havestop = true;
         onPublishStop();
@@ -181,10 +292,17 @@ void RtmpClient::doHandshake(const char *data, int size) {
                 }
                 data_cache_->pop_data(3073);
                 handshake.create_c2();
-                sendData(handshake.c2, 1536);
+                // c2 share one write with connect app
+                rtmp_transport_->sendRawData((const uint8_t*)handshake.c2, 1536);
                 status_ = RTMP_HANDSHAKE_SEND_C2;
                 ILOG("rtmp handshake finish\n");
                 connectApp();
+                if (data_cache_->len() > 0) {
+                    // server data arrive together with s0s1s2
+                    int left = data_cache_->len();
+                    processData(data_cache_->data(), left);
+                    data_cache_->pop_data(left);
+                }
             }
             break;
         default:
@@ -259,28 +377,39 @@ void RtmpClient::processData(const char *data, int length)
 {
     RtmpBasePacket *packet = nullptr;
     int ret = 0;
-    data_cache_->push_data((char*)data, length);
-    while (data_cache_->len() > 0)
+    int offset = 0;
+    // transport keep partial chunk itself, socket data is parsed in place
+    while (offset < length)
     {
         packet = nullptr;
-        ret = rtmp_transport_->recvRtmpMessage(data_cache_->data(), data_cache_->len(), &packet);
+        ret = rtmp_transport_->recvRtmpMessage(data+offset, length-offset, &packet);
         if (ret < 0)
         {
+            ELOG("rtmp chunk decode error %d\n", ret);
             return;
         }
-        data_cache_->pop_data(ret);
-        if (packet != nullptr) {
-            AutoFree(RtmpBasePacket, packet);
-            if (pushPullStatus_ == RTMP_CONNECT_APP) {
-                RtmpConnectResponsePacket *pkg = dynamic_cast<RtmpConnectResponsePacket *>(packet);
-                if (pkg != nullptr) {
+        offset += ret;
+        if (packet == nullptr) {
+            continue;
+        }
+        AutoFree(RtmpBasePacket, packet);
+        switch (packet->kind) {
+            case RTMP_PACKET_AUDIO:
+            case RTMP_PACKET_VIDEO:
+            case RTMP_PACKET_AVC:
+            case RTMP_PACKET_MEDIA:
+                // media fast path, no command state check
+                processPlayOrPublishPkg(packet);
+                break;
+            case RTMP_PACKET_CONNECT_RESPONSE:
+                if (pushPullStatus_ == RTMP_CONNECT_APP) {
                     ILOG("recv connect response\n");
                     createStream(rtmp_app_);
                 }
-            }
-            else if (pushPullStatus_ == RTMP_CREATE_STREAM) {
-                RtmpCreateStreamResponsePacket *pkg = dynamic_cast<RtmpCreateStreamResponsePacket *>(packet);
-                if (pkg != nullptr) {
+                break;
+            case RTMP_PACKET_CREATE_STREAM_RESPONSE:
+                if (pushPullStatus_ == RTMP_CREATE_STREAM) {
+                    RtmpCreateStreamResponsePacket *pkg = static_cast<RtmpCreateStreamResponsePacket *>(packet);
                     ILOG("recv create stream response stream id=%d\n", (int) pkg->streamid_);
                     streamid = (int)pkg->streamid_;
                     if (dir == 0) {
@@ -290,92 +419,159 @@ void RtmpClient::processData(const char *data, int length)
                         startPullStream();
                     }
                 }
-            }
-            else if (pushPullStatus_ == RTMP_PUSH_OR_PULL) {
-                RtmpCallPacket *pkg = dynamic_cast<RtmpCallPacket *>(packet);
-                if (pkg != nullptr) {
-                    ILOG("recv call data command name=%s\n", pkg->command_name.c_str());
-                    if (pkg->command_name == "onStatus") {
-                        RtmpAmf0Object *obj = pkg->args->to_object();
-                        std::string value = obj->get_property("code")->to_str();
-                        ILOG("name=code, val=%s\n", value.c_str());
-                        if (value == "NetStream.Publish.Start") {
-                            onPublishStart();
-                        }
-                        else if (value == "NetStream.Unpublish.Success") {
-                            havestop = true;
-                            onPublishStop();
-                        }
-                        else if (value == "NetStream.Play.Start") {
-                            onPlayStart();
-                        }
-                    }
+                break;
+            case RTMP_PACKET_AMF0_VIEW:
+                if (pushPullStatus_ == RTMP_PUSH_OR_PULL) {
+                    processCommand(static_cast<RtmpAmf0ViewPacket *>(packet));
                 }
-                else {
+                break;
+            default:
+                if (pushPullStatus_ == RTMP_PUSH_OR_PULL) {
                     processPlayOrPublishPkg(packet);
                 }
-            }
+                break;
         }
     }
 }
 
+void RtmpClient::processCommand(RtmpAmf0ViewPacket *pkg)
+{
+    ILOG("recv call data command name=%s\n", pkg->command_name.c_str());
+    if (pkg->command_name != "onStatus") {
+        return;
+    }
+    // onStatus null info
+    RtmpAmf0View *info = pkg->value_at(1);
+    RtmpAmf0View *code = info ? info->get_property("code") : nullptr;
+    if (code == nullptr) {
+        return;
+    }
+    std::string value = code->to_str();
+    ILOG("name=code, val=%s\n", value.c_str());
+    if (value == "NetStream.Publish.Start") {
+        onStreamStarted();
+        onPublishStart();
+    }
+    else if (value == "NetStream.Unpublish.Success") {
+        havestop = true;
+        onPublishStop();
+    }
+    else if (value == "NetStream.Play.Start") {
+        onStreamStarted();
+        onPlayStart();
+    }
+}
 
 RtmpPublishClient::RtmpPublishClient(std::string url, bool audio) : RtmpClient(url, 0, audio) {
     video_device_ = nullptr;
     video_codec_ = nullptr;
     video_pts = video_dts = 0;
-    if (audio) {
-        audio_device_ = nullptr;
-        audio_codec_ = nullptr;
-        audio_dts = audio_pts = 0;
-    }
+    audio_device_ = nullptr;
+    audio_codec_ = nullptr;
+    audio_dts = audio_pts = 0;
+    encode_threads_ = 1;
+    encode_thread_type_ = VIDEO_CODEC_THREAD_FRAME;
+    video_source_ = "video";
+    audio_source_ = "source1_8k.pcm";
+    video_fps_ = 25;
+    publishing_ = false;
+    send_congested_ = false;
+    drop_gop_ = false;
+    chunk_size_ = RTMP_PUBLISH_MAX_CHUNK_SIZE;
+    target_bitrate_ = 0;
+    last_adjust_time_ = 0;
+    estimated_bps_ = 0;
     video_timestamp = 0;
     audio_timestamp = 0;
-    datalist.clear();
+    video_queue_ = new SpscRingQueue<MediaPacketShareData*>(RTMP_PUBLISH_VIDEO_QUEUE_SIZE);
+    audio_queue_ = new SpscRingQueue<MediaPacketShareData*>(RTMP_PUBLISH_AUDIO_QUEUE_SIZE);
 
-    timer_ = new uv_timer_t;
-    timer_->data = static_cast<void*>(this);
-    uv_timer_init(NETIOMANAGER->loop_, timer_);
+    notify_ = new uv_async_t;
+    notify_->data = static_cast<void*>(this);
 }
 
 RtmpPublishClient::~RtmpPublishClient() {
     DLOG("destroy rtmp publish client\n");
-    delete timer_;
+    delete notify_;
     if (video_device_) {
         delete video_device_;
     }
-    if (audio_device_) {
+    if (video_codec_) {
+        // join encode thread before queues are freed
         delete video_codec_;
     }
-    for (auto iter = datalist.begin(); iter != datalist.end(); ++iter) {
-        MediaPacketShareData *data = *iter;
-        if (data) {
-            delete data;
-        }
+    if (audio_codec_) {
+        delete audio_codec_;
+    }
+    MediaPacketShareData *data = nullptr;
+    while (video_queue_->pop(data)) {
+        delete data;
+    }
+    while (audio_queue_->pop(data)) {
+        delete data;
+    }
+    delete video_queue_;
+    delete audio_queue_;
+    clearGopCache();
+}
+
+void RtmpPublishClient::setVideoEncodeParam(int threads, int threadType) {
+    encode_threads_ = threads;
+    encode_thread_type_ = threadType;
+}
+
+void RtmpPublishClient::setCaptureSource(const std::string &video, const std::string &audio, int fps) {
+    video_source_ = video;
+    audio_source_ = audio;
+    if (fps > 0) {
+        video_fps_ = fps;
     }
-    datalist.clear();
+}
+
+void RtmpPublishClient::onStart() {
+    uv_async_init(io_loop_->loop_, notify_, &RtmpPublishClient::on_uv_notify);
+    RtmpClient::onStart();
 }
 
 void RtmpPublishClient::startPushStream() {
-    publish(rtmp_stream_, streamid);
+    publish(rtmp_app_, streamid);
 }
 
 void RtmpPublishClient::stopPushStream() {
-    RtmpFMLEStartPacket *pkg = RtmpFMLEStartPacket::create_release_stream(rtmp_stream_);
+    RtmpFMLEStartPacket *pkg = RtmpFMLEStartPacket::create_release_stream(rtmp_app_);
     sendRtmpPacket(pkg, streamid);
 }
 
 void RtmpPublishClient::onPublishStart() {
-    video_device_ = DevicesFactory::CreateVideoDevice("video", width, heigth, 25);
+    if (video_codec_ != nullptr) {
+        // publish again after reconnect, devices and encoder never stop,
+        // start from cached keyframe and keep timestamp going on
+        ILOG("publish resume, replay %d cached packets\n", (int)gop_cache_.size());
+        publishing_ = true;
+        rtmp_transport_->cork();
+        sendMetaData();
+        for (auto iter = gop_cache_.begin(); iter != gop_cache_.end(); ++iter) {
+            sendMediaPacket(*iter);
+        }
+        rtmp_transport_->uncork();
+        return;
+    }
+    video_device_ = DevicesFactory::CreateVideoDevice(video_source_, width, heigth, video_fps_);
     video_device_->registerVideoCallback(this);
     video_device_->Init();
 
     video_codec_ = new VideoCodec(VIDEO_CODEC_NAME);
-    video_codec_->initCodec(width, heigth, bitrate, 25);
+    video_codec_->initCodec(width, heigth, bitrate, video_fps_, encode_threads_, encode_thread_type_);
+    target_bitrate_ = bitrate;
+    metrics_->video_target_bitrate = bitrate;
+    // capture thread only hand frame to encode thread, the encode thread is the video queue producer
+    video_codec_->startEncodeThread([this](std::vector<MediaPacketShareData*> &pkts) {
+        onVideoEncoded(pkts);
+    });
     video_pts = video_dts = 0;
 
     if (audio) {
-        audio_device_ = DevicesFactory::CreateAudioDevice("audio", 8000, 16, 1, 20);
+        audio_device_ = DevicesFactory::CreateAudioDevice(audio_source_, 8000, 16, 1, 20);
         audio_device_->registerAudioCallback(this);
         audio_device_->Init();
 
@@ -383,7 +579,25 @@ void RtmpPublishClient::onPublishStart() {
         audio_codec_->initCodec(8000, 64000, 1);
         audio_dts = audio_pts = 0;
     }
+    publishing_ = true;
     sendMetaData();
+    startDevices();
+}
+
+void RtmpPublishClient::onDisconnect() {
+    // packets produced before publish again only go to gop cache
+    publishing_ = false;
+    send_congested_ = false;
+    drop_gop_ = false;
+    // new connection measure again from zero
+    estimated_bps_ = 0;
+    RtmpClient::onDisconnect();
+}
+
+void RtmpPublishClient::onSendCongestion(bool congested) {
+    WLOG("publish uplink %s, write queue %d bytes\n", congested ? "congested" : "recovered",
+         (int)rtmp_socket_->writeQueueSize());
+    send_congested_ = congested;
 }
 
 void RtmpPublishClient::onPublishStop() {
@@ -393,8 +607,10 @@ void RtmpPublishClient::onPublishStop() {
     if (audio_device_ && audio_device_->Recording()) {
         audio_device_->StopRecord();
     }
-    uv_timer_stop(timer_);
-    uv_close((uv_handle_t *) timer_, [](uv_handle_t *handle) {
+    if (video_codec_) {
+        video_codec_->stopEncodeThread();
+    }
+    uv_close((uv_handle_t *) notify_, [](uv_handle_t *handle) {
         RtmpPublishClient *data = static_cast<RtmpPublishClient *>(handle->data);
         data->onStoped();
     });
@@ -402,25 +618,30 @@ void RtmpPublishClient::onPublishStop() {
 
 int RtmpPublishClient::YuvDataIsAvailable(const void* yuvData, const uint32_t len, const int32_t width, const int32_t height)
 {
-    std::vector<MediaPacketShareData *> outpkts;
     int ret;
-    ret = video_codec_->encode((char *) yuvData, len, video_pts++, video_dts++, outpkts);
-    if (ret >= 0) {
-        if (!outpkts.empty()) {
-            for (auto iter = outpkts.begin(); iter != outpkts.end(); ++iter) {
-                MediaPacketShareData *data = *iter;
-                MediaPacketShareData *copy = data->copy();
-                {
-                    std::lock_guard<std::recursive_mutex> lock(data_mutex);
-                    datalist.push_back(copy);
-                }
-            }
-            video_codec_->freePackets(outpkts);
-        }
+    metrics_->capture_time.record(Utils::Util::getSteadyTimeUs() - video_device_->captureStartTime());
+    ret = video_codec_->pushFrame((const char *) yuvData, len, video_pts++, video_dts++);
+    if (ret < 0) {
+        WLOG_RATE(1000, "video encoder busy, drop frame\n");
+        metrics_->media_dropped++;
     }
     return 0;
 }
 
+void RtmpPublishClient::onVideoEncoded(std::vector<MediaPacketShareData*> &pkts)
+{
+    for (auto iter = pkts.begin(); iter != pkts.end(); ++iter) {
+        MediaPacketShareData *data = *iter;
+        MediaPacketShareData *copy = data->copy();
+        if (!video_queue_->push(copy)) {
+            WLOG_RATE(1000, "video queue full, drop packet\n");
+            metrics_->media_dropped++;
+            delete copy;
+        }
+    }
+    uv_async_send(notify_);
+}
+
 int RtmpPublishClient::RecordDataIsAvailable(const void* audioData,
                                   const int32_t nSamples,
                                   const int32_t nBitsPerSample,
@@ -438,12 +659,14 @@ int RtmpPublishClient::RecordDataIsAvailable(const void* audioData,
                 for (auto iter = outpkts.begin(); iter != outpkts.end(); ++iter) {
                     MediaPacketShareData *data = *iter;
                     MediaPacketShareData *copy = data->copy();
-                    {
-                        std::lock_guard<std::recursive_mutex> lock(data_mutex);
-                        datalist.push_back(copy);
+                    if (!audio_queue_->push(copy)) {
+                        WLOG_RATE(1000, "audio queue full, drop packet\n");
+                        metrics_->media_dropped++;
+                        delete copy;
                     }
                 }
                 audio_codec_->freePackets(outpkts);
+                uv_async_send(notify_);
             }
         }
     }
@@ -467,7 +690,7 @@ void RtmpPublishClient::sendMetaData()
     pkg->metadata->set("duration", RtmpAmf0Any::number(0));
     pkg->metadata->set("width", RtmpAmf0Any::number(width));
     pkg->metadata->set("height", RtmpAmf0Any::number(heigth));
-    pkg->metadata->set("framerate", RtmpAmf0Any::number(25));
+    pkg->metadata->set("framerate", RtmpAmf0Any::number(video_fps_));
     pkg->metadata->set("videocodecid", RtmpAmf0Any::number(7));
     if (audio) {
         pkg->metadata->set("audiocodecid", RtmpAmf0Any::number(8));
@@ -476,22 +699,22 @@ void RtmpPublishClient::sendMetaData()
         pkg->metadata->set("stereo", RtmpAmf0Any::boolean(false));
     }
     sendRtmpPacket(pkg, streamid);
+}
+
+void RtmpPublishClient::startDevices()
+{
     video_device_->InitRecordDevice();
     video_device_->StartRecord();
     if (audio) {
         audio_device_->InitRecordDevice();
         audio_device_->StartRecord();
     }
-    uv_timer_start(timer_, &RtmpPublishClient::on_uv_timer, 20, 20);
 }
 
 void RtmpPublishClient::publish(std::string stream, int streamid)
 {
-    if (true) {
-        RtmpSetChunkSizePacket *pkg = new RtmpSetChunkSizePacket();
-        pkg->chunk_size = 60000;
-        sendRtmpPacket(pkg, 0);
-    }
+    // start large, the bitrate controller lower it when uplink is slow
+    setChunkSize(RTMP_PUBLISH_MAX_CHUNK_SIZE);
 
     if (true) {
         RtmpPublishPacket *pkg = new RtmpPublishPacket();
@@ -501,62 +724,276 @@ void RtmpPublishClient::publish(std::string stream, int streamid)
     pushPullStatus_ = RTMP_PUSH_OR_PULL;
 }
 
-void RtmpPublishClient::onTimer()
+void RtmpPublishClient::setChunkSize(int size)
 {
-    std::lock_guard<std::recursive_mutex> lock(data_mutex);
-    while (datalist.size() > 0)
-    {
-        MediaPacketShareData *share = datalist.front();
-        MediaPacketShareData::MediaPacketData *media = share->mediaPacketData;
-        if (media != nullptr) {
-            if (media->type == 1) {
-                // video
-                VideoMediaPacketData *data = dynamic_cast<VideoMediaPacketData*>(media->media);
-                if (data != nullptr) {
-                    if (data->keyframe_) {
-                        RtmpAVCPacket *pkg = new RtmpAVCPacket(data->spslen_, data->ppslen_);
-                        memcpy(pkg->sps, data->sps_, data->spslen_);
-                        memcpy(pkg->pps, data->pps_, data->ppslen_);
-                        sendRtmpPacket(pkg, streamid);
-                    }
-                    RtmpVideoPacket *pkg = new RtmpVideoPacket(data->datalen_);
+    RtmpSetChunkSizePacket *pkg = new RtmpSetChunkSizePacket();
+    pkg->chunk_size = size;
+    // transport split with new size right after this message
+    sendRtmpPacket(pkg, 0);
+    chunk_size_ = size;
+}
+
+void RtmpPublishClient::adjustBitrate()
+{
+    int64_t now = Utils::Util::getSteadyTimeUs();
+    uint64_t throughput;
+    uint64_t latency;
+    uint64_t target;
+    uint64_t minBitrate;
+
+    if (now - last_adjust_time_ < RTMP_BITRATE_ADJUST_INTERVAL_US) {
+        return;
+    }
+    last_adjust_time_ = now;
+    throughput = rtmp_socket_->writeThroughput() * 8;
+    latency = rtmp_socket_->writeLatencyUs();
+    if (throughput == 0) {
+        return;
+    }
+    estimated_bps_ = throughput;
+    metrics_->estimated_send_bps = throughput;
+    selectChunkSize(throughput / 8);
+    if (bitrate == 0 || video_codec_ == nullptr) {
+        return;
+    }
+    target = target_bitrate_;
+    minBitrate = bitrate / RTMP_BITRATE_MIN_DIVISOR;
+    if (send_congested_ || latency >= RTMP_WRITE_LATENCY_HIGH_US) {
+        // backoff fast, and never above what the uplink just delivered
+        target = UTILS_MIN(target * 3 / 4, throughput * 9 / 10);
+    }
+    else if (latency < RTMP_WRITE_LATENCY_HIGH_US / 4 && !drop_gop_) {
+        // probe up slowly
+        target += bitrate / 20;
+    }
+    target = UTILS_MAX(target, minBitrate);
+    target = UTILS_MIN(target, (uint64_t)bitrate);
+    if (target == target_bitrate_) {
+        return;
+    }
+    ILOG("publish bitrate %d -> %d, uplink %d bps, write latency %d us\n", (int)target_bitrate_, (int)target,
+         (int)throughput, (int)latency);
+    target_bitrate_ = (uint32_t)target;
+    metrics_->video_target_bitrate = (int64_t)target;
+    video_codec_->setBitrate((int32_t)target);
+}
+
+void RtmpPublishClient::selectChunkSize(uint64_t bytesPerSec)
+{
+    int size;
+
+    size = (int)UTILS_MIN(bytesPerSec * RTMP_CHUNK_TARGET_MS / 1000, (uint64_t)RTMP_PUBLISH_MAX_CHUNK_SIZE);
+    size = UTILS_MAX(size, RTMP_PUBLISH_MIN_CHUNK_SIZE);
+    // change only when off by 2x, so it does not flap with the estimate
+    if (size < chunk_size_ * 2 && size * 2 > chunk_size_) {
+        return;
+    }
+    ILOG("publish chunk size %d -> %d\n", chunk_size_, size);
+    setChunkSize(size);
+}
+
+void RtmpPublishClient::onMediaReady()
+{
+    MediaPacketShareData *share = nullptr;
+
+    // uv_async_send may be merged, so drain all packets every wakeup
+    metrics_->video_queue_depth = video_queue_->size();
+    metrics_->audio_queue_depth = audio_queue_->size();
+    if (publishing_) {
+        adjustBitrate();
+        rtmp_transport_->cork();
+    }
+    while (video_queue_->pop(share)) {
+        if (publishing_) {
+            if (share->mediaPacketData != nullptr) {
+                MediaData *media = share->mediaPacketData->media;
+                metrics_->recordSend(media->capture_time, media->encode_start_time, media->encode_end_time);
+            }
+            int64_t start = Utils::Util::getSteadyTimeUs();
+            sendMediaPacket(share);
+            metrics_->chunk_time.record(Utils::Util::getSteadyTimeUs() - start);
+        }
+        cacheMediaPacket(share);
+    }
+    while (audio_queue_->pop(share)) {
+        if (publishing_) {
+            sendMediaPacket(share);
+        }
+        cacheMediaPacket(share);
+    }
+    if (publishing_) {
+        rtmp_transport_->uncork();
+    }
+}
+
+void RtmpPublishClient::cacheMediaPacket(MediaPacketShareData *share)
+{
+    MediaPacketShareData::MediaPacketData *media = share->mediaPacketData;
+    bool keyframe = false;
+
+    if (media != nullptr && media->type == 1) {
+        VideoMediaPacketData *data = dynamic_cast<VideoMediaPacketData*>(media->media);
+        keyframe = (data != nullptr && data->keyframe_);
+    }
+    if (keyframe || gop_cache_.size() >= RTMP_PUBLISH_GOP_CACHE_MAX) {
+        clearGopCache();
+    }
+    // cache always start with keyframe
+    if (keyframe || !gop_cache_.empty()) {
+        gop_cache_.push_back(share);
+    }
+    else {
+        delete share;
+    }
+}
+
+void RtmpPublishClient::clearGopCache()
+{
+    for (auto iter = gop_cache_.begin(); iter != gop_cache_.end(); ++iter) {
+        delete *iter;
+    }
+    gop_cache_.clear();
+}
+
+void RtmpPublishClient::sendMediaPacket(MediaPacketShareData *share)
+{
+    MediaPacketShareData::MediaPacketData *media = share->mediaPacketData;
+    if (media != nullptr) {
+        if (media->type == 1) {
+            // video
+            VideoMediaPacketData *data = dynamic_cast<VideoMediaPacketData*>(media->media);
+            if (data != nullptr) {
+                if (data->keyframe_) {
+                    RtmpAVCPacket *pkg = new RtmpAVCPacket(data->spslen_, data->ppslen_);
+                    memcpy(pkg->sps, data->sps_, data->spslen_);
+                    memcpy(pkg->pps, data->pps_, data->ppslen_);
+                    sendRtmpPacket(pkg, streamid);
+                }
+                // from encoder frame index, one packet per frame, so fps like 30 does not drift
+                // and dropped frames keep their gap
+                video_timestamp = (uint32_t)(data->dts * 1000 / video_fps_);
+                if (dropVideoFrame(data)) {
+                    metrics_->media_dropped++;
+                }
+                else {
+                    // packet reference the encoder output buffer, no copy
+                    RtmpVideoPacket *pkg = new RtmpVideoPacket(data->buffer_);
                     pkg->timestamp = video_timestamp;
-                    video_timestamp += 40;
                     pkg->keyframe = data->keyframe_;
-                    memcpy(pkg->naluItem[0]->nalu, data->data_, data->datalen_);
                     sendRtmpPacket(pkg, streamid);
+                    metrics_->video_frames_out++;
                 }
             }
-            else if (media->type == 0) {
-                // audio
-                AudioMediaPacketData *data = dynamic_cast<AudioMediaPacketData*>(media->media);
-                if (data != nullptr) {
-                    RtmpAudioPacket *pkg = new RtmpAudioPacket(data->datalen_);
-                    pkg->timestamp = audio_timestamp;
-                    audio_timestamp += 20;
-                    memcpy(pkg->data, data->data_, data->datalen_);
-                    sendRtmpPacket(pkg, streamid);
-                }
+        }
+        else if (media->type == 0) {
+            // audio
+            AudioMediaPacketData *data = dynamic_cast<AudioMediaPacketData*>(media->media);
+            if (data != nullptr) {
+                RtmpAudioPacket *pkg = new RtmpAudioPacket(data->buffer_);
+                pkg->timestamp = audio_timestamp;
+                audio_timestamp += 20;
+                sendRtmpPacket(pkg, streamid);
             }
         }
-        datalist.pop_front();
-        delete share;
     }
 }
 
-void RtmpPublishClient::on_uv_timer(uv_timer_t *handle)
+bool RtmpPublishClient::dropVideoFrame(VideoMediaPacketData *data)
+{
+    size_t queued;
+
+    if (!send_congested_ && !drop_gop_) {
+        return false;
+    }
+    if (data->keyframe_) {
+        // new gop start only after the queue drained
+        if (drop_gop_ && send_congested_) {
+            return true;
+        }
+        drop_gop_ = false;
+    }
+    if (drop_gop_) {
+        return true;
+    }
+    queued = rtmp_socket_->writeQueueSize();
+    if (queued >= RTMP_WRITE_MAX_QUEUE) {
+        WLOG_RATE(1000, "write queue %d bytes, drop video until next keyframe\n", (int)queued);
+        drop_gop_ = true;
+        return true;
+    }
+    return false;
+}
+
+void RtmpPublishClient::on_uv_notify(uv_async_t *handle)
 {
     RtmpPublishClient *data = static_cast<RtmpPublishClient*>(handle->data);
-    data->onTimer();
+    data->onMediaReady();
 }
 
 RtmpPlayClient::RtmpPlayClient(std::string url, bool audio) : RtmpClient(url, 1, audio)
 {
-    fp = fopen("test.h264", "w");
+    recorder_ = nullptr;
+    gop_cache_ = new RtmpGopCache();
+    media_passthrough_ = false;
 }
 
 RtmpPlayClient::~RtmpPlayClient() {
+    if (recorder_) {
+        gop_cache_->detach(recorder_);
+        delete recorder_;
+    }
+    delete gop_cache_;
+}
 
+int RtmpPlayClient::setRecordFile(std::string filename, int format, int segmentMs, int64_t segmentBytes) {
+    if (recorder_) {
+        gop_cache_->detach(recorder_);
+        delete recorder_;
+    }
+    recorder_ = new RtmpRecorder(filename, format);
+    recorder_->setSegment(segmentMs, segmentBytes);
+    if (recorder_->start() < 0) {
+        ELOG("start record file %s fail\n", filename.c_str());
+        delete recorder_;
+        recorder_ = nullptr;
+        return -1;
+    }
+    // start from cached keyframe, file is written by record io thread
+    gop_cache_->attach(recorder_);
+    return 0;
+}
+
+void RtmpPlayClient::setMediaPassthrough(bool enable) {
+    media_passthrough_ = enable;
+}
+
+void RtmpPlayClient::attachConsumer(IRtmpMediaConsumer *consumer) {
+    gop_cache_->attach(consumer);
+}
+
+void RtmpPlayClient::detachConsumer(IRtmpMediaConsumer *consumer) {
+    gop_cache_->detach(consumer);
+}
+
+uint64_t RtmpPlayClient::replayConsumer(IRtmpMediaConsumer *consumer) {
+    return gop_cache_->replay(consumer);
+}
+
+void RtmpPlayClient::doConnect() {
+    RtmpClient::doConnect();
+    rtmp_transport_->setMediaPassthrough(media_passthrough_);
+    rtmp_transport_->setMediaMessageCallback([this](uint8_t type, uint32_t timestamp, SharedBuffer *body) {
+        if (type == RTMP_MSG_VideoMessage && body->len() >= 2 && !RtmpGopCache::isVideoSequenceHeader(body->data(), body->len())) {
+            metrics_->video_frames_in++;
+        }
+        gop_cache_->onMessage(type, timestamp, body);
+    });
+}
+
+void RtmpPlayClient::onDisconnect() {
+    // origin send sequence header and keyframe again after play
+    gop_cache_->clear();
+    RtmpClient::onDisconnect();
 }
 
 void RtmpPlayClient::startPullStream() {
@@ -572,23 +1009,18 @@ void RtmpPlayClient::onPlayStart() {
 }
 
 void RtmpPlayClient::processPlayOrPublishPkg(RtmpBasePacket *packet) {
-    if (dynamic_cast<RtmpVideoPacket*>(packet) != nullptr) {
-        RtmpVideoPacket *pkg = dynamic_cast<RtmpVideoPacket*>(packet);
-        //ILOG("video packet, %x, %d\n", pkg->nalu[0], pkg->nalulen);
-        for (int i = 0; i < pkg->naluItem.size(); i++) {
-            write_frame_data(pkg->naluItem[i]->nalu, pkg->naluItem[i]->nalulen);
+    // video, audio and avc header reach consumers through gop cache, nothing to do here
+    switch (packet->kind) {
+        case RTMP_PACKET_MEDIA: {
+            RtmpMediaPacket *pkg = static_cast<RtmpMediaPacket*>(packet);
+            if (pkg->is_sequence_header()) {
+                DLOG("%s sequence header, codec=%d, nalu length size=%d\n", pkg->is_video() ? "video" : "audio",
+                     pkg->codec_id, pkg->nalu_length_size);
+            }
         }
-    }
-    else if (dynamic_cast<RtmpAudioPacket*>(packet) != nullptr) {
-
-    }
-    else if (dynamic_cast<RtmpAVCPacket*>(packet) != nullptr) {
-        RtmpAVCPacket *pkg = dynamic_cast<RtmpAVCPacket*>(packet);
-        //ILOG("avc packet, %x,%d\n", pkg->sps[0],pkg->spslen);
-        write_spspps_data(pkg->sps, pkg->spslen, pkg->pps, pkg->ppslen);
-    }
-    else {
-
+            break;
+        default:
+            break;
     }
 }
 
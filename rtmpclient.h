@@ -6,16 +6,42 @@
 #define RTMP_CLIENT_RTMPCLIENT_H
 
 #include <string>
-#include <list>
+#include <deque>
 #include <mutex>
 #include "net/NetCore.h"
 #include "rtmp/rtmp_stack_handshake.h"
 #include "app_protocol/rtmp/rtmp_stack_packet.h"
 #include "rtmp_transport.h"
+#include "rtmp_metrics.h"
+#include "rtmp_gop_cache.h"
+#include "rtmp_recorder.h"
 #include "DataBuf.h"
 #include "av_device.h"
 #include "av_codec.h"
 
+const int RTMP_RECONNECT_MIN_DELAY_MS = 100;
+const int RTMP_RECONNECT_MAX_DELAY_MS = 5000;
+// client ping after stream start, measure rtt to server
+const int RTMP_PING_INTERVAL_MS = 5000;
+// packets since last keyframe, replayed after reconnect
+const int RTMP_PUBLISH_GOP_CACHE_MAX = 1024;
+const int RTMP_PUBLISH_VIDEO_QUEUE_SIZE = 256;
+const int RTMP_PUBLISH_AUDIO_QUEUE_SIZE = 256;
+// socket write queue bytes, congested above high until drained below low,
+// video gop is dropped when queue exceed max
+const size_t RTMP_WRITE_HIGH_WATERMARK = 256 * 1024;
+const size_t RTMP_WRITE_LOW_WATERMARK = 64 * 1024;
+const size_t RTMP_WRITE_MAX_QUEUE = 1024 * 1024;
+// publish bitrate follow the uplink, checked every interval and kept in [start bitrate / MIN_DIVISOR, start bitrate]
+const int64_t RTMP_BITRATE_ADJUST_INTERVAL_US = 1000 * 1000;
+const int RTMP_BITRATE_MIN_DIVISOR = 8;
+// socket write complete slower than this is treated as congestion
+const uint64_t RTMP_WRITE_LATENCY_HIGH_US = 200 * 1000;
+// one chunk carry about this much time of data, audio never wait long behind a video chunk
+const int RTMP_CHUNK_TARGET_MS = 20;
+const int RTMP_PUBLISH_MIN_CHUNK_SIZE = 4096;
+const int RTMP_PUBLISH_MAX_CHUNK_SIZE = 60000;
+
 enum RtmpClientHandshakeStatus {
     RTMP_HANDSHAKE_CLIENT_START,
     RTMP_HANDSHAKE_SEND_C0C1,
@@ -37,9 +63,21 @@ public:
 
 public:
     virtual void start(uint32_t w, uint32_t h, uint32_t b);
+    // can call in any thread, teardown run in session loop thread
     virtual void stop();
+    // reconnect with backoff when connection lost, maxRetry 0 means no limit
+    void setReconnect(bool enable, int maxRetry = 0);
+    // smoothed ping rtt to server in us, 0 before measured, can call in any thread
+    int64_t rttUs() const { return metrics_->rtt_us.load(std::memory_order_relaxed); }
+    // counters of this session, live until client destroy
+    RtmpSessionMetrics* metrics() const { return metrics_; }
 
 protected:
+    // run in io loop thread after start
+    virtual void onStart();
+    // connection lost and reconnect will be scheduled
+    virtual void onDisconnect();
+    virtual void doConnect();
     virtual void startPushStream();
     virtual void startPullStream();
     virtual void stopPushStream();
@@ -49,6 +87,8 @@ protected:
     virtual void onPublishStart();
     virtual void onPublishStop();
     virtual void onPlayStart();
+    // socket write queue cross watermark, run in loop thread
+    virtual void onSendCongestion(bool congested);
 
 protected:
     virtual void processPlayOrPublishPkg(RtmpBasePacket *packet);
@@ -61,6 +101,12 @@ protected:
 protected:
     virtual void onStoped();
 
+protected:
+    void scheduleReconnect();
+    void onStreamStarted();
+    static void on_ping_timer(uv_timer_t *handle);
+    static void on_reconnect_timer(uv_timer_t *handle);
+
 protected:
     void doHandshake(const char *data, int size);
     void connectApp();
@@ -70,6 +116,7 @@ protected:
     void sendRtmpPacket(RtmpBasePacket *pkg, int streamid);
     void sendData(const char *data, int len);
     void processData(const char *data, int length);
+    void processCommand(RtmpAmf0ViewPacket *pkg);
 
 protected:
     std::string rtmp_app_;
@@ -84,6 +131,16 @@ protected:
     bool havestop;
 
 protected:
+    bool reconnect_;
+    int reconnect_max_;
+    int reconnect_count_;
+    int reconnect_delay_;
+    uv_timer_t *reconnect_timer_;
+    uv_timer_t *ping_timer_;
+
+protected:
+    NetCore::NetIoLoop *io_loop_;
+    RtmpSessionMetrics *metrics_;
     NetCore::IPAddr serveraddr_;
     NetCore::TcpSocket *rtmp_socket_;
     DataCacheBuf *data_cache_;
@@ -102,11 +159,22 @@ public:
     RtmpPublishClient(std::string url, bool audio);
     virtual ~RtmpPublishClient();
 
+public:
+    // call before start, threads 0 auto by cpu count, threadType VideoCodecThreadType
+    void setVideoEncodeParam(int threads, int threadType);
+    // call before start, source is i420 or pcm file mapped by device, empty or missing file use generated pattern
+    void setCaptureSource(const std::string &video, const std::string &audio, int fps);
+    // bits per second the uplink deliver, 0 before measured, can call in any thread
+    uint64_t estimatedThroughput() const { return estimated_bps_.load(std::memory_order_relaxed); }
+
 protected:
+    virtual void onStart();
     virtual void startPushStream();
     virtual void stopPushStream();
     virtual void onPublishStart();
     virtual void onPublishStop();
+    virtual void onDisconnect();
+    virtual void onSendCongestion(bool congested);
 
 protected:
     virtual int YuvDataIsAvailable(const void* yuvData, const uint32_t len, const int32_t width, const int32_t height);
@@ -126,11 +194,24 @@ protected:
 
 private:
     void sendMetaData();
+    void startDevices();
     void publish(std::string stream, int streamid);
+    void setChunkSize(int size);
 
 private:
-    void onTimer();
-    static void on_uv_timer(uv_timer_t *handle);
+    void adjustBitrate();
+    void selectChunkSize(uint64_t bytesPerSec);
+
+private:
+    void onVideoEncoded(std::vector<MediaPacketShareData*> &pkts);
+    void onMediaReady();
+    void sendMediaPacket(MediaPacketShareData *share);
+    // only policy on congestion: drop from the frame the queue overflow until next keyframe,
+    // baseline stream has no b frame and every p frame is a reference, so no single frame can go
+    bool dropVideoFrame(VideoMediaPacketData *data);
+    void cacheMediaPacket(MediaPacketShareData *share);
+    void clearGopCache();
+    static void on_uv_notify(uv_async_t *handle);
 
 private:
     BaseDevices *video_device_;
@@ -143,13 +224,31 @@ private:
     int64_t audio_dts;
     uint32_t video_timestamp;
     uint32_t audio_timestamp;
+    int encode_threads_;
+    int encode_thread_type_;
+    std::string video_source_;
+    std::string audio_source_;
+    int video_fps_;
+
+private:
+    // wakeup loop thread when encoder output packet
+    uv_async_t *notify_;
 
 private:
-    uv_timer_t *timer_;
+    // filled by device threads, drained by loop thread
+    SpscRingQueue<MediaPacketShareData*> *video_queue_;
+    SpscRingQueue<MediaPacketShareData*> *audio_queue_;
 
 private:
-    std::list<MediaPacketShareData*> datalist;
-    std::recursive_mutex data_mutex;
+    // loop thread only
+    bool publishing_;
+    std::deque<MediaPacketShareData*> gop_cache_;
+    bool send_congested_;
+    bool drop_gop_;  // drop video until next keyframe
+    int chunk_size_;
+    uint32_t target_bitrate_;
+    int64_t last_adjust_time_;
+    std::atomic<uint64_t> estimated_bps_;
 };
 
 class RtmpPlayClient : public RtmpClient {
@@ -158,7 +257,20 @@ public:
     RtmpPlayClient(std::string url, bool audio);
     virtual ~RtmpPlayClient();
 
+public:
+    // record to h264 annexb or flv file, segmentMs and segmentBytes 0 means one file
+    int setRecordFile(std::string filename, int format = RTMP_RECORD_ANNEXB, int segmentMs = 0, int64_t segmentBytes = 0);
+    // local consumer start from cached keyframe, can call in any thread
+    void attachConsumer(IRtmpMediaConsumer *consumer);
+    void detachConsumer(IRtmpMediaConsumer *consumer);
+    // cached tags only, return seq of last message seen by cache
+    uint64_t replayConsumer(IRtmpMediaConsumer *consumer);
+    // consumers only need raw tags, skip nalu split, apply on next connect
+    void setMediaPassthrough(bool enable);
+
 protected:
+    virtual void doConnect();
+    virtual void onDisconnect();
     virtual void startPullStream();
     virtual void stopPullStream();
     virtual void onPlayStart();
@@ -166,6 +278,11 @@ protected:
 
 private:
     void play(std::string stream, int streamid);
+
+private:
+    RtmpRecorder *recorder_;
+    RtmpGopCache *gop_cache_;
+    bool media_passthrough_;
 };
 
 #endif //RTMP_CLIENT_RTMPCLIENT_H